@@ -0,0 +1,65 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Progress of DMA writing a circular buffer
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _DMA_RING_H_
+#define _DMA_RING_H_
+
+
+/*
+ * DMA position in a circular buffer tells where it writes, but not how many
+ * laps it has made. Interrupt handlers sample the position at least once
+ * per lap (e.g. on half and full transfer) and accumulate the distance
+ * covered, so the reader can tell data overwritten before it was read.
+ * Positions and totals are in buffer units (bytes, samples).
+ */
+typedef struct {
+	volatile unsigned int prod; /* Units written in total up to last */
+	volatile unsigned int last; /* Position at the last sample */
+} dma_ring_t;
+
+
+static inline void dma_ringReset(dma_ring_t *ring)
+{
+	ring->prod = 0;
+	ring->last = 0;
+}
+
+
+/* Called from interrupt handlers with the current DMA position */
+static inline void dma_ringSample(dma_ring_t *ring, unsigned int head, unsigned int size)
+{
+	ring->prod += (head + size - ring->last) % size;
+	ring->last = head;
+}
+
+
+/*
+ * Returns units written in total and the position they end at. Position is
+ * read by position(arg) together with the totals, so sampling in interrupts
+ * meanwhile can't make them inconsistent.
+ */
+static inline unsigned int dma_ringProduced(dma_ring_t *ring, unsigned int size, unsigned int (*position)(void *), void *arg, unsigned int *head)
+{
+	unsigned int prod, last, pos;
+
+	do {
+		prod = ring->prod;
+		last = ring->last;
+		pos = position(arg);
+	} while (prod != ring->prod);
+
+	*head = pos;
+
+	return prod + (pos + size - last) % size;
+}
+
+#endif
@@ -23,6 +23,7 @@
 #include <sys/msg.h>
 #include <sys/platform.h>
 #include <sys/threads.h>
+#include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/interrupt.h>
 #include <sys/file.h>
@@ -63,6 +64,12 @@
 
 #define MAIN_THD_PRIO           (2)
 
+#define OCRAM_BASE              (0x900000)
+#define OCRAM_END               (0x920000)
+#define OCRAM_PAGES             ((OCRAM_END - OCRAM_BASE) / SIZE_PAGE)
+#define OCRAM_MAX_ORDER         (5) /* Whole OCRAM is a single block */
+#define OCRAM_FREE              (-1)
+
 /* Buffer Descriptor Commands for Bootload scripts */
 #define SDMA_CMD_C0_SET_DM                      (0x1)
 #define SDMA_CMD_C0_GET_DM                      (0x2)
@@ -127,18 +134,21 @@ typedef enum {
 
 typedef struct {
 	int active;
-	int auto_bd_done;
 
 	sdma_buffer_desc_t *bd;
 	addr_t bd_paddr;
+	unsigned bd_head; /* Next buffer descriptor to complete */
+	unsigned bd_tail; /* Next buffer descriptor to arm */
 
 	id_t file_id;
 
 	handle_t intr_cond;
-	unsigned intr_cnt;
+	volatile sdma_channel_status_t *status;
+	unsigned bd_cnt;
 	unsigned missed_intr_cnt;
 
 	unsigned read_cnt;
+	unsigned open_cnt;
 } sdma_channel_t;
 
 struct driver_common_s
@@ -152,6 +162,10 @@ struct driver_common_s
 	sdma_channel_ctrl_t *ccb; /* Pointer to channel control block array */
 	addr_t ccb_paddr;
 
+	/* Channel progress shared with clients */
+	sdma_channel_status_t *status;
+	addr_t status_paddr;
+
 	/* Temporary buffer (uncached, with known physical address) for
 	 * loading/dumping contexts, scripts etc. */
 	size_t tmp_size;
@@ -163,7 +177,11 @@ struct driver_common_s
 	handle_t intr_cond;
 	handle_t lock;
 
-	addr_t ocram_next;
+	/* OCRAM buddy allocator, page granular */
+	struct {
+		uint8_t head[OCRAM_PAGES]; /* Block order + 1 at the first page of a block, 0 elsewhere */
+		int8_t owner[OCRAM_PAGES]; /* Channel owning the block starting here, OCRAM_FREE if none */
+	} ocram;
 
 	int stats_period_s;
 	int use_syslog;
@@ -208,11 +226,34 @@ static void sdma_enable_channel(uint8_t channel_id)
 	common.regs->HSTART = (1 << channel_id);
 }
 
-static void __attribute__((unused)) sdma_disable_channel(uint8_t channel_id)
+#define PSW_CCR_MASK                            (0x1f)
+#define PSW_CCP_MASK                            (0x7 << 5)
+
+static int sdma_disable_channel(uint8_t channel_id)
 {
-	common.regs->HSTART &= ~(1 << channel_id);
-	common.active_mask &= ~(1 << channel_id);
+	unsigned tries = 100, i;
+
+	/* Interrupt handler doesn't touch inactive channels */
 	common.channel[channel_id].active = 0;
+	common.active_mask &= ~(1 << channel_id);
+
+	/* HSTART bits only set HE, it's cleared through STOP_STAT. Without
+	 * overrides neither HE nor pending events can start the channel again */
+	common.regs->HOSTOVR &= ~(1 << channel_id);
+	common.regs->EVTOVR &= ~(1 << channel_id);
+	for (i = 0; i < NUM_OF_SDMA_REQUESTS; i++)
+		common.regs->CHNENBL[i] &= ~(1 << channel_id);
+	common.regs->STOP_STAT = (1 << channel_id);
+	common.regs->EVTPEND = (1 << channel_id);
+
+	/* Running script finishes its current step, wait until it's switched out */
+	while ((common.regs->PSW & PSW_CCP_MASK) != 0 && (common.regs->PSW & PSW_CCR_MASK) == channel_id) {
+		if (--tries == 0)
+			return -ETIME;
+		usleep(1000);
+	}
+
+	return EOK;
 }
 
 static int sdma_run_channel0_cmd(uint16_t count,
@@ -282,20 +323,111 @@ static int sdma_context_dump(uint8_t channel_id, sdma_context_t *context)
 	return EOK;
 }
 
-#define OCRAM_BASE              (0x900000)
-#define OCRAM_END               (0x920000)
+static void sdma_ocram_init(void)
+{
+	memset(common.ocram.head, 0, sizeof(common.ocram.head));
+	memset(common.ocram.owner, OCRAM_FREE, sizeof(common.ocram.owner));
+
+	common.ocram.head[0] = OCRAM_MAX_ORDER + 1;
+}
 
-addr_t sdma_ocram_alloc(size_t size)
+/* Blocks of 2^order pages are aligned to their size */
+static addr_t sdma_ocram_alloc(size_t size, int owner)
 {
-	unsigned n = (size + SIZE_PAGE - 1)/SIZE_PAGE;
-	addr_t paddr = 0;
+	unsigned p, best = OCRAM_PAGES, order = 0;
 
-	if (common.ocram_next + n*SIZE_PAGE <= OCRAM_END) {
-		paddr = common.ocram_next;
-		common.ocram_next += n*SIZE_PAGE;
+	while ((SIZE_PAGE << order) < size) {
+		if (++order > OCRAM_MAX_ORDER)
+			return 0;
 	}
 
-	return paddr;
+	/* Smallest free block which fits */
+	for (p = 0; p < OCRAM_PAGES; p += 1 << (common.ocram.head[p] - 1)) {
+		if (common.ocram.owner[p] != OCRAM_FREE || common.ocram.head[p] - 1 < order)
+			continue;
+		if (best == OCRAM_PAGES || common.ocram.head[p] < common.ocram.head[best])
+			best = p;
+	}
+
+	if (best == OCRAM_PAGES)
+		return 0;
+
+	/* Split, upper halves stay free */
+	while (common.ocram.head[best] - 1 > order) {
+		common.ocram.head[best]--;
+		common.ocram.head[best + (1 << (common.ocram.head[best] - 1))] = common.ocram.head[best];
+	}
+
+	common.ocram.owner[best] = owner;
+
+	return OCRAM_BASE + best * SIZE_PAGE;
+}
+
+static int sdma_ocram_free(addr_t paddr, int owner)
+{
+	unsigned p, buddy, order;
+
+	if (paddr < OCRAM_BASE || paddr >= OCRAM_END || (paddr & (SIZE_PAGE - 1)))
+		return -EINVAL;
+
+	p = (paddr - OCRAM_BASE) / SIZE_PAGE;
+	if (!common.ocram.head[p] || common.ocram.owner[p] == OCRAM_FREE)
+		return -EINVAL;
+
+	if (owner >= 0 && common.ocram.owner[p] != owner)
+		return -EPERM;
+
+	common.ocram.owner[p] = OCRAM_FREE;
+
+	/* Merge with free buddies of the same size */
+	for (order = common.ocram.head[p] - 1; order < OCRAM_MAX_ORDER; order++) {
+		buddy = p ^ (1 << order);
+		if (common.ocram.head[buddy] != order + 1 || common.ocram.owner[buddy] != OCRAM_FREE)
+			break;
+
+		common.ocram.head[p | buddy] = 0;
+		p &= buddy;
+		common.ocram.head[p] = order + 2;
+	}
+
+	return EOK;
+}
+
+/* Releases blocks of a channel nobody has open anymore */
+static void sdma_ocram_reclaim(int owner)
+{
+	unsigned p;
+
+	for (p = 0; p < OCRAM_PAGES; p++) {
+		/* Merging touches only free blocks, so the scan can go on */
+		if (common.ocram.head[p] && common.ocram.owner[p] == owner)
+			sdma_ocram_free(OCRAM_BASE + p * SIZE_PAGE, owner);
+	}
+}
+
+static void sdma_ocram_stats(sdma_ocram_stats_t *stats, int owner)
+{
+	unsigned p;
+	size_t size;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->total = OCRAM_END - OCRAM_BASE;
+
+	for (p = 0; p < OCRAM_PAGES; p += 1 << (common.ocram.head[p] - 1)) {
+		size = SIZE_PAGE << (common.ocram.head[p] - 1);
+
+		if (common.ocram.owner[p] == OCRAM_FREE) {
+			stats->free_blocks++;
+			if (size > stats->largest)
+				stats->largest = size;
+			continue;
+		}
+
+		stats->used += size;
+		stats->used_blocks++;
+		if (common.ocram.owner[p] == owner)
+			stats->owned += size;
+	}
 }
 
 void *sdma_alloc_uncached(size_t size, addr_t *paddr, int ocram)
@@ -306,14 +438,17 @@ void *sdma_alloc_uncached(size_t size, addr_t *paddr, int ocram)
 
 	if (ocram) {
 		oid = OID_PHYSMEM;
-		_paddr = sdma_ocram_alloc(n*SIZE_PAGE);
+		_paddr = sdma_ocram_alloc(n*SIZE_PAGE, 0);
 		if (!_paddr)
 			return NULL;
 	}
 
 	void *vaddr = mmap(NULL, n*SIZE_PAGE, PROT_READ | PROT_WRITE, MAP_UNCACHED, oid, _paddr);
-	if (vaddr == MAP_FAILED)
+	if (vaddr == MAP_FAILED) {
+		if (ocram)
+			sdma_ocram_free(_paddr, 0);
 		return NULL;
+	}
 
 	if (!ocram)
 		_paddr = va2pa(vaddr);
@@ -375,16 +510,23 @@ static int sdma_intr(unsigned int intr, void *arg)
 			/* Check if channel is active and it's interrupt flag is set */
 			if (_INTR & (1 << i) && cmn->channel[i].active) {
 
-				/* Set BD_DONE in all buffer descriptors */
-				sdma_buffer_desc_t *current = cmn->channel[i].bd;
-				do {
-					if (!(current->flags & SDMA_BD_DONE))
-						current->flags |= SDMA_BD_DONE;
-				} while (!((current++)->flags & SDMA_BD_WRAP));
+				/* Retire descriptors given back by the hardware, in ring order */
+				sdma_channel_t *ch = &cmn->channel[i];
+				uint32_t done = ch->status->bd_done;
+
+				while (done != ch->status->bd_armed && !(ch->bd[ch->bd_head].flags & SDMA_BD_DONE)) {
+					ch->bd_head = (ch->bd_head + 1 == ch->bd_cnt) ? 0 : ch->bd_head + 1;
+					done++;
+				}
 
-				/* Increase interrupt count to notify dispatcher that interrupt for
-				 * this channel occurred */
-				cmn->channel[i].intr_cnt++;
+				ch->status->bd_done = done;
+
+				/* Clients read bd_done after seeing the interrupt count change */
+				__sync_synchronize();
+
+				/* Increase interrupt count to notify dispatcher and clients that
+				 * interrupt for this channel occurred */
+				cmn->channel[i].status->intr_cnt++;
 			}
 		}
 	}
@@ -399,6 +541,15 @@ static int sdma_init_structs(void)
 	for (i = 0; i < NUM_OF_SDMA_CHANNELS; i++)
 		common.channel[i].active = 0;
 
+	common.status = sdma_alloc_uncached(sizeof(sdma_channel_status_t) * NUM_OF_SDMA_CHANNELS, &common.status_paddr, 0);
+	if (common.status == NULL)
+		return -ENOMEM;
+
+	memset(common.status, 0, sizeof(sdma_channel_status_t) * NUM_OF_SDMA_CHANNELS);
+
+	for (i = 0; i < NUM_OF_SDMA_CHANNELS; i++)
+		common.channel[i].status = &common.status[i];
+
 	common.ccb = sdma_alloc_uncached(sizeof(sdma_channel_ctrl_t) * NUM_OF_SDMA_CHANNELS, &common.ccb_paddr, 1);
 	if (common.ccb == NULL)
 		goto fail;
@@ -417,6 +568,7 @@ static int sdma_init_structs(void)
 	return 0;
 
 fail:
+	sdma_free_uncached(common.status, sizeof(sdma_channel_status_t) * NUM_OF_SDMA_CHANNELS);
 	if (common.ccb != NULL) sdma_free_uncached(common.ccb, sizeof(sdma_channel_ctrl_t) * NUM_OF_SDMA_CHANNELS);
 	if (common.channel[0].bd != NULL) sdma_free_uncached(common.channel[0].bd, sizeof(sdma_buffer_desc_t));
 	if (common.tmp != NULL) sdma_free_uncached(common.tmp, SIZE_PAGE);
@@ -524,6 +676,45 @@ static int sdma_init(void)
 	return 0;
 }
 
+/* Takes over descriptors the client armed by setting BD_DONE itself */
+static void sdma_bd_sync(uint8_t channel_id)
+{
+	sdma_channel_t *ch = &common.channel[channel_id];
+
+	while (ch->status->bd_armed - ch->status->bd_done < ch->bd_cnt && (ch->bd[ch->bd_tail].flags & SDMA_BD_DONE)) {
+		ch->bd_tail = (ch->bd_tail + 1 == ch->bd_cnt) ? 0 : ch->bd_tail + 1;
+		ch->status->bd_armed++;
+	}
+}
+
+static int sdma_bd_rearm(uint8_t channel_id, unsigned cnt)
+{
+	sdma_channel_t *ch = &common.channel[channel_id];
+
+	if (ch->bd == NULL)
+		return -EINVAL;
+
+	/* Only descriptors the hardware gave back can be armed again */
+	if (cnt > ch->bd_cnt - (ch->status->bd_armed - ch->status->bd_done))
+		return -EINVAL;
+
+	while (cnt-- > 0) {
+		/* Client filled the descriptor before asking, flags go last */
+		ch->bd[ch->bd_tail].flags |= SDMA_BD_DONE;
+		ch->bd_tail = (ch->bd_tail + 1 == ch->bd_cnt) ? 0 : ch->bd_tail + 1;
+
+		/* Descriptor is armed before the client can see it counted */
+		__sync_synchronize();
+		ch->status->bd_armed++;
+	}
+
+	/* Restart the channel in case it ran out of descriptors, no-op if it is running */
+	if (ch->active)
+		common.regs->HSTART = (1 << channel_id);
+
+	return EOK;
+}
+
 static int sdma_set_bd_array(uint8_t channel_id, addr_t paddr, unsigned cnt)
 {
 	sdma_buffer_desc_t *bd;
@@ -538,10 +729,16 @@ static int sdma_set_bd_array(uint8_t channel_id, addr_t paddr, unsigned cnt)
 
 	common.channel[channel_id].bd = bd;
 	common.channel[channel_id].bd_paddr = paddr;
+	common.channel[channel_id].bd_cnt = cnt;
+	common.channel[channel_id].bd_head = 0;
+	common.channel[channel_id].bd_tail = 0;
+	common.channel[channel_id].status->bd_armed = common.channel[channel_id].status->bd_done;
 
 	common.ccb[channel_id].base_bd = paddr;
 	common.ccb[channel_id].current_bd = paddr;
 
+	sdma_bd_sync(channel_id);
+
 	/* TODO: mmap buffers */
 
 	/* TODO: Error handlig (unmap what was already mapped) */
@@ -620,32 +817,73 @@ static int dev_init(void)
 	return 0;
 }
 
-static int dev_open(oid_t *oid, int flags)
+static int oid_to_channel(oid_t *oid)
 {
-	return EOK;
+	return oid->id;
 }
 
-static int dev_close(oid_t *oid, int flags)
+static int dev_open(oid_t *oid, int flags)
 {
-	/* TODO: unmap buffer descriptor array and buffers */
+	mutexLock(common.lock);
+	common.channel[oid_to_channel(oid)].open_cnt++;
+	mutexUnlock(common.lock);
 
 	return EOK;
 }
 
-static int oid_to_channel(oid_t *oid)
+static int dev_close(oid_t *oid, int flags)
 {
-	return oid->id;
+	int channel = oid_to_channel(oid);
+	sdma_channel_t *ch = &common.channel[channel];
+	size_t size;
+
+	mutexLock(common.lock);
+	if (ch->open_cnt > 0 && --ch->open_cnt == 0) {
+		/* Channel has to be stopped before its descriptors and OCRAM go away */
+		if (sdma_disable_channel(channel) < 0) {
+			log_error("dev_close: channel %d didn't stop, keeping its memory", channel);
+		}
+		else {
+			if (ch->bd != NULL) {
+				size = ch->bd_cnt * sizeof(sdma_buffer_desc_t);
+				munmap(ch->bd, ((size + SIZE_PAGE - 1) / SIZE_PAGE) * SIZE_PAGE);
+				ch->bd = NULL;
+				ch->bd_cnt = 0;
+			}
+			sdma_ocram_reclaim(channel);
+		}
+	}
+	mutexUnlock(common.lock);
+
+	return EOK;
 }
 
-static int dev_read(oid_t *oid, void *data, size_t size)
+/* Blocks until interrupt count differs from seen (up to timeout us, 0 - forever), returns the current one */
+static int dev_read(oid_t *oid, void *data, size_t size, unsigned seen, time_t timeout)
 {
 	int channel = oid_to_channel(oid);
 	unsigned intr_cnt;
+	time_t now, end = 0;
 
-	mutexLock(common.lock);
-	condWait(common.channel[channel].intr_cond, common.lock, 0);
+	if (timeout != 0) {
+		gettime(&now, NULL);
+		end = now + timeout;
+	}
 
-	intr_cnt = common.channel[channel].intr_cnt;
+	mutexLock(common.lock);
+	while ((intr_cnt = common.channel[channel].status->intr_cnt) == seen) {
+		if (timeout != 0) {
+			gettime(&now, NULL);
+			if (now >= end) {
+				mutexUnlock(common.lock);
+				return -ETIME;
+			}
+			condWait(common.channel[channel].intr_cond, common.lock, end - now);
+		}
+		else {
+			condWait(common.channel[channel].intr_cond, common.lock, 0);
+		}
+	}
 
 	mutexUnlock(common.lock);
 
@@ -716,11 +954,30 @@ static int dev_ctl(msg_t *msg)
 			return sdma_context_load(channel, context);
 
 		case sdma_dev_ctl__enable:
+			if (common.channel[channel].bd != NULL)
+				sdma_bd_sync(channel);
 			sdma_enable_channel(channel);
 			return EOK;
 
+		case sdma_dev_ctl__rearm:
+			return sdma_bd_rearm(channel, dev_ctl.bd.cnt);
+
 		case sdma_dev_ctl__ocram_alloc:
-			dev_ctl.alloc.paddr = sdma_ocram_alloc(dev_ctl.alloc.size);
+			dev_ctl.alloc.paddr = sdma_ocram_alloc(dev_ctl.alloc.size, channel);
+			memcpy(msg->o.raw, &dev_ctl, sizeof(sdma_dev_ctl_t));
+			return EOK;
+
+		case sdma_dev_ctl__ocram_free:
+			return sdma_ocram_free(dev_ctl.alloc.paddr, channel);
+
+		case sdma_dev_ctl__ocram_stats:
+			sdma_ocram_stats(&dev_ctl.ocram, channel);
+			memcpy(msg->o.raw, &dev_ctl, sizeof(sdma_dev_ctl_t));
+			return EOK;
+
+		case sdma_dev_ctl__status:
+			dev_ctl.status.paddr = common.status_paddr;
+			dev_ctl.status.offs = channel * sizeof(sdma_channel_status_t);
 			memcpy(msg->o.raw, &dev_ctl, sizeof(sdma_dev_ctl_t));
 			return EOK;
 
@@ -753,7 +1010,7 @@ static void worker_thread(void *arg)
 				break;
 
 			case mtRead:
-				msg.o.io.err = dev_read(&msg.i.io.oid, msg.o.data, msg.o.size);
+				msg.o.io.err = dev_read(&msg.i.io.oid, msg.o.data, msg.o.size, (unsigned)msg.i.io.offs, (time_t)msg.i.io.len);
 				break;
 
 			case mtWrite:
@@ -785,7 +1042,7 @@ static void stats_thread(void *arg)
 			if (!common.channel[i].active)
 				continue;
 
-			intr_cnt = common.channel[i].intr_cnt;
+			intr_cnt = common.channel[i].status->intr_cnt;
 			missed_cnt = common.channel[i].missed_intr_cnt;
 			read_cnt = common.channel[i].read_cnt;
 
@@ -798,7 +1055,7 @@ static int init(void)
 {
 	int res, i;
 
-	common.ocram_next = OCRAM_BASE;
+	sdma_ocram_init();
 
 	if (common.use_syslog)
 		openlog("sdma-driver", LOG_NDELAY, LOG_DAEMON);
@@ -814,7 +1071,6 @@ static int init(void)
 	}
 
 	for (i = 0; i < NUM_OF_SDMA_CHANNELS; i++) {
-		common.channel[i].intr_cnt = 0;
 		common.channel[i].read_cnt = 0;
 		common.channel[i].missed_intr_cnt = 0;
 		if (condCreate(&common.channel[i].intr_cond) != EOK) {
@@ -911,7 +1167,9 @@ static void dump_debug_info(void)
 
 		fprintf(f, "Channel %u is active\n", i);
 
-		fprintf(f, "intr_cnt   = %u\n", common.channel[i].intr_cnt);
+		fprintf(f, "intr_cnt   = %u\n", common.channel[i].status->intr_cnt);
+		fprintf(f, "bd_done    = %u\n", common.channel[i].status->bd_done);
+		fprintf(f, "bd_armed   = %u\n", common.channel[i].status->bd_armed);
 		fprintf(f, "missed_cnt = %u\n", common.channel[i].missed_intr_cnt);
 		fprintf(f, "priority   = %u\n\n", common.regs->SDMA_CHNPRI[i]);
 
@@ -1073,7 +1331,7 @@ int main(int argc, char *argv[])
 		}
 
 		for (i = 0; i < NUM_OF_SDMA_CHANNELS; i++) {
-			cnt = common.channel[i].intr_cnt;
+			cnt = common.channel[i].status->intr_cnt;
 
 			if (intr_cnt[i] == cnt) /* No interrupts for this channel */
 				continue;
@@ -1086,7 +1344,7 @@ int main(int argc, char *argv[])
 #endif
 			}
 
-			condSignal(common.channel[i].intr_cond);
+			condBroadcast(common.channel[i].intr_cond);
 			intr_cnt[i] = cnt;
 		}
 
@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <sys/msg.h>
 #include <sys/mman.h>
@@ -46,6 +47,24 @@ static int sdma_dev_ctl(sdma_t *s, sdma_dev_ctl_t *dev_ctl, void *data, size_t s
 	return 0;
 }
 
+static volatile sdma_channel_status_t *sdma_map_status(sdma_t *s)
+{
+	sdma_dev_ctl_t dev_ctl;
+	void *page;
+
+	dev_ctl.oid = s->oid;
+	dev_ctl.type = sdma_dev_ctl__status;
+
+	if (sdma_dev_ctl(s, &dev_ctl, NULL, 0) < 0)
+		return NULL;
+
+	page = mmap(NULL, SIZE_PAGE, PROT_READ, MAP_UNCACHED, OID_PHYSMEM, dev_ctl.status.paddr);
+	if (page == MAP_FAILED)
+		return NULL;
+
+	return (volatile sdma_channel_status_t *)((char *)page + dev_ctl.status.offs);
+}
+
 int sdma_open(sdma_t *s, const char *dev_name)
 {
 	int fd, res;
@@ -55,17 +74,28 @@ int sdma_open(sdma_t *s, const char *dev_name)
 	if ((fd = open(dev_name, O_RDWR)) < 0)
 		return -2;
 
-	if ((res = lookup(dev_name, NULL, &s->oid)) < 0)
+	if ((res = lookup(dev_name, NULL, &s->oid)) < 0) {
+		close(fd);
 		return -3;
+	}
+
+	s->fd = fd;
+
+	s->status = sdma_map_status(s);
+	s->intr_seen = (s->status != NULL) ? s->status->intr_cnt : 0;
 
 	return 0;
 }
 
 int sdma_close(sdma_t *s)
 {
-	/* TODO: Implement sdma_channel_close */
+	if (s->status != NULL) {
+		munmap((void *)((addr_t)s->status & ~(SIZE_PAGE - 1)), SIZE_PAGE);
+		s->status = NULL;
+	}
 
-	return 0;
+	/* Last close of the channel releases its OCRAM */
+	return close(s->fd);
 }
 
 int sdma_channel_configure(sdma_t *s, sdma_channel_config_t *cfg)
@@ -133,6 +163,17 @@ int sdma_enable(sdma_t *s)
 	return sdma_dev_ctl(s, &dev_ctl, NULL, 0);
 }
 
+int sdma_rearm(sdma_t *s, unsigned cnt)
+{
+	sdma_dev_ctl_t dev_ctl;
+
+	dev_ctl.oid = s->oid;
+	dev_ctl.type = sdma_dev_ctl__rearm;
+	dev_ctl.bd.cnt = cnt;
+
+	return sdma_dev_ctl(s, &dev_ctl, NULL, 0);
+}
+
 int sdma_trigger(sdma_t *s)
 {
 	sdma_dev_ctl_t dev_ctl;
@@ -144,25 +185,48 @@ int sdma_trigger(sdma_t *s)
 }
 
 int sdma_wait_for_intr(sdma_t *s, uint32_t *cnt)
+{
+	return sdma_wait_for_intr_timeout(s, cnt, 0);
+}
+
+int sdma_wait_for_intr_timeout(sdma_t *s, uint32_t *cnt, time_t timeout)
 {
 	int res;
 	msg_t msg;
+	uint32_t intr_cnt;
 
+	/* Interrupts since the last call are already visible, no need to ask */
+	if (s->status != NULL && (intr_cnt = sdma_intr_cnt(s)) != s->intr_seen) {
+		s->intr_seen = intr_cnt;
+		if (cnt != NULL)
+			*cnt = intr_cnt;
+		return 0;
+	}
+
+	/* Server blocks until the count differs from the one passed in offs, at most len us */
 	msg.type = mtRead;
 	msg.o.size = sizeof(uint32_t);
-	msg.o.data = cnt;
+	msg.o.data = &intr_cnt;
 	msg.i.size = 0;
 	msg.i.data = NULL;
 	msg.i.io.oid = s->oid;
+	msg.i.io.offs = s->intr_seen;
+	msg.i.io.len = timeout;
 
 	if ((res = msgSend(s->oid.port, &msg)) < 0) {
 		fprintf(stderr, "msgSend failed (%d)\n\r", res);
 		return -1;
+	} else if (msg.o.io.err == -ETIME) {
+		return -ETIME;
 	} else if (msg.o.io.err != EOK) {
 		fprintf(stderr, "read failed (%d)\n\r", msg.o.io.err);
 		return -2;
 	}
 
+	s->intr_seen = intr_cnt;
+	if (cnt != NULL)
+		*cnt = intr_cnt;
+
 	return 0;
 }
 
@@ -185,6 +249,35 @@ addr_t sdma_ocram_alloc(sdma_t *s, size_t size)
 }
 
 
+int sdma_ocram_free(sdma_t *s, addr_t paddr)
+{
+	sdma_dev_ctl_t dev_ctl;
+
+	dev_ctl.oid = s->oid;
+	dev_ctl.type = sdma_dev_ctl__ocram_free;
+	dev_ctl.alloc.paddr = paddr;
+
+	return sdma_dev_ctl(s, &dev_ctl, NULL, 0);
+}
+
+
+int sdma_ocram_stats(sdma_t *s, sdma_ocram_stats_t *stats)
+{
+	int res;
+	sdma_dev_ctl_t dev_ctl;
+
+	dev_ctl.oid = s->oid;
+	dev_ctl.type = sdma_dev_ctl__ocram_stats;
+
+	if ((res = sdma_dev_ctl(s, &dev_ctl, NULL, 0)) < 0)
+		return res;
+
+	*stats = dev_ctl.ocram;
+
+	return 0;
+}
+
+
 void *sdma_alloc_uncached(sdma_t *s, size_t size, addr_t *paddr, int ocram)
 {
 	uint32_t n = (size + SIZE_PAGE - 1)/SIZE_PAGE;
@@ -199,8 +292,11 @@ void *sdma_alloc_uncached(sdma_t *s, size_t size, addr_t *paddr, int ocram)
 	}
 
 	void *vaddr = mmap(NULL, n*SIZE_PAGE, PROT_READ | PROT_WRITE, MAP_UNCACHED, oid, _paddr);
-	if (vaddr == MAP_FAILED)
+	if (vaddr == MAP_FAILED) {
+		if (ocram)
+			sdma_ocram_free(s, _paddr);
 		return NULL;
+	}
 
 	if (!ocram)
 		_paddr = va2pa(vaddr);
@@ -112,6 +112,20 @@ typedef struct {
 	unsigned priority;
 } sdma_channel_config_t;
 
+/* Channel progress, shared read-only with the client (see sdma_dev_ctl__status).
+ * Descriptors are completed and armed in ring order: the hardware owns bd_armed - bd_done
+ * of them, starting from the one after the last completed. A client keeps its own ring
+ * index and advances it by the change of bd_done to find exactly which ones completed.
+ * Completed descriptors are retired only in the channel interrupt, so every descriptor
+ * has to have SDMA_BD_INTR set for the counters to be valid. Channels without it (e.g.
+ * ECSPI TX, whose completion is implied by RX) never advance bd_done, their bd_armed
+ * stops at bd_cnt and sdma_rearm() can't be used on them. */
+typedef struct {
+	volatile uint32_t intr_cnt; /* Interrupts so far */
+	volatile uint32_t bd_done; /* Buffer descriptors completed so far */
+	volatile uint32_t bd_armed; /* Buffer descriptors handed to the hardware so far */
+} sdma_channel_status_t;
+
 typedef enum {
 	sdma_dev_ctl__channel_cfg,
 	sdma_dev_ctl__data_mem_write,
@@ -120,9 +134,23 @@ typedef enum {
 	sdma_dev_ctl__context_set,
 	sdma_dev_ctl__enable,
 	sdma_dev_ctl__trigger,
-	sdma_dev_ctl__ocram_alloc
+	sdma_dev_ctl__ocram_alloc,
+	sdma_dev_ctl__status,
+	sdma_dev_ctl__ocram_free,
+	sdma_dev_ctl__ocram_stats,
+	sdma_dev_ctl__rearm
 } sdma_dev_ctl_type_t;
 
+/* OCRAM usage, fragmentation shows as largest free block much smaller than total - used */
+typedef struct {
+	size_t total;
+	size_t used;
+	size_t owned; /* Used by the channel asking */
+	size_t largest; /* Largest free block */
+	unsigned used_blocks;
+	unsigned free_blocks;
+} sdma_ocram_stats_t;
+
 typedef struct {
 	sdma_dev_ctl_type_t type;
 	oid_t oid;
@@ -140,6 +168,17 @@ typedef struct {
 			size_t size;
 			addr_t paddr;
 		} alloc;
+
+		struct {
+			addr_t paddr; /* Page with sdma_channel_status_t of all channels */
+			size_t offs;
+		} status;
+
+		sdma_ocram_stats_t ocram;
+
+		struct {
+			unsigned cnt; /* Completed descriptors to arm again, in ring order */
+		} bd;
 	};
 } sdma_dev_ctl_t;
 
@@ -18,6 +18,10 @@
 
 typedef struct {
 	oid_t oid;
+	int fd;
+
+	volatile sdma_channel_status_t *status;
+	uint32_t intr_seen;
 } sdma_t;
 
 int sdma_open(sdma_t *s, const char *dev_name);
@@ -34,9 +38,45 @@ int sdma_context_set(sdma_t *s, const sdma_context_t *ctx);
 int sdma_enable(sdma_t *s);
 int sdma_trigger(sdma_t *s);
 
-/* cnt - number of interrupts for this channel registered up until this point */
+/* Waits for interrupts not seen by previous calls (returns at once if there are any),
+ * cnt - number of interrupts for this channel registered up until this point */
 int sdma_wait_for_intr(sdma_t *s, uint32_t *cnt);
 
+/* As above, returns -ETIME if no interrupt came in timeout us (0 - wait forever) */
+int sdma_wait_for_intr_timeout(sdma_t *s, uint32_t *cnt, time_t timeout);
+
+/* Progress of the channel without IPC, valid only if s->status != NULL */
+static inline uint32_t sdma_intr_cnt(sdma_t *s)
+{
+	uint32_t cnt = s->status->intr_cnt;
+
+	/* bd_done read afterwards is at least as recent (pairs with the interrupt handler) */
+	__sync_synchronize();
+
+	return cnt;
+}
+
+static inline uint32_t sdma_bd_done(sdma_t *s)
+{
+	return s->status->bd_done;
+}
+
+static inline uint32_t sdma_bd_armed(sdma_t *s)
+{
+	return s->status->bd_armed;
+}
+
+/* Hands cnt completed descriptors back to the hardware in ring order, without stopping
+ * the channel. Descriptors have to be filled in (except for BD_DONE) before the call,
+ * and all of them need SDMA_BD_INTR (see sdma_channel_status_t) */
+int sdma_rearm(sdma_t *s, unsigned cnt);
+
+/* OCRAM is allocated in power of 2 pages blocks aligned to their size. Blocks are owned
+ * by the channel and released when the last descriptor of the channel is closed */
+addr_t sdma_ocram_alloc(sdma_t *s, size_t size);
+int sdma_ocram_free(sdma_t *s, addr_t paddr);
+int sdma_ocram_stats(sdma_t *s, sdma_ocram_stats_t *stats);
+
 void *sdma_alloc_uncached(sdma_t *s, size_t size, addr_t *paddr, int ocram);
 int sdma_free_uncached(void *vaddr, size_t size);
 
@@ -67,6 +67,15 @@ uint8_t edma_get_tcd_attr_xsize(uint8_t num_of_bytes);
 /* Checks if there is a pending hardware request for given channel */
 int edma_is_hw_req_pending(unsigned channel);
 
+/* Returns current major loop iteration count of given channel */
+uint16_t edma_get_citer(unsigned channel);
+
+/* Checks if major loop of given channel has completed */
+int edma_is_done(unsigned channel);
+
+/* Returns bitmask of channels with error flag set */
+uint32_t edma_get_errors(void);
+
 void edma_channel_enable(unsigned channel);
 void edma_channel_disable(unsigned channel);
 
@@ -235,6 +235,21 @@ int edma_is_hw_req_pending(unsigned channel)
 	return edma_regs->hrs & (1 << channel);
 }
 
+uint16_t edma_get_citer(unsigned channel)
+{
+	return edma_regs->tcd[channel].citer_elinkno & 0x7fff;
+}
+
+int edma_is_done(unsigned channel)
+{
+	return !!(edma_regs->tcd[channel].csr & (1 << 7));
+}
+
+uint32_t edma_get_errors(void)
+{
+	return edma_regs->err;
+}
+
 void edma_channel_enable(unsigned channel)
 {
 	edma_regs->serq = channel | (1 << 6);
@@ -12,16 +12,20 @@
  */
 
 #include <errno.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/msg.h>
 #include <sys/threads.h>
 #include <sys/mman.h>
 #include <sys/msg.h>
 #include <sys/file.h>
+#include <sys/interrupt.h>
 #include <sys/platform.h>
 #include <posix/utils.h>
 #include <phoenix/arch/imx6ull.h>
@@ -29,32 +33,245 @@
 #include "imx6ull-gpio.h"
 
 
-enum { gpio1 = 0, gpio2, gpio3, gpio4, gpio5, dir1, dir2, dir3, dir4, dir5 };
+/* Has to be power of 2 */
+#define GPIO_EVENTS 32
+#define GPIO_READERS 4
+
+/* Server waits for shared port lock this many times 1 us at most */
+#define GPIO_LOCK_TRIES 1000
+#define GPIO_LOCK_SERVER ((unsigned int)-1)
+
+
+enum { gpio1 = 0, gpio2, gpio3, gpio4, gpio5, dir1, dir2, dir3, dir4, dir5, event1, event2, event3, event4, event5 };
 
 
 enum { dr = 0, gdir, psr, icr1, icr2, imr, isr, edge };
 
 
+/* GPT2 counts microseconds for event timestamps, GPT1 and EPITs belong to the kernel */
+enum { gpt_cr = 0, gpt_pr, gpt_sr, gpt_ir, gpt_ocr1, gpt_ocr2, gpt_ocr3, gpt_icr1, gpt_icr2, gpt_cnt };
+
+
+typedef struct {
+	volatile unsigned int head;   /* written by interrupt handler */
+	unsigned int stamped;         /* events before this one have timestamp */
+	unsigned int tail;
+	volatile unsigned int overflow;
+	uint32_t level;               /* pins with level triggered interrupt */
+	volatile uint32_t imrshadow;  /* IMR value, changed atomically by interrupt handler and threads */
+	gpioevent_t events[GPIO_EVENTS]; /* timestamp holds GPT ticks until stamped */
+
+	/* Blocked readers */
+	struct {
+		msg_t msg;
+		unsigned int rid;
+		unsigned int pid;
+		int used;
+	} readers[GPIO_READERS];
+
+	handle_t irqlock;
+	handle_t cond;
+
+	char stack[1024] __attribute__ ((aligned(8)));
+} gpioqueue_t;
+
+
 struct {
 	struct {
 		volatile uint32_t *base;
 		id_t port;
 		id_t dir;
+		id_t event;
 		handle_t lock;
+		gpioqueue_t queue;
+
+		/* Fast path grants, kept out of the shared page */
+		uint32_t granted;
+		unsigned int owner[32];
 	} gpio[5];
 
+	gpioshared_t *shared;
+	addr_t sharedpa;
+
+	volatile uint32_t *gpt;
+
 	uint32_t port;
 } common;
 
 
 static const addr_t paddr[] = { 0x0209c000, 0x020a0000, 0x020a4000, 0x020a8000, 0x020ac000 };
+static const addr_t gptpaddr = 0x020e8000;
 static const int clocks[] = { pctl_clk_gpio1, pctl_clk_gpio2, pctl_clk_gpio3, pctl_clk_gpio4, pctl_clk_gpio5 };
 
+/* Combined interrupts for pins 0 - 15, pins 16 - 31 use the next one */
+static const unsigned int irqs[] = { 32 + 66, 32 + 68, 32 + 70, 32 + 72, 32 + 74 };
+
+
+int gpioirq(unsigned int n, void *arg)
+{
+	int i = (int)arg;
+	volatile uint32_t *base = common.gpio[i].base;
+	gpioqueue_t *q = &common.gpio[i].queue;
+	gpioevent_t *ev;
+	uint32_t pending, ticks;
+
+	ticks = *(common.gpt + gpt_cnt);
+
+	if (!(pending = *(base + isr) & *(base + imr)))
+		return -1;
+
+	*(base + isr) = pending;
+
+	/* Level triggered pins would fire continuously, mask them until the event is read */
+	if (pending & q->level) {
+		__sync_fetch_and_and(&q->imrshadow, ~(pending & q->level));
+		*(base + imr) = q->imrshadow;
+	}
+
+	if (q->head - q->tail >= GPIO_EVENTS) {
+		++q->overflow;
+		return 0;
+	}
+
+	ev = &q->events[q->head & (GPIO_EVENTS - 1)];
+	ev->pins = pending;
+	ev->val = *(base + psr);
+	ev->timestamp = ticks;
+
+	++q->head;
+
+	return 0;
+}
+
+
+/*
+ * IMR is written by interrupt handler too. Threads change the shadow atomically
+ * and write it until it doesn't change underneath, handler always writes it last.
+ */
+static void gpiosyncimr(int i)
+{
+	gpioqueue_t *q = &common.gpio[i].queue;
+	uint32_t v;
+
+	do {
+		v = q->imrshadow;
+		*(common.gpio[i].base + imr) = v;
+	} while (v != q->imrshadow);
+}
+
+
+/* Must be called with port lock held, converts GPT ticks latched by interrupt handler to time */
+static void gpiostamp(int i)
+{
+	gpioqueue_t *q = &common.gpio[i].queue;
+	gpioevent_t *ev;
+	time_t now;
+	uint32_t ticks;
+
+	if (q->stamped == q->head)
+		return;
+
+	gettime(&now, NULL);
+	ticks = *(common.gpt + gpt_cnt);
+
+	while (q->stamped != q->head) {
+		ev = &q->events[q->stamped++ & (GPIO_EVENTS - 1)];
+		ev->timestamp = now - (uint32_t)(ticks - (uint32_t)ev->timestamp);
+	}
+}
+
+
+/* Must be called with port lock held */
+static int gpiogetevents(int i, gpioevent_t *buff, size_t size)
+{
+	gpioqueue_t *q = &common.gpio[i].queue;
+	int n = 0;
+
+	while (q->tail != q->stamped && (n + 1) * sizeof(gpioevent_t) <= size)
+		buff[n++] = q->events[q->tail++ & (GPIO_EVENTS - 1)];
+
+	/* Rearm level triggered pins */
+	if (n && q->level) {
+		__sync_fetch_and_or(&q->imrshadow, q->level);
+		gpiosyncimr(i);
+	}
+
+	return n * sizeof(gpioevent_t);
+}
+
+
+void gpioevthread(void *arg)
+{
+	int i = (int)arg, r;
+	gpioqueue_t *q = &common.gpio[i].queue;
+
+	for (;;) {
+		mutexLock(q->irqlock);
+		while (q->stamped == q->head)
+			condWait(q->cond, q->irqlock, 0);
+		mutexUnlock(q->irqlock);
+
+		mutexLock(common.gpio[i].lock);
+		gpiostamp(i);
+
+		for (r = 0; r < GPIO_READERS && q->tail != q->stamped; ++r) {
+			if (!q->readers[r].used)
+				continue;
+
+			q->readers[r].msg.o.io.err = gpiogetevents(i, q->readers[r].msg.o.data, q->readers[r].msg.o.size);
+			msgRespond(common.port, &q->readers[r].msg, q->readers[r].rid);
+			q->readers[r].used = 0;
+		}
+		mutexUnlock(common.gpio[i].lock);
+	}
+}
+
+
+static int gptinit(void)
+{
+	platformctl_t pctl;
+	static const int gptclocks[] = { pctl_clk_gpt2_bus, pctl_clk_gpt2_serial };
+	int i;
+
+	if ((common.gpt = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_DEVICE | MAP_UNCACHED, OID_PHYSMEM, gptpaddr)) == MAP_FAILED)
+		return -1;
+
+	for (i = 0; i < sizeof(gptclocks) / sizeof(gptclocks[0]); ++i) {
+		pctl.action = pctl_set;
+		pctl.type = pctl_devclock;
+		pctl.devclock.state = 3;
+		pctl.devclock.dev = gptclocks[i];
+
+		if (platformctl(&pctl) != EOK)
+			return -1;
+	}
+
+	/* Already counting, set up by another user (libecspi capture) */
+	if (*(common.gpt + gpt_cr) & 1)
+		return 0;
+
+	*(common.gpt + gpt_ir) = 0;
+
+	/* Software reset */
+	*(common.gpt + gpt_cr) = 1 << 15;
+	while (*(common.gpt + gpt_cr) & (1 << 15))
+		;
+
+	/* 24 MHz oscillator / 12 / 2 = 1 MHz */
+	*(common.gpt + gpt_pr) = (11 << 12) | 1;
+
+	/* Free running, 24M clock source, counter reset on enable, running in wait mode */
+	*(common.gpt + gpt_cr) = (1 << 10) | (1 << 9) | (5 << 6) | (1 << 3) | (1 << 1);
+	*(common.gpt + gpt_cr) |= 1;
+
+	return 0;
+}
+
 
 int init(void)
 {
 	int i, err;
-	char devpath[11];
+	char devpath[12];
 	platformctl_t pctl;
 	oid_t dev;
 
@@ -65,6 +282,19 @@ int init(void)
 		}
 	}
 
+	if ((common.shared = mmap(NULL, 4096, PROT_READ | PROT_WRITE, 0, OID_NULL, 0)) == MAP_FAILED) {
+		printf("gpiodrv: Could not allocate shared page\n");
+		return -1;
+	}
+
+	memset(common.shared, 0, 4096);
+	common.sharedpa = va2pa(common.shared);
+
+	if (gptinit() < 0) {
+		printf("gpiodrv: Could not initialize GPT2 for timestamps\n");
+		return -1;
+	}
+
 	if (portCreate(&common.port) != EOK) {
 		printf("gpiodrv: Could not create port\n");
 		return -1;
@@ -96,6 +326,18 @@ int init(void)
 
 		common.gpio[i].dir = dev.id;
 
+		sprintf(devpath, "gpio%d/event", i + 1);
+
+		dev.port = common.port;
+		dev.id = event1 + i;
+
+		if ((err = create_dev(&dev, devpath)) != EOK) {
+			printf("gpiodrv: Could not create event file #%d (err %d)\n", i + 1, err);
+			return - 1;
+		}
+
+		common.gpio[i].event = dev.id;
+
 		pctl.action = pctl_set;
 		pctl.type = pctl_devclock;
 		pctl.devclock.state = 3;
@@ -110,12 +352,84 @@ int init(void)
 			printf("gpiodrv: Could not create mutex for gpio%d\n", i + 1);
 			return -1;
 		}
+
+		if (mutexCreate(&common.gpio[i].queue.irqlock) < 0 || condCreate(&common.gpio[i].queue.cond) < 0) {
+			printf("gpiodrv: Could not create event queue for gpio%d\n", i + 1);
+			return -1;
+		}
+
+		/* Mask and clear all pin interrupts */
+		common.gpio[i].queue.imrshadow = 0;
+		*(common.gpio[i].base + imr) = 0;
+		*(common.gpio[i].base + isr) = 0xffffffff;
+
+		interrupt(irqs[i], gpioirq, (void *)i, common.gpio[i].queue.cond, NULL);
+		interrupt(irqs[i] + 1, gpioirq, (void *)i, common.gpio[i].queue.cond, NULL);
+
+		beginthread(gpioevthread, 2, common.gpio[i].queue.stack, sizeof(common.gpio[i].queue.stack), (void *)i);
 	}
 
 	return 0;
 }
 
 
+/* Must be called with port lock held */
+static void gpiodropowner(int i, unsigned int pid)
+{
+	unsigned int pin;
+
+	for (pin = 0; pin < 32; ++pin) {
+		if ((common.gpio[i].granted & (1 << pin)) && common.gpio[i].owner[pin] == pid)
+			common.gpio[i].granted &= ~(1 << pin);
+	}
+
+	/* Owner is gone, it won't release the shared lock itself */
+	__sync_bool_compare_and_swap(&common.shared[i].lock, pid, 0);
+}
+
+
+static int gpioisdead(unsigned int pid)
+{
+	return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+
+/* Must be called with port lock held */
+static void gpioreap(int i)
+{
+	unsigned int pin;
+
+	for (pin = 0; pin < 32; ++pin) {
+		if ((common.gpio[i].granted & (1 << pin)) && gpioisdead(common.gpio[i].owner[pin]))
+			gpiodropowner(i, common.gpio[i].owner[pin]);
+	}
+}
+
+
+/* Must be called with port lock held, holder of shared lock may have died with it taken */
+static int gpiolockshared(int i)
+{
+	gpioshared_t *shared = &common.shared[i];
+	unsigned int holder;
+	int tries;
+
+	for (tries = 0; tries < GPIO_LOCK_TRIES; ++tries) {
+		if (__sync_bool_compare_and_swap(&shared->lock, 0, GPIO_LOCK_SERVER))
+			return EOK;
+		usleep(1);
+	}
+
+	holder = shared->lock;
+	if (holder != 0 && holder != GPIO_LOCK_SERVER && gpioisdead(holder)) {
+		gpiodropowner(i, holder);
+		if (__sync_bool_compare_and_swap(&shared->lock, 0, GPIO_LOCK_SERVER))
+			return EOK;
+	}
+
+	return -EBUSY;
+}
+
+
 int gpioread(int d, uint32_t *val)
 {
 	if (d < gpio1 || d > gpio5)
@@ -132,19 +446,211 @@ int gpioread(int d, uint32_t *val)
 int gpiowrite(int d, uint32_t val, uint32_t mask)
 {
 	uint32_t t;
+	int err;
 
 	if (d < gpio1 || d > gpio5)
 		return -EINVAL;
 
 	mutexLock(common.gpio[d - gpio1].lock);
-	t = *(common.gpio[d - gpio1].base + dr) & ~(mask);
-	*(common.gpio[d - gpio1].base + dr) = t | (val & mask);
+
+	/* Granted pins are driven by their owner only */
+	mask &= ~common.gpio[d - gpio1].granted;
+
+	if ((err = gpiolockshared(d - gpio1)) == EOK) {
+		t = *(common.gpio[d - gpio1].base + dr) & ~(mask);
+		*(common.gpio[d - gpio1].base + dr) = t | (val & mask);
+		gpio_fastUnlock(&common.shared[d - gpio1]);
+	}
+
 	mutexUnlock(common.gpio[d - gpio1].lock);
 
+	return err;
+}
+
+
+int gpioevread(msg_t *msg, int d, unsigned int rid)
+{
+	gpioqueue_t *q;
+	int i = d - event1, r;
+
+	if (msg->o.data == NULL || msg->o.size < sizeof(gpioevent_t)) {
+		msg->o.io.err = -EINVAL;
+		return 0;
+	}
+
+	q = &common.gpio[i].queue;
+
+	mutexLock(common.gpio[i].lock);
+	gpiostamp(i);
+
+	if (q->tail != q->stamped) {
+		msg->o.io.err = gpiogetevents(i, msg->o.data, msg->o.size);
+		mutexUnlock(common.gpio[i].lock);
+		return 0;
+	}
+
+	if (msg->i.io.mode & O_NONBLOCK) {
+		msg->o.io.err = -EWOULDBLOCK;
+		mutexUnlock(common.gpio[i].lock);
+		return 0;
+	}
+
+	/* Defer response until event arrives */
+	for (r = 0; r < GPIO_READERS; ++r) {
+		if (!q->readers[r].used)
+			break;
+	}
+
+	if (r == GPIO_READERS) {
+		msg->o.io.err = -EBUSY;
+		mutexUnlock(common.gpio[i].lock);
+		return 0;
+	}
+
+	q->readers[r].msg = *msg;
+	q->readers[r].rid = rid;
+	q->readers[r].pid = msg->pid;
+	q->readers[r].used = 1;
+	mutexUnlock(common.gpio[i].lock);
+
+	return 1;
+}
+
+
+/* Drops reads left blocked by a client closing the event file */
+static void gpioevclose(int i, unsigned int pid)
+{
+	gpioqueue_t *q = &common.gpio[i].queue;
+	int r;
+
+	mutexLock(common.gpio[i].lock);
+	for (r = 0; r < GPIO_READERS; ++r) {
+		if (!q->readers[r].used || q->readers[r].pid != pid)
+			continue;
+
+		q->readers[r].msg.o.io.err = -EBADF;
+		msgRespond(common.port, &q->readers[r].msg, q->readers[r].rid);
+		q->readers[r].used = 0;
+	}
+	mutexUnlock(common.gpio[i].lock);
+}
+
+
+/* Must be called with port lock held */
+static int gpiosetirq(int i, uint32_t mask, unsigned int mode)
+{
+	volatile uint32_t *base = common.gpio[i].base;
+	gpioqueue_t *q = &common.gpio[i].queue;
+	uint32_t t, bits, pin;
+
+	switch (mode) {
+		case gpio_irq_none:
+		case gpio_irq_low: bits = 0; break;
+		case gpio_irq_high: bits = 1; break;
+		case gpio_irq_rising: bits = 2; break;
+		case gpio_irq_falling: bits = 3; break;
+		case gpio_irq_both: bits = 0; break;
+		default: return -EINVAL;
+	}
+
+	/* Disable interrupts while reconfiguring */
+	__sync_fetch_and_and(&q->imrshadow, ~mask);
+	gpiosyncimr(i);
+
+	for (pin = 0; pin < 32; ++pin) {
+		if (!(mask & (1 << pin)))
+			continue;
+
+		t = *(base + icr1 + pin / 16) & ~(3 << (2 * (pin % 16)));
+		*(base + icr1 + pin / 16) = t | (bits << (2 * (pin % 16)));
+	}
+
+	/* EDGE_SEL overrides ICR */
+	if (mode == gpio_irq_both)
+		*(base + edge) |= mask;
+	else
+		*(base + edge) &= ~mask;
+
+	if (mode == gpio_irq_low || mode == gpio_irq_high)
+		q->level |= mask;
+	else
+		q->level &= ~mask;
+
+	if (mode != gpio_irq_none) {
+		/* Drop stale status before enabling */
+		*(base + isr) = mask;
+		__sync_fetch_and_or(&q->imrshadow, mask);
+		gpiosyncimr(i);
+	}
+
 	return EOK;
 }
 
 
+int gpiodevctl(gpiodevctl_i_t *in, gpiodevctl_o_t *out, unsigned int pid)
+{
+	int d = in->id, err = EOK;
+	unsigned int pin;
+
+	if (d < gpio1 || d > gpio5)
+		return -EINVAL;
+
+	mutexLock(common.gpio[d - gpio1].lock);
+
+	switch (in->type) {
+		case gpio_grant:
+			/* Pins of clients which exited without release are free again */
+			if (common.gpio[d - gpio1].granted & in->mask)
+				gpioreap(d - gpio1);
+
+			if (common.gpio[d - gpio1].granted & in->mask) {
+				err = -EBUSY;
+				break;
+			}
+
+			common.gpio[d - gpio1].granted |= in->mask;
+			for (pin = 0; pin < 32; ++pin) {
+				if (in->mask & (1 << pin))
+					common.gpio[d - gpio1].owner[pin] = pid;
+			}
+
+			out->mask = in->mask;
+			out->regs = paddr[d - gpio1];
+			out->shared = common.sharedpa;
+			out->offs = (d - gpio1) * sizeof(gpioshared_t);
+			break;
+
+		case gpio_release:
+			/* Only pins granted to the sender */
+			for (pin = 0; pin < 32; ++pin) {
+				if ((in->mask & (1 << pin)) && common.gpio[d - gpio1].owner[pin] != pid)
+					err = -EPERM;
+			}
+
+			if (err == EOK)
+				common.gpio[d - gpio1].granted &= ~in->mask;
+			break;
+
+		case gpio_interrupt:
+			err = gpiosetirq(d - gpio1, in->mask, in->mode);
+			break;
+
+		case gpio_overflow:
+			out->overflow = common.gpio[d - gpio1].queue.overflow;
+			common.gpio[d - gpio1].queue.overflow = 0;
+			break;
+
+		default:
+			err = -EINVAL;
+			break;
+	}
+
+	mutexUnlock(common.gpio[d - gpio1].lock);
+
+	return err;
+}
+
+
 int gpiogetdir(int d, uint32_t *dir)
 {
 	if (d < dir1 || d > dir5)
@@ -180,6 +686,7 @@ void thread(void *arg)
 	unsigned int rid;
 	int d;
 	uint32_t val, mask;
+	gpioqueue_t *q;
 
 	while (1) {
 		if (msgRecv(common.port, &msg, &rid) < 0)
@@ -189,11 +696,45 @@ void thread(void *arg)
 
 		switch (msg.type) {
 			case mtOpen:
+				msg.o.io.err = msg.i.openclose.oid.id < gpio1 || msg.i.openclose.oid.id > event5 ? -ENOENT : EOK;
+				break;
+
 			case mtClose:
-				msg.o.io.err = msg.i.openclose.oid.id < gpio1 || msg.i.openclose.oid.id > dir5 ? -ENOENT : EOK;
+				d = msg.i.openclose.oid.id;
+				msg.o.io.err = d < gpio1 || d > event5 ? -ENOENT : EOK;
+
+				/* Grants end with the client */
+				if (d >= gpio1 && d <= gpio5) {
+					mutexLock(common.gpio[d - gpio1].lock);
+					gpiodropowner(d - gpio1, msg.pid);
+					mutexUnlock(common.gpio[d - gpio1].lock);
+				}
+				else if (d >= event1 && d <= event5) {
+					gpioevclose(d - event1, msg.pid);
+				}
+				break;
+
+			case mtGetAttr:
+				d = msg.i.attr.oid.id;
+
+				if (msg.i.attr.type == atPollStatus && d >= event1 && d <= event5) {
+					mutexLock(common.gpio[d - event1].lock);
+					q = &common.gpio[d - event1].queue;
+					msg.o.attr.val = (q->tail != q->head) ? POLLIN : 0;
+					mutexUnlock(common.gpio[d - event1].lock);
+				}
+				else {
+					msg.o.attr.val = -EINVAL;
+				}
 				break;
 
 			case mtRead:
+				if (msg.i.io.oid.id >= event1 && msg.i.io.oid.id <= event5) {
+					if (gpioevread(&msg, msg.i.io.oid.id, rid))
+						continue;
+					break;
+				}
+
 				if (msg.o.data != NULL && msg.o.size >= sizeof(uint32_t)) {
 					d = msg.i.io.oid.id;
 
@@ -231,6 +772,10 @@ void thread(void *arg)
 						msg.o.io.err = (msg.i.size >= (sizeof(uint32_t) << 1)) ? sizeof(uint32_t) << 1 : sizeof(uint32_t);
 				}
 				break;
+
+			case mtDevCtl:
+				((gpiodevctl_o_t *)msg.o.raw)->err = gpiodevctl((gpiodevctl_i_t *)msg.i.raw, (gpiodevctl_o_t *)msg.o.raw, msg.pid);
+				break;
 		}
 
 		msgRespond(common.port, &msg, rid);
@@ -14,6 +14,10 @@
 #ifndef _GPIODRV_H_
 #define _GPIODRV_H_
 
+#include <unistd.h>
+#include <sys/types.h>
+
+
 typedef union {
 	unsigned int val;
 	struct {
@@ -22,4 +26,99 @@ typedef union {
 	} __attribute__((packed)) w;
 } gpiodata_t;
 
+
+/* Requests sent as mtDevCtl to port file */
+enum { gpio_grant = 0, gpio_release, gpio_interrupt, gpio_overflow };
+
+
+enum { gpio_irq_none = 0, gpio_irq_low, gpio_irq_high, gpio_irq_rising, gpio_irq_falling, gpio_irq_both };
+
+
+typedef struct {
+	id_t id;
+	int type;
+	unsigned int mask;
+	unsigned int mode;
+} __attribute__((packed)) gpiodevctl_i_t;
+
+
+typedef struct {
+	int err;
+	unsigned int mask;
+	addr_t regs;
+	addr_t shared;
+	unsigned int offs;
+	unsigned int overflow;
+} __attribute__((packed)) gpiodevctl_o_t;
+
+
+/*
+ * Pin interrupt events are read from event file, read blocks until at least
+ * one event is available. Level triggered pins are masked after each event
+ * and rearmed when the event is read.
+ */
+typedef struct {
+	unsigned long long timestamp; /* us */
+	unsigned int pins;            /* pins which triggered the event */
+	unsigned int val;             /* port state */
+} __attribute__((packed)) gpioevent_t;
+
+
+/* Fast path - pins granted to a client are driven through mapped port registers */
+
+
+/* Port entry in the shared page, lock guards read-modify-write of DR and holds pid of the holder */
+typedef struct {
+	volatile unsigned int lock;
+} gpioshared_t;
+
+
+typedef struct {
+	volatile unsigned int *regs;
+	gpioshared_t *shared;
+	unsigned int mask;
+	unsigned int owner; /* getpid() of the client */
+} gpiofast_t;
+
+
+static inline void gpio_fastLock(gpioshared_t *shared, unsigned int owner)
+{
+	/* Holder can have lower priority, let it run */
+	while (!__sync_bool_compare_and_swap(&shared->lock, 0, owner))
+		usleep(1);
+}
+
+
+static inline void gpio_fastUnlock(gpioshared_t *shared)
+{
+	__sync_lock_release(&shared->lock);
+}
+
+
+static inline void gpio_fastWrite(gpiofast_t *f, unsigned int val, unsigned int mask)
+{
+	mask &= f->mask;
+
+	gpio_fastLock(f->shared, f->owner);
+	*f->regs = (*f->regs & ~mask) | (val & mask);
+	gpio_fastUnlock(f->shared);
+}
+
+
+static inline void gpio_fastToggle(gpiofast_t *f, unsigned int mask)
+{
+	mask &= f->mask;
+
+	gpio_fastLock(f->shared, f->owner);
+	*f->regs ^= mask;
+	gpio_fastUnlock(f->shared);
+}
+
+
+static inline unsigned int gpio_fastRead(gpiofast_t *f)
+{
+	/* PSR */
+	return *(f->regs + 2);
+}
+
 #endif
@@ -11,8 +11,53 @@
  * %LICENSE%
  */
 
+#include <stdint.h>
 #include <sys/platform.h>
+#include <edma.h>
+
 #include "common.h"
 
 
 unsigned int multi_port;
+
+
+/* Channels which reported an error, kept until taken by common_dmaErrors() */
+static volatile uint32_t common_dmaErr;
+
+
+static int common_dmaErrorHandler(unsigned int n, void *arg)
+{
+	uint32_t err = edma_get_errors();
+	unsigned int channel;
+
+	common_dmaErr |= err;
+
+	for (channel = 0; err != 0; ++channel, err >>= 1) {
+		if (err & 1)
+			edma_clear_error(channel);
+	}
+
+	return -1;
+}
+
+
+uint32_t common_dmaErrors(uint32_t mask)
+{
+	return __sync_fetch_and_and(&common_dmaErr, ~mask) & mask;
+}
+
+
+int common_initDma(void)
+{
+	static int initialized = 0;
+
+	if (initialized)
+		return 0;
+
+	if (edma_init(common_dmaErrorHandler) < 0)
+		return -1;
+
+	initialized = 1;
+
+	return 0;
+}
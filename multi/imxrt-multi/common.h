@@ -56,4 +56,12 @@ int common_setPad(int pad, char hys, char pus, char pue, char pke, char ode, cha
 
 int common_setInput(int isel, char daisy);
 
+
+/* Initializes eDMA controller shared by all drivers, may be called multiple times */
+int common_initDma(void);
+
+
+/* Returns and forgets errors reported by eDMA channels in mask (bit n - channel n) */
+uint32_t common_dmaErrors(uint32_t mask);
+
 #endif
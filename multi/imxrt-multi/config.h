@@ -36,6 +36,18 @@
 #define UART1_HW_FLOWCTRL 0
 #endif
 
+#ifndef UART1_DMA
+#define UART1_DMA 0
+#endif
+
+#ifndef UART1_DMA_RXCH
+#define UART1_DMA_RXCH 0
+#endif
+
+#ifndef UART1_DMA_TXCH
+#define UART1_DMA_TXCH 1
+#endif
+
 #ifndef UART2
 #define UART2 0
 #endif
@@ -44,6 +56,18 @@
 #define UART2_HW_FLOWCTRL 0
 #endif
 
+#ifndef UART2_DMA
+#define UART2_DMA 0
+#endif
+
+#ifndef UART2_DMA_RXCH
+#define UART2_DMA_RXCH 2
+#endif
+
+#ifndef UART2_DMA_TXCH
+#define UART2_DMA_TXCH 3
+#endif
+
 #ifndef UART3
 #define UART3 0
 #endif
@@ -52,6 +76,18 @@
 #define UART3_HW_FLOWCTRL 0
 #endif
 
+#ifndef UART3_DMA
+#define UART3_DMA 0
+#endif
+
+#ifndef UART3_DMA_RXCH
+#define UART3_DMA_RXCH 4
+#endif
+
+#ifndef UART3_DMA_TXCH
+#define UART3_DMA_TXCH 5
+#endif
+
 #ifndef UART4
 #define UART4 0
 #endif
@@ -60,6 +96,18 @@
 #define UART4_HW_FLOWCTRL 0
 #endif
 
+#ifndef UART4_DMA
+#define UART4_DMA 0
+#endif
+
+#ifndef UART4_DMA_RXCH
+#define UART4_DMA_RXCH 6
+#endif
+
+#ifndef UART4_DMA_TXCH
+#define UART4_DMA_TXCH 7
+#endif
+
 #ifndef UART5
 #define UART5 0
 #endif
@@ -68,6 +116,18 @@
 #define UART5_HW_FLOWCTRL 0
 #endif
 
+#ifndef UART5_DMA
+#define UART5_DMA 0
+#endif
+
+#ifndef UART5_DMA_RXCH
+#define UART5_DMA_RXCH 8
+#endif
+
+#ifndef UART5_DMA_TXCH
+#define UART5_DMA_TXCH 9
+#endif
+
 #ifndef UART6
 #define UART6 0
 #endif
@@ -76,6 +136,18 @@
 #define UART6_HW_FLOWCTRL 0
 #endif
 
+#ifndef UART6_DMA
+#define UART6_DMA 0
+#endif
+
+#ifndef UART6_DMA_RXCH
+#define UART6_DMA_RXCH 10
+#endif
+
+#ifndef UART6_DMA_TXCH
+#define UART6_DMA_TXCH 11
+#endif
+
 #ifndef UART7
 #define UART7 0
 #endif
@@ -84,6 +156,18 @@
 #define UART7_HW_FLOWCTRL 0
 #endif
 
+#ifndef UART7_DMA
+#define UART7_DMA 0
+#endif
+
+#ifndef UART7_DMA_RXCH
+#define UART7_DMA_RXCH 12
+#endif
+
+#ifndef UART7_DMA_TXCH
+#define UART7_DMA_TXCH 13
+#endif
+
 #ifndef UART8
 #define UART8 0
 #endif
@@ -92,32 +176,96 @@
 #define UART8_HW_FLOWCTRL 0
 #endif
 
+#ifndef UART8_DMA
+#define UART8_DMA 0
+#endif
+
+#ifndef UART8_DMA_RXCH
+#define UART8_DMA_RXCH 14
+#endif
+
+#ifndef UART8_DMA_TXCH
+#define UART8_DMA_TXCH 15
+#endif
+
 #ifndef UART_CONSOLE
 #define UART_CONSOLE 1
 #endif
 
+#define UART_DMA (UART1_DMA || UART2_DMA || UART3_DMA || UART4_DMA || UART5_DMA || UART6_DMA || UART7_DMA || UART8_DMA)
+
 /* SPI */
 
 #ifndef SPI1
 #define SPI1 1
 #endif
 
+#ifndef SPI1_DMA
+#define SPI1_DMA 0
+#endif
+
+#ifndef SPI1_DMA_RXCH
+#define SPI1_DMA_RXCH 16
+#endif
+
+#ifndef SPI1_DMA_TXCH
+#define SPI1_DMA_TXCH 17
+#endif
+
 #ifndef SPI2
 #define SPI2 0
 #endif
 
+#ifndef SPI2_DMA
+#define SPI2_DMA 0
+#endif
+
+#ifndef SPI2_DMA_RXCH
+#define SPI2_DMA_RXCH 18
+#endif
+
+#ifndef SPI2_DMA_TXCH
+#define SPI2_DMA_TXCH 19
+#endif
+
 #ifndef SPI3
 #define SPI3 0
 #endif
 
+#ifndef SPI3_DMA
+#define SPI3_DMA 0
+#endif
+
+#ifndef SPI3_DMA_RXCH
+#define SPI3_DMA_RXCH 20
+#endif
+
+#ifndef SPI3_DMA_TXCH
+#define SPI3_DMA_TXCH 21
+#endif
+
 #ifndef SPI4
 #define SPI4 0
 #endif
 
+#ifndef SPI4_DMA
+#define SPI4_DMA 0
+#endif
+
+#ifndef SPI4_DMA_RXCH
+#define SPI4_DMA_RXCH 22
+#endif
+
+#ifndef SPI4_DMA_TXCH
+#define SPI4_DMA_TXCH 23
+#endif
+
+#define SPI_DMA (SPI1_DMA || SPI2_DMA || SPI3_DMA || SPI4_DMA)
+
 /* I2C */
 
 #ifndef I2C1
-#define I2C1 1
+#define I2C1 0
 #endif
 
 #ifndef I2C2
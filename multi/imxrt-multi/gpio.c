@@ -18,6 +18,8 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/threads.h>
 #include <sys/file.h>
 #include <sys/msg.h>
@@ -30,16 +32,443 @@
 
 
 
+/* Has to be power of 2 */
+#define GPIO_EVENTS 32
+#define GPIO_READERS 4
+
+/* Script limits, longer delays and waits are slept with the lock released */
+#define GPIO_SCRIPT_OPS 64
+#define GPIO_SCRIPT_US 100000
+#define GPIO_SPIN_US 100
+
+
 enum { gpio_dr = 0, gpio_gdir, gpio_psr, gpio_icr1, gpio_icr2, gpio_imr,
 	gpio_isr, gpio_edge_sel, gpio_dr_set, gpio_dr_clear, gpio_dr_toggle };
 
 
+enum { gpt_cr = 0, gpt_pr, gpt_sr, gpt_ir, gpt_ocr1, gpt_ocr2, gpt_ocr3, gpt_icr1, gpt_icr2, gpt_cnt };
+
+
+typedef struct {
+	volatile unsigned int head;   /* written by interrupt handler */
+	unsigned int stamped;         /* events before this one have timestamp */
+	unsigned int tail;
+	volatile unsigned int overflow;
+	uint32_t level;               /* pins with level triggered interrupt */
+	volatile uint32_t imrshadow;  /* IMR value, changed atomically by interrupt handler and threads */
+	gpio_event_t events[GPIO_EVENTS]; /* timestamp holds GPT ticks until stamped */
+} gpio_queue_t;
+
+
 struct {
 	volatile uint32_t *base[GPIO_PORTS];
+	volatile uint32_t *gpt;
 	handle_t lock;
+
+	gpio_queue_t queue[GPIO_PORTS];
+
+	/* Blocked readers */
+	struct {
+		msg_t msg;
+		unsigned int rid;
+		unsigned int pid;
+		int port;
+		int used;
+	} readers[GPIO_READERS];
+
+	handle_t irqLock;
+	handle_t cond;
+
+	char stack[1024] __attribute__ ((aligned(8)));
 } gpio_common;
 
 
+static int gpio_irqHandler(unsigned int n, void *arg)
+{
+	int port = (int)arg;
+	volatile uint32_t *base = gpio_common.base[port];
+	gpio_queue_t *q = &gpio_common.queue[port];
+	gpio_event_t *ev;
+	uint32_t pending, ticks;
+
+	ticks = *(gpio_common.gpt + gpt_cnt);
+
+	/* IRQ line is shared by both halves of the port and by fast GPIO ports */
+	if (!(pending = *(base + gpio_isr) & *(base + gpio_imr)))
+		return -1;
+
+	*(base + gpio_isr) = pending;
+
+	/* Level triggered pins would fire continuously, mask them until the event is read */
+	if (pending & q->level) {
+		__sync_fetch_and_and(&q->imrshadow, ~(pending & q->level));
+		*(base + gpio_imr) = q->imrshadow;
+	}
+
+	if (q->head - q->tail >= GPIO_EVENTS) {
+		++q->overflow;
+		return 0;
+	}
+
+	ev = &q->events[q->head & (GPIO_EVENTS - 1)];
+	ev->pins = pending;
+	ev->val = *(base + gpio_psr);
+	ev->timestamp = ticks;
+
+	common_dataBarrier();
+	++q->head;
+
+	return 0;
+}
+
+
+/*
+ * IMR is written by interrupt handler too. Threads change the shadow atomically
+ * and write it until it doesn't change underneath, handler always writes it last.
+ */
+static void gpio_syncImr(int port)
+{
+	gpio_queue_t *q = &gpio_common.queue[port];
+	uint32_t v;
+
+	do {
+		v = q->imrshadow;
+		*(gpio_common.base[port] + gpio_imr) = v;
+	} while (v != q->imrshadow);
+}
+
+
+/* Must be called with gpio_common.lock held, converts GPT ticks latched by interrupt handler to time */
+static void gpio_stampEvents(int port)
+{
+	gpio_queue_t *q = &gpio_common.queue[port];
+	gpio_event_t *ev;
+	time_t now;
+	uint32_t ticks;
+
+	if (q->stamped == q->head)
+		return;
+
+	gettime(&now, NULL);
+	ticks = *(gpio_common.gpt + gpt_cnt);
+
+	while (q->stamped != q->head) {
+		ev = &q->events[q->stamped++ & (GPIO_EVENTS - 1)];
+		ev->timestamp = now - (uint32_t)(ticks - (uint32_t)ev->timestamp);
+	}
+}
+
+
+/* Must be called with gpio_common.lock held */
+static int gpio_readEvents(int port, gpio_event_t *buff, size_t size)
+{
+	gpio_queue_t *q = &gpio_common.queue[port];
+	int n = 0;
+
+	while (q->tail != q->stamped && (n + 1) * sizeof(gpio_event_t) <= size)
+		buff[n++] = q->events[q->tail++ & (GPIO_EVENTS - 1)];
+
+	/* Rearm level triggered pins */
+	if (n && q->level) {
+		__sync_fetch_and_or(&q->imrshadow, q->level);
+		gpio_syncImr(port);
+	}
+
+	return n * sizeof(gpio_event_t);
+}
+
+
+static void gpio_eventThread(void *arg)
+{
+	gpio_queue_t *q;
+	int i, pending;
+
+	for (;;) {
+		mutexLock(gpio_common.irqLock);
+		do {
+			for (i = 0, pending = 0; i < GPIO_PORTS; ++i) {
+				q = &gpio_common.queue[i];
+				pending |= (q->stamped != q->head);
+			}
+
+			if (!pending)
+				condWait(gpio_common.cond, gpio_common.irqLock, 0);
+		} while (!pending);
+		mutexUnlock(gpio_common.irqLock);
+
+		mutexLock(gpio_common.lock);
+		for (i = 0; i < GPIO_PORTS; ++i)
+			gpio_stampEvents(i);
+
+		for (i = 0; i < GPIO_READERS; ++i) {
+			if (!gpio_common.readers[i].used)
+				continue;
+
+			q = &gpio_common.queue[gpio_common.readers[i].port];
+			if (q->tail == q->stamped)
+				continue;
+
+			gpio_common.readers[i].msg.o.io.err = gpio_readEvents(gpio_common.readers[i].port,
+				gpio_common.readers[i].msg.o.data, gpio_common.readers[i].msg.o.size);
+			msgRespond(multi_port, &gpio_common.readers[i].msg, gpio_common.readers[i].rid);
+			gpio_common.readers[i].used = 0;
+		}
+		mutexUnlock(gpio_common.lock);
+	}
+}
+
+
+static int gpio_read(msg_t *msg, int port, unsigned int rid)
+{
+	int i;
+
+	if (msg->o.data == NULL || msg->o.size < sizeof(gpio_event_t)) {
+		msg->o.io.err = -EINVAL;
+		return 0;
+	}
+
+	mutexLock(gpio_common.lock);
+	gpio_stampEvents(port);
+
+	if (gpio_common.queue[port].tail != gpio_common.queue[port].stamped) {
+		msg->o.io.err = gpio_readEvents(port, msg->o.data, msg->o.size);
+		mutexUnlock(gpio_common.lock);
+		return 0;
+	}
+
+	if (msg->i.io.mode & O_NONBLOCK) {
+		msg->o.io.err = -EWOULDBLOCK;
+		mutexUnlock(gpio_common.lock);
+		return 0;
+	}
+
+	/* Defer response until event arrives */
+	for (i = 0; i < GPIO_READERS; ++i) {
+		if (!gpio_common.readers[i].used)
+			break;
+	}
+
+	if (i == GPIO_READERS) {
+		msg->o.io.err = -EBUSY;
+		mutexUnlock(gpio_common.lock);
+		return 0;
+	}
+
+	gpio_common.readers[i].msg = *msg;
+	gpio_common.readers[i].rid = rid;
+	gpio_common.readers[i].pid = msg->pid;
+	gpio_common.readers[i].port = port;
+	gpio_common.readers[i].used = 1;
+	mutexUnlock(gpio_common.lock);
+
+	return 1;
+}
+
+
+/* Drops reads left blocked by a client closing the device */
+static void gpio_close(int port, unsigned int pid)
+{
+	int i;
+
+	mutexLock(gpio_common.lock);
+	for (i = 0; i < GPIO_READERS; ++i) {
+		if (!gpio_common.readers[i].used || gpio_common.readers[i].port != port || gpio_common.readers[i].pid != pid)
+			continue;
+
+		gpio_common.readers[i].msg.o.io.err = -EBADF;
+		msgRespond(multi_port, &gpio_common.readers[i].msg, gpio_common.readers[i].rid);
+		gpio_common.readers[i].used = 0;
+	}
+	mutexUnlock(gpio_common.lock);
+}
+
+
+static int gpio_setIrq(int port, uint32_t mask, unsigned int mode)
+{
+	volatile uint32_t *base = gpio_common.base[port];
+	uint32_t icr, bits, pin;
+
+	if (mode > gpio_irq_both)
+		return -EINVAL;
+
+	mutexLock(gpio_common.lock);
+
+	/* Disable interrupts while reconfiguring */
+	__sync_fetch_and_and(&gpio_common.queue[port].imrshadow, ~mask);
+	gpio_syncImr(port);
+
+	for (pin = 0; pin < 32; ++pin) {
+		if (!(mask & (1 << pin)))
+			continue;
+
+		switch (mode) {
+			case gpio_irq_low: bits = 0; break;
+			case gpio_irq_high: bits = 1; break;
+			case gpio_irq_rising: bits = 2; break;
+			case gpio_irq_falling: bits = 3; break;
+			default: bits = 0; break;
+		}
+
+		icr = *(base + gpio_icr1 + pin / 16) & ~(3 << (2 * (pin % 16)));
+		*(base + gpio_icr1 + pin / 16) = icr | (bits << (2 * (pin % 16)));
+	}
+
+	if (mode == gpio_irq_both)
+		*(base + gpio_edge_sel) |= mask;
+	else
+		*(base + gpio_edge_sel) &= ~mask;
+
+	if (mode == gpio_irq_low || mode == gpio_irq_high)
+		gpio_common.queue[port].level |= mask;
+	else
+		gpio_common.queue[port].level &= ~mask;
+
+	if (mode != gpio_irq_none) {
+		/* Drop stale status before enabling */
+		*(base + gpio_isr) = mask;
+		__sync_fetch_and_or(&gpio_common.queue[port].imrshadow, mask);
+		gpio_syncImr(port);
+	}
+
+	mutexUnlock(gpio_common.lock);
+
+	return EOK;
+}
+
+
+/* Must be called with gpio_common.lock held */
+static void gpio_delay(time_t start, unsigned int us)
+{
+	time_t now;
+
+	gettime(&now, NULL);
+
+	if (us > GPIO_SPIN_US) {
+		if ((now - start) < us) {
+			mutexUnlock(gpio_common.lock);
+			usleep(us - (now - start));
+			mutexLock(gpio_common.lock);
+		}
+		return;
+	}
+
+	while ((now - start) < us)
+		gettime(&now, NULL);
+}
+
+
+/* Must be called with gpio_common.lock held */
+static int gpio_waitLevel(int port, uint32_t mask, uint32_t level, unsigned int timeout)
+{
+	time_t start, now;
+	int err, unlocked = 0;
+
+	gettime(&start, NULL);
+
+	for (;;) {
+		if ((*(gpio_common.base[port] + gpio_psr) & mask) == level) {
+			err = EOK;
+			break;
+		}
+
+		gettime(&now, NULL);
+		if ((now - start) >= timeout) {
+			err = -ETIMEDOUT;
+			break;
+		}
+
+		/* Don't hold the lock spinning for long */
+		if ((now - start) >= GPIO_SPIN_US) {
+			if (!unlocked) {
+				mutexUnlock(gpio_common.lock);
+				unlocked = 1;
+			}
+			usleep(GPIO_SPIN_US / 4);
+		}
+	}
+
+	if (unlocked)
+		mutexLock(gpio_common.lock);
+
+	return err;
+}
+
+
+static int gpio_runScript(int port, const gpio_op_t *ops, size_t opsz, unsigned int *reads, size_t readsz, unsigned int *nreads)
+{
+	volatile uint32_t *base = gpio_common.base[port];
+	size_t i, n = 0;
+	time_t start;
+	unsigned int total = 0;
+	int err = EOK;
+
+	if ((opsz % sizeof(gpio_op_t)) != 0 || opsz > GPIO_SCRIPT_OPS * sizeof(gpio_op_t))
+		return -EINVAL;
+
+	opsz /= sizeof(gpio_op_t);
+	readsz /= sizeof(unsigned int);
+
+	for (i = 0; i < opsz; ++i) {
+		if (ops[i].op > gpio_op_wait_low)
+			return -EINVAL;
+
+		/* Delays and wait timeouts together */
+		total += ops[i].us;
+		if (total > GPIO_SCRIPT_US)
+			return -EINVAL;
+
+		if (ops[i].op == gpio_op_read && n++ >= readsz)
+			return -EINVAL;
+	}
+
+	n = 0;
+
+	mutexLock(gpio_common.lock);
+	for (i = 0; i < opsz && err == EOK; ++i) {
+		gettime(&start, NULL);
+
+		/* DR_SET & DR_CLEAR registers are not functional */
+		switch (ops[i].op) {
+			case gpio_op_set:
+				*(base + gpio_dr) |= ops[i].mask;
+				break;
+
+			case gpio_op_clear:
+				*(base + gpio_dr) &= ~ops[i].mask;
+				break;
+
+			case gpio_op_toggle:
+				*(base + gpio_dr) ^= ops[i].mask;
+				break;
+
+			case gpio_op_read:
+				reads[n++] = *(base + gpio_psr) & ops[i].mask;
+				break;
+
+			case gpio_op_wait_high:
+				err = gpio_waitLevel(port, ops[i].mask, ops[i].mask, ops[i].us);
+				continue;
+
+			case gpio_op_wait_low:
+				err = gpio_waitLevel(port, ops[i].mask, 0, ops[i].us);
+				continue;
+
+			default:
+				break;
+		}
+
+		/* Delay is applied after any set/clear/toggle/read step too */
+		if (ops[i].us != 0)
+			gpio_delay(start, ops[i].us);
+	}
+	mutexUnlock(gpio_common.lock);
+
+	*nreads = n;
+
+	return err;
+}
+
+
 static void gpio_handleDevCtl(msg_t *msg, int port)
 {
 	unsigned int set, clr, t;
@@ -79,6 +508,22 @@ static void gpio_handleDevCtl(msg_t *msg, int port)
 			omsg->val = *(gpio_common.base[port] + gpio_gdir);
 			break;
 
+		case gpio_set_irq :
+			omsg->err = gpio_setIrq(port, imsg->gpio.irq.mask, imsg->gpio.irq.mode);
+			break;
+
+		case gpio_get_overflow :
+			mutexLock(gpio_common.lock);
+			omsg->val = gpio_common.queue[port].overflow;
+			gpio_common.queue[port].overflow = 0;
+			mutexUnlock(gpio_common.lock);
+			break;
+
+		case gpio_script :
+			omsg->err = gpio_runScript(port, msg->i.data, msg->i.size, msg->o.data, msg->o.size, &t);
+			omsg->val = t;
+			break;
+
 		default:
 			omsg->err = -ENOSYS;
 			break;
@@ -86,7 +531,7 @@ static void gpio_handleDevCtl(msg_t *msg, int port)
 }
 
 
-int gpio_handleMsg(msg_t *msg, int dev)
+int gpio_handleMsg(msg_t *msg, int dev, unsigned int rid)
 {
 	dev -= id_gpio1;
 
@@ -95,11 +540,27 @@ int gpio_handleMsg(msg_t *msg, int dev)
 
 	switch (msg->type) {
 		case mtGetAttr:
-		case mtOpen:
+			if (msg->i.attr.type == atPollStatus) {
+				mutexLock(gpio_common.lock);
+				msg->o.attr.val = (gpio_common.queue[dev].tail != gpio_common.queue[dev].head) ? POLLIN : 0;
+				mutexUnlock(gpio_common.lock);
+			}
+			else {
+				msg->o.attr.val = -EINVAL;
+			}
+			break;
+
+		case mtRead:
+			return gpio_read(msg, dev, rid);
+
 		case mtClose:
+			gpio_close(dev, msg->pid);
+			msg->o.io.err = EOK;
+			break;
+
+		case mtOpen:
 		case mtSetAttr :
 		case mtWrite:
-		case mtRead:
 			msg->o.io.err = EOK;
 			break;
 
@@ -116,6 +577,38 @@ int gpio_handleMsg(msg_t *msg, int dev)
 }
 
 
+static int gpio_gptInit(void)
+{
+	static const unsigned int clocks[] = { GPT2_BUS_CLK, GPT2_SERIAL_CLK };
+	int i;
+
+	if ((gpio_common.gpt = GPT2_BASE) == NULL)
+		return -1;
+
+	for (i = 0; i < sizeof(clocks) / sizeof(clocks[0]); ++i) {
+		if (common_setClock(clocks[i], clk_state_run) < 0)
+			return -1;
+	}
+
+	*(gpio_common.gpt + gpt_cr) = 0;
+	*(gpio_common.gpt + gpt_ir) = 0;
+
+	/* Software reset */
+	*(gpio_common.gpt + gpt_cr) = 1 << 15;
+	while (*(gpio_common.gpt + gpt_cr) & (1 << 15))
+		;
+
+	/* 24 MHz oscillator / 12 / 2 = 1 MHz */
+	*(gpio_common.gpt + gpt_pr) = (11 << 12) | 1;
+
+	/* Free running, 24M clock source, counter reset on enable, running in wait mode */
+	*(gpio_common.gpt + gpt_cr) = (1 << 10) | (1 << 9) | (5 << 6) | (1 << 3) | (1 << 1);
+	*(gpio_common.gpt + gpt_cr) |= 1;
+
+	return 0;
+}
+
+
 int gpio_init(void)
 {
 	int i;
@@ -123,6 +616,8 @@ int gpio_init(void)
 	static const void *addresses[] = { GPIO1_BASE, GPIO2_BASE, GPIO3_BASE, GPIO4_BASE,
 		GPIO5_BASE, GPIO6_BASE, GPIO7_BASE, GPIO8_BASE, GPIO9_BASE};
 	static const unsigned int clocks[] = { GPIO1_CLK, GPIO2_CLK, GPIO3_CLK, GPIO4_CLK, GPIO5_CLK };
+	static const unsigned int irqs[] = { GPIO1_IRQ, GPIO2_IRQ, GPIO3_IRQ, GPIO4_IRQ,
+		GPIO5_IRQ, GPIO6_IRQ, GPIO7_IRQ, GPIO8_IRQ, GPIO9_IRQ };
 
 	pctl.action = pctl_set;
 	pctl.type = pctl_devclock;
@@ -137,5 +632,23 @@ int gpio_init(void)
 	for (i = 0; i < sizeof(gpio_common.base) / sizeof(gpio_common.base[0]); ++i)
 		gpio_common.base[i] = (void *)addresses[i];
 
+	if (gpio_gptInit() < 0)
+		return -1;
+
+	if (mutexCreate(&gpio_common.lock) < 0 || mutexCreate(&gpio_common.irqLock) < 0 || condCreate(&gpio_common.cond) < 0)
+		return -1;
+
+	for (i = 0; i < GPIO_PORTS; ++i) {
+		/* Mask and clear all pin interrupts */
+		gpio_common.queue[i].imrshadow = 0;
+		*(gpio_common.base[i] + gpio_imr) = 0;
+		*(gpio_common.base[i] + gpio_isr) = 0xffffffff;
+
+		interrupt(irqs[i], gpio_irqHandler, (void *)i, gpio_common.cond, NULL);
+		interrupt(irqs[i] + 1, gpio_irqHandler, (void *)i, gpio_common.cond, NULL);
+	}
+
+	beginthread(gpio_eventThread, 2, gpio_common.stack, sizeof(gpio_common.stack), NULL);
+
 	return 0;
 }
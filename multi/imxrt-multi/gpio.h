@@ -16,7 +16,8 @@
 
 #define GPIO_PORTS 9
 
-int gpio_handleMsg(msg_t *msg, int dev);
+/* Returns 1 if response to the message has been deferred */
+int gpio_handleMsg(msg_t *msg, int dev, unsigned int rid);
 
 
 int gpio_init(void);
@@ -11,11 +11,15 @@
  * %LICENSE%
  */
 
+#include <sys/interrupt.h>
+#include <sys/threads.h>
 #include <sys/msg.h>
+#include <unistd.h>
 #include <errno.h>
 
 #include "common.h"
 #include "gpio.h"
+#include "i2c.h"
 
 #define I2C1_POS 0
 #define I2C2_POS (I2C1_POS + I2C1)
@@ -24,20 +28,422 @@
 
 #define I2C_CNT (I2C1 + I2C2 + I2C3 + I2C4)
 
+/* Timeout in us, restarted whenever transaction makes progress */
+#define I2C_TIMEOUT 100000
+
 static const int i2cConfig[] = { I2C1, I2C2, I2C3, I2C4 };
 
 
 static const int i2cPos[] = { I2C1_POS, I2C2_POS, I2C3_POS, I2C4_POS };
 
 
+/* CCM registers */
+enum { ccm_cscdr2 = 14 };
+
+
 enum { veridr = 0, paramr, mcr = 4, msr, mier, mder, mscfgr0, mscfgr1, mscfgr2, mscfgr3, mdmr = 16,
 	mccr0 = 18, mccr1 = 20, mfcr = 22, mfsr, mtdr, mrdr = 28, scr = 68, ssr, sier, sder,
 	scfgr1 = 73, scfgr2, samr = 80, sasr = 84, star, stdr= 88, srdr= 92 };
 
 
+/* Master command words */
+enum { cmd_tx = 0, cmd_rx, cmd_stop, cmd_rxdiscard, cmd_start, cmd_startnack };
+
+
+/* Master status flags */
+#define MSR_TDF (1 << 0)
+#define MSR_RDF (1 << 1)
+#define MSR_SDF (1 << 9)
+#define MSR_NDF (1 << 10)
+#define MSR_ALF (1 << 11)
+#define MSR_FEF (1 << 12)
+#define MSR_PLTF (1 << 13)
+#define MSR_MBF (1 << 24)
+#define MSR_ERR (MSR_NDF | MSR_ALF | MSR_FEF | MSR_PLTF)
+
+
+struct {
+	volatile uint32_t *base;
+
+	handle_t mutex;
+	handle_t irqLock;
+	handle_t cond;
+	handle_t inth;
+
+	volatile int ready;
+	unsigned int txFifoSz;
+} i2c_common[I2C_CNT];
+
+
+static int i2c_irqHandler(unsigned int n, void *arg)
+{
+	int i2c = (int)arg;
+
+	*(i2c_common[i2c].base + mier) = 0;
+	i2c_common[i2c].ready = 1;
+
+	return 0;
+}
+
+
+/* Waits until deadline at most */
+static int i2c_waitForIrq(int i2c, uint32_t mask, time_t deadline)
+{
+	int err = EOK;
+	time_t now;
+
+	mutexLock(i2c_common[i2c].irqLock);
+	i2c_common[i2c].ready = 0;
+
+	*(i2c_common[i2c].base + mier) = mask;
+
+	while (!i2c_common[i2c].ready) {
+		gettime(&now, NULL);
+		if (now >= deadline || condWait(i2c_common[i2c].cond, i2c_common[i2c].irqLock, deadline - now) < 0) {
+			*(i2c_common[i2c].base + mier) = 0;
+			err = -ETIMEDOUT;
+			break;
+		}
+	}
+
+	mutexUnlock(i2c_common[i2c].irqLock);
+
+	return err;
+}
+
+
+static void i2c_recover(int i2c)
+{
+	volatile uint32_t *base = i2c_common[i2c].base;
+	int i;
+
+	/* Drop pending commands and data */
+	*(base + mcr) |= (1 << 8) | (1 << 9);
+
+	if (*(base + msr) & MSR_MBF) {
+		*(base + msr) = MSR_ERR;
+		*(base + mtdr) = cmd_stop << 8;
+
+		for (i = 0; i < 1000 && (*(base + msr) & MSR_MBF); ++i)
+			usleep(10);
+	}
+
+	/* Clear all status flags */
+	*(base + msr) = 0x7f00;
+}
+
+
+static inline unsigned int i2c_txFifoFree(int i2c)
+{
+	return i2c_common[i2c].txFifoSz - (*(i2c_common[i2c].base + mfsr) & 0x7);
+}
+
+
+static int i2c_performTransaction(int i2c, uint8_t addr, const uint8_t *txBuff, size_t txLen, uint8_t *rxBuff, size_t rxLen)
+{
+	volatile uint32_t *base = i2c_common[i2c].base;
+	enum { stage_wrstart, stage_tx, stage_rdstart, stage_rx, stage_stop, stage_done } stage;
+	size_t txCnt = 0, rxCmdCnt = 0, rxCnt = 0, n, progress = 0;
+	uint32_t status, mask;
+	time_t deadline = 0;
+	int err = EOK;
+
+	if (!txLen && !rxLen)
+		return -EINVAL;
+
+	stage = (txLen != 0) ? stage_wrstart : stage_rdstart;
+
+	/* Clear status flags from previous transaction */
+	*(base + msr) = 0x7f00;
+
+	while (1) {
+		/* Push as many command words as possible */
+		while (stage != stage_done && i2c_txFifoFree(i2c) > 0) {
+			switch (stage) {
+				case stage_wrstart:
+					*(base + mtdr) = (cmd_start << 8) | (addr << 1);
+					stage = stage_tx;
+					break;
+
+				case stage_tx:
+					*(base + mtdr) = (cmd_tx << 8) | txBuff[txCnt++];
+					if (txCnt == txLen)
+						stage = rxLen ? stage_rdstart : stage_stop;
+					break;
+
+				case stage_rdstart:
+					*(base + mtdr) = (cmd_start << 8) | (addr << 1) | 1;
+					stage = rxLen ? stage_rx : stage_stop;
+					break;
+
+				case stage_rx:
+					/* Single receive command reads up to 256 bytes */
+					n = rxLen - rxCmdCnt;
+					if (n > 256)
+						n = 256;
+					*(base + mtdr) = (cmd_rx << 8) | (n - 1);
+					rxCmdCnt += n;
+					if (rxCmdCnt == rxLen)
+						stage = stage_stop;
+					break;
+
+				case stage_stop:
+					*(base + mtdr) = cmd_stop << 8;
+					stage = stage_done;
+					break;
+
+				default:
+					break;
+			}
+		}
+
+		/* Drain receive FIFO */
+		while (rxCnt < rxLen && ((*(base + mfsr) >> 16) & 0x7))
+			rxBuff[rxCnt++] = *(base + mrdr) & 0xff;
+
+		status = *(base + msr);
+
+		if (status & MSR_ERR) {
+			err = (status & MSR_NDF) ? -ENXIO : -EIO;
+			break;
+		}
+
+		if (stage == stage_done && rxCnt == rxLen && (status & MSR_SDF))
+			break;
+
+		/* Long transfers at low speed take longer than the timeout, only a stall is an error */
+		n = txCnt + rxCmdCnt + rxCnt + stage;
+		if (deadline == 0 || n != progress) {
+			progress = n;
+			gettime(&deadline, NULL);
+			deadline += I2C_TIMEOUT;
+		}
+
+		mask = MSR_SDF | MSR_ERR;
+		if (stage != stage_done)
+			mask |= MSR_TDF;
+		if (rxCnt < rxLen)
+			mask |= MSR_RDF;
+
+		if ((err = i2c_waitForIrq(i2c, mask, deadline)) < 0)
+			break;
+	}
+
+	if (err < 0)
+		i2c_recover(i2c);
+	else
+		*(base + msr) = MSR_SDF;
+
+	return err;
+}
+
+
+/* LPI2C clock root is pll3_sw_clk / 8 or osc_clk, divided by LPI2C_CLK_PODF + 1 */
+static unsigned int i2c_getClock(void)
+{
+	uint32_t cscdr2 = *((volatile uint32_t *)CCM_BASE + ccm_cscdr2);
+	unsigned int root = (cscdr2 & (1 << 18)) ? OSC_CLK : PLL3_SW_CLK / 8;
+
+	return root / (((cscdr2 >> 19) & 0x3f) + 1);
+}
+
+
+static int i2c_setSpeed(int i2c, int speed)
+{
+	volatile uint32_t *base = i2c_common[i2c].base;
+	unsigned int clk, freq, prescale, cycles, clkhi, clklo;
+
+	switch (speed) {
+		case i2c_speed_standard:
+			freq = 100000;
+			break;
+
+		case i2c_speed_fast:
+			freq = 400000;
+			break;
+
+		case i2c_speed_fastplus:
+			freq = 1000000;
+			break;
+
+		default:
+			return -EINVAL;
+	}
+
+	clk = i2c_getClock();
+
+	/* SCL period = (CLKLO + CLKHI + 2) * 2^PRESCALE cycles of functional clock */
+	for (prescale = 0; prescale < 8; ++prescale) {
+		cycles = clk / ((1 << prescale) * freq) - 2;
+		if (cycles <= 104)
+			break;
+	}
+
+	if (prescale == 8)
+		return -EINVAL;
+
+	clkhi = (cycles * 2) / 5;
+	clklo = cycles - clkhi;
+
+	/* Disable master for configuration */
+	*(base + mcr) &= ~1;
+
+	*(base + mscfgr1) = (*(base + mscfgr1) & ~0x7) | prescale;
+	*(base + mccr0) = ((clkhi / 2 + 1) << 24) | (clkhi << 16) | (clkhi << 8) | clklo;
+
+	/* Bus idle timeout after ~2 SCL periods, pin low timeout disabled */
+	*(base + mscfgr2) = (*(base + mscfgr2) & ~0xfff) | ((2 * (clklo + clkhi + 2)) & 0xfff);
+
+	*(base + mcr) |= 1;
+
+	return EOK;
+}
+
+
+static void i2c_handleDevCtl(msg_t *msg, int dev)
+{
+	multi_i_t *idevctl = (multi_i_t *)msg->i.raw;
+	multi_o_t *odevctl = (multi_o_t *)msg->o.raw;
+	int i2c;
+
+	dev -= id_i2c1;
+
+	if (dev >= sizeof(i2cConfig) / sizeof(i2cConfig[0]) || !i2cConfig[dev]) {
+		odevctl->err = -EINVAL;
+		return;
+	}
+
+	i2c = i2cPos[dev];
+
+	mutexLock(i2c_common[i2c].mutex);
+
+	switch (idevctl->i2c.type) {
+		case i2c_config:
+			odevctl->err = i2c_setSpeed(i2c, idevctl->i2c.config.speed);
+			break;
+
+		case i2c_transaction:
+			odevctl->err = i2c_performTransaction(i2c, idevctl->i2c.transaction.addr & 0x7f,
+				msg->i.data, msg->i.data ? msg->i.size : 0, msg->o.data, msg->o.data ? msg->o.size : 0);
+			break;
+
+		default:
+			odevctl->err = -ENOSYS;
+			break;
+	}
+
+	mutexUnlock(i2c_common[i2c].mutex);
+}
+
+
 int i2c_handleMsg(msg_t *msg, int dev)
 {
-	return -1;
+	switch (msg->type) {
+		case mtGetAttr:
+		case mtOpen:
+		case mtClose:
+		case mtSetAttr:
+		case mtWrite:
+		case mtRead:
+			msg->o.io.err = EOK;
+			break;
+
+		case mtDevCtl:
+			i2c_handleDevCtl(msg, dev);
+			break;
+
+		default:
+			msg->o.io.err = -ENOSYS;
+			break;
+	}
+
+	return EOK;
+}
+
+
+static int i2c_muxVal(int mux)
+{
+	switch (mux) {
+		case pctl_mux_gpio_ad_b0_12:
+		case pctl_mux_gpio_ad_b0_13:
+			return 0;
+
+		case pctl_mux_gpio_ad_b1_06:
+		case pctl_mux_gpio_ad_b1_07:
+			return 1;
+
+		case pctl_mux_gpio_ad_b1_00:
+		case pctl_mux_gpio_ad_b1_01:
+		case pctl_mux_gpio_sd_b1_10:
+		case pctl_mux_gpio_sd_b1_11:
+			return 3;
+	}
+
+	return 2;
+}
+
+
+static int i2c_getIsel(int mux, int *isel, int *val)
+{
+	switch (mux) {
+		case pctl_mux_gpio_sd_b1_04: *isel = pctl_isel_lpi2c1_scl; *val = 0; break;
+		case pctl_mux_gpio_ad_b1_00: *isel = pctl_isel_lpi2c1_scl; *val = 1; break;
+		case pctl_mux_gpio_sd_b1_05: *isel = pctl_isel_lpi2c1_sda; *val = 0; break;
+		case pctl_mux_gpio_ad_b1_01: *isel = pctl_isel_lpi2c1_sda; *val = 1; break;
+		case pctl_mux_gpio_sd_b1_11: *isel = pctl_isel_lpi2c2_scl; *val = 0; break;
+		case pctl_mux_gpio_b0_04:    *isel = pctl_isel_lpi2c2_scl; *val = 1; break;
+		case pctl_mux_gpio_sd_b1_10: *isel = pctl_isel_lpi2c2_sda; *val = 0; break;
+		case pctl_mux_gpio_b0_05:    *isel = pctl_isel_lpi2c2_sda; *val = 1; break;
+		case pctl_mux_gpio_emc_22:   *isel = pctl_isel_lpi2c3_scl; *val = 0; break;
+		case pctl_mux_gpio_sd_b0_00: *isel = pctl_isel_lpi2c3_scl; *val = 1; break;
+		case pctl_mux_gpio_ad_b1_07: *isel = pctl_isel_lpi2c3_scl; *val = 2; break;
+		case pctl_mux_gpio_emc_21:   *isel = pctl_isel_lpi2c3_sda; *val = 0; break;
+		case pctl_mux_gpio_sd_b0_01: *isel = pctl_isel_lpi2c3_sda; *val = 1; break;
+		case pctl_mux_gpio_ad_b1_06: *isel = pctl_isel_lpi2c3_sda; *val = 2; break;
+		case pctl_mux_gpio_emc_12:   *isel = pctl_isel_lpi2c4_scl; *val = 0; break;
+		case pctl_mux_gpio_ad_b0_12: *isel = pctl_isel_lpi2c4_scl; *val = 1; break;
+		case pctl_mux_gpio_emc_11:   *isel = pctl_isel_lpi2c4_sda; *val = 0; break;
+		case pctl_mux_gpio_ad_b0_13: *isel = pctl_isel_lpi2c4_sda; *val = 1; break;
+		default: return -1;
+	}
+
+	return 0;
+}
+
+
+static void i2c_initPins(void)
+{
+	int i, isel, val;
+	static const struct {
+		int mux;
+		int pad;
+	} pins[] = {
+#if I2C1
+		{ PIN2MUX(I2C1_SCL_PIN), PIN2PAD(I2C1_SCL_PIN) }, { PIN2MUX(I2C1_SDA_PIN), PIN2PAD(I2C1_SDA_PIN) },
+#endif
+#if I2C2
+		{ PIN2MUX(I2C2_SCL_PIN), PIN2PAD(I2C2_SCL_PIN) }, { PIN2MUX(I2C2_SDA_PIN), PIN2PAD(I2C2_SDA_PIN) },
+#endif
+#if I2C3
+		{ PIN2MUX(I2C3_SCL_PIN), PIN2PAD(I2C3_SCL_PIN) }, { PIN2MUX(I2C3_SDA_PIN), PIN2PAD(I2C3_SDA_PIN) },
+#endif
+#if I2C4
+		{ PIN2MUX(I2C4_SCL_PIN), PIN2PAD(I2C4_SCL_PIN) }, { PIN2MUX(I2C4_SDA_PIN), PIN2PAD(I2C4_SDA_PIN) },
+#endif
+	};
+
+	for (i = 0; i < sizeof(pins) / sizeof(pins[0]); ++i) {
+		/* Input path has to be forced for open drain operation */
+		common_setMux(pins[i].mux, 1, i2c_muxVal(pins[i].mux));
+
+		/* Open drain, 22k pull-up */
+		common_setPad(pins[i].pad, 0, 3, 1, 1, 1, 2, 6, 0);
+
+		if (i2c_getIsel(pins[i].mux, &isel, &val) < 0)
+			continue;
+
+		common_setInput(isel, val);
+	}
 }
 
 
@@ -56,17 +462,52 @@ int i2c_init(void)
 		{ I2C4_BASE, I2C4_CLK, I2C4_IRQ }
 	};
 
-	/* FIXME: remove following statements when driver implementation will be finished */
-	(void)i;
-	(void)i2cPos;
+	i2c_initPins();
 
-	/* TODO: initialize peripherals */
 	for (i = 0, dev = 0; dev < sizeof(i2cConfig) / sizeof(i2cConfig[0]); ++dev) {
 		if (!i2cConfig[dev])
 			continue;
 
 		if (common_setClock(info[dev].clk, clk_state_run) < 0)
 			return -EFAULT;
+
+		if (condCreate(&i2c_common[i].cond) != EOK)
+			return -ENOENT;
+
+		if (mutexCreate(&i2c_common[i].mutex) != EOK) {
+			resourceDestroy(i2c_common[i].cond);
+			return -ENOENT;
+		}
+
+		if (mutexCreate(&i2c_common[i].irqLock) != EOK) {
+			resourceDestroy(i2c_common[i].cond);
+			resourceDestroy(i2c_common[i].mutex);
+			return -ENOENT;
+		}
+
+		i2c_common[i].base = info[dev].base;
+		i2c_common[i].ready = 1;
+
+		/* Software reset */
+		*(i2c_common[i].base + mcr) = 1 << 1;
+		*(i2c_common[i].base + mcr) = 0;
+
+		i2c_common[i].txFifoSz = 1 << (*(i2c_common[i].base + paramr) & 0xf);
+
+		/* Watermarks: TX FIFO empty, RX FIFO not empty */
+		*(i2c_common[i].base + mfcr) = 0;
+
+		/* Glitch filters */
+		*(i2c_common[i].base + mscfgr2) = (2 << 24) | (2 << 16);
+
+		*(i2c_common[i].base + mier) = 0;
+
+		interrupt(info[dev].irq, i2c_irqHandler, (void *)i, i2c_common[i].cond, &i2c_common[i].inth);
+
+		/* Enables master */
+		i2c_setSpeed(i, i2c_speed_standard);
+
+		++i;
 	}
 
 	return 0;
@@ -40,20 +40,140 @@
 #define THREADS_PRIORITY 2
 #define STACKSZ 512
 
+/* Each SPI and I2C bus is served by its own worker */
+#define BUS_WORKERS_NO (id_i2c4 - id_spi1 + 1)
+
+/* Requests waiting for a bus at most, more are refused with -EBUSY */
+#define BUS_QUEUE_LEN 16
+
+
+typedef struct _multi_req_t {
+	struct _multi_req_t *next;
+
+	msg_t msg;
+	unsigned int rid;
+} multi_req_t;
+
+
+typedef struct {
+	id_t id;
+	multi_req_t *queue; /* sorted by message priority */
+	unsigned int queued;
+
+	handle_t lock;
+	handle_t cond;
+
+	char stack[STACKSZ] __attribute__ ((aligned(8)));
+} multi_worker_t;
+
 
 struct {
 	uint32_t uart_port;
 	char stack[MULTI_THREADS_NO + UART_THREADS_NO - 1][STACKSZ] __attribute__ ((aligned(8)));
+
+	multi_worker_t workers[BUS_WORKERS_NO];
 } common;
 
 
-static void multi_dispatchMsg(msg_t *msg)
+static const int busConfig[] = { SPI1, SPI2, SPI3, SPI4, I2C1, I2C2, I2C3, I2C4 };
+
+
+static void multi_handleBusMsg(msg_t *msg, id_t id)
+{
+	if (id >= id_i2c1)
+		i2c_handleMsg(msg, id);
+	else
+		spi_handleMsg(msg, id);
+}
+
+
+static void multi_worker(void *arg)
+{
+	multi_worker_t *worker = (multi_worker_t *)arg;
+	multi_req_t *req;
+
+	for (;;) {
+		mutexLock(worker->lock);
+		while ((req = worker->queue) == NULL)
+			condWait(worker->cond, worker->lock, 0);
+		worker->queue = req->next;
+		worker->queued--;
+		mutexUnlock(worker->lock);
+
+		priority(req->msg.priority);
+		multi_handleBusMsg(&req->msg, worker->id);
+		priority(THREADS_PRIORITY);
+
+		msgRespond(multi_port, &req->msg, req->rid);
+		free(req);
+	}
+}
+
+
+/* Returns 1 if message has been passed to the bus worker */
+static int multi_queueBusMsg(msg_t *msg, unsigned int rid, id_t id)
+{
+	multi_worker_t *worker;
+	multi_req_t *req, **prev;
+
+	/* Only transactions may take long, disabled buses respond immediately */
+	if (msg->type != mtDevCtl || !busConfig[id - id_spi1]) {
+		multi_handleBusMsg(msg, id);
+		return 0;
+	}
+
+	worker = &common.workers[id - id_spi1];
+
+	mutexLock(worker->lock);
+	if (worker->queued >= BUS_QUEUE_LEN) {
+		mutexUnlock(worker->lock);
+		msg->o.io.err = -EBUSY;
+		return 0;
+	}
+
+	if ((req = malloc(sizeof(multi_req_t))) == NULL) {
+		mutexUnlock(worker->lock);
+		msg->o.io.err = -ENOMEM;
+		return 0;
+	}
+
+	req->msg = *msg;
+	req->rid = rid;
+	worker->queued++;
+
+	/* Lower value means higher priority, FIFO order within the same priority */
+	for (prev = &worker->queue; *prev != NULL && (*prev)->msg.priority <= msg->priority; prev = &(*prev)->next)
+		;
+	req->next = *prev;
+	*prev = req;
+	condSignal(worker->cond);
+	mutexUnlock(worker->lock);
+
+	return 1;
+}
+
+
+static int multi_dispatchMsg(msg_t *msg, unsigned int rid)
 {
 	id_t id;
 	multi_i_t *imsg;
 
-	imsg = (multi_i_t *)msg->i.raw;
-	id = imsg->id;
+	switch (msg->type) {
+		case mtRead:
+		case mtWrite:
+			id = msg->i.io.oid.id;
+			break;
+
+		case mtGetAttr:
+		case mtSetAttr:
+			id = msg->i.attr.oid.id;
+			break;
+
+		default:
+			imsg = (multi_i_t *)msg->i.raw;
+			id = imsg->id;
+			break;
+	}
 
 	switch (id) {
 		case id_gpio1:
@@ -65,26 +185,23 @@ static void multi_dispatchMsg(msg_t *msg)
 		case id_gpio7:
 		case id_gpio8:
 		case id_gpio9:
-			gpio_handleMsg(msg, id);
-			break;
+			return gpio_handleMsg(msg, id, rid) > 0;
 
 		case id_spi1:
 		case id_spi2:
 		case id_spi3:
 		case id_spi4:
-			spi_handleMsg(msg, id);
-			break;
-
 		case id_i2c1:
 		case id_i2c2:
 		case id_i2c3:
 		case id_i2c4:
-			i2c_handleMsg(msg, id);
-			break;
+			return multi_queueBusMsg(msg, rid, id);
 
 		default:
-			return;
+			break;
 	}
+
+	return 0;
 }
 
 
@@ -244,6 +361,7 @@ static int createDevFiles(void)
 
 #if SPI4
 	if (mkFile(&dir, id_spi4, "spi4", multi_port) < 0)
+		return -1;
 #endif
 
 
@@ -288,7 +406,9 @@ static void multi_thread(void *arg)
 			case mtGetAttr:
 			case mtSetAttr:
 			case mtDevCtl:
-				multi_dispatchMsg(&msg);
+				/* Response may be deferred, e.g. for blocking read or bus transaction */
+				if (multi_dispatchMsg(&msg, rid))
+					continue;
 				break;
 
 			case mtOpen:
@@ -361,7 +481,7 @@ static void uart_thread(void *arg)
 
 int main(void)
 {
-	int i;
+	int i, j;
 
 	portCreate(&common.uart_port);
 	portCreate(&multi_port);
@@ -369,6 +489,7 @@ int main(void)
 	uart_init();
 	gpio_init();
 	spi_init();
+	i2c_init();
 
 	for (i = 0; i < UART_THREADS_NO; ++i)
 		beginthread(uart_thread, THREADS_PRIORITY, common.stack[i], STACKSZ, (void *)i);
@@ -376,6 +497,22 @@ int main(void)
 	for (; i < (MULTI_THREADS_NO + UART_THREADS_NO - 1); ++i)
 		beginthread(multi_thread, THREADS_PRIORITY, common.stack[i], STACKSZ, (void *)i);
 
+	for (j = 0; j < BUS_WORKERS_NO; ++j) {
+		if (!busConfig[j])
+			continue;
+
+		common.workers[j].id = id_spi1 + j;
+		common.workers[j].queue = NULL;
+		common.workers[j].queued = 0;
+
+		if (mutexCreate(&common.workers[j].lock) < 0 || condCreate(&common.workers[j].cond) < 0) {
+			printf("imxrt-multi: bus worker initialization failed\n");
+			return -1;
+		}
+
+		beginthread(multi_worker, THREADS_PRIORITY, common.workers[j].stack, STACKSZ, &common.workers[j]);
+	}
+
 	if (createDevFiles() < 0) {
 		printf("imxrt-multi: createSpecialFiles failed\n");
 		return -1;
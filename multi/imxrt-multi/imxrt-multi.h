@@ -15,6 +15,7 @@
 #define _IMXRT_MULTI_H_
 
 #include <stdlib.h>
+#include <sys/ioctl.h>
 
 /* IDs of special files OIDs */
 enum { id_console = 0, id_uart1, id_uart2, id_uart3, id_uart4, id_uart5, id_uart6, id_uart7, id_uart8,
@@ -25,11 +26,49 @@ enum { id_console = 0, id_uart1, id_uart2, id_uart3, id_uart4, id_uart5, id_uart
 #pragma pack(push, 8)
 
 
+/* UART */
+
+
+/*
+ * Receive overruns of UART with DMA, read with ioctl(fd, UART_IOC_GETOVERRUN, &ov).
+ * Counters are zero for UARTs without DMA.
+ */
+typedef struct {
+	unsigned int rxoverrun; /* times received data was overwritten before it was read */
+	unsigned int hwoverrun; /* overrun errors reported by LPUART */
+} uart_overrun_t;
+
+
+#define UART_IOC_GETOVERRUN _IOR('u', 0x01, uart_overrun_t)
+
+
 /* GPIO */
 
 
+enum { gpio_irq_none = 0, gpio_irq_low, gpio_irq_high, gpio_irq_rising, gpio_irq_falling, gpio_irq_both };
+
+
+enum { gpio_op_set = 0, gpio_op_clear, gpio_op_toggle, gpio_op_read, gpio_op_delay, gpio_op_wait_high, gpio_op_wait_low };
+
+
+/*
+ * Script operation executed by gpio_script devctl. Script is passed in
+ * msg.i.data as an array of gpio_op_t, values captured by gpio_op_read
+ * (port state & mask) are returned in msg.o.data as an array of unsigned int
+ * and their number in val. Script is executed with port locked, wait steps
+ * fail with -ETIMEDOUT if level is not reached in time. Script is limited
+ * to 64 steps and 100 ms of delays and timeouts in total, the lock is
+ * released during delays and waits longer than 100 us.
+ */
 typedef struct {
-	enum { gpio_set_port = 0, gpio_get_port, gpio_set_dir, gpio_get_dir } type;
+	unsigned short op;
+	unsigned short us;  /* delay or wait timeout */
+	unsigned int mask;
+} gpio_op_t;
+
+
+typedef struct {
+	enum { gpio_set_port = 0, gpio_get_port, gpio_set_dir, gpio_get_dir, gpio_set_irq, gpio_get_overflow, gpio_script } type;
 
 	union {
 		struct {
@@ -41,10 +80,27 @@ typedef struct {
 			unsigned int mask;
 			unsigned int val;
 		} dir;
+
+		struct {
+			unsigned int mask;
+			unsigned int mode;
+		} irq;
 	};
 } gpio_t;
 
 
+/*
+ * Pin interrupt events are read from gpio device with mtRead, which blocks
+ * until at least one event is available. Level triggered pins are masked
+ * after each event and rearmed when the event is read.
+ */
+typedef struct {
+	unsigned long long timestamp; /* us */
+	unsigned int pins;            /* pins which triggered the event */
+	unsigned int val;             /* port state */
+} gpio_event_t;
+
+
 
 /* SPI */
 
@@ -55,8 +111,24 @@ enum { spi_msb = 0, spi_lsb = 1};
 enum { spi_mode_0 = 0, spi_mode_1, spi_mode_2, spi_mode_3 };
 
 
+/*
+ * spi_segments executes count segments back to back in one request.
+ * msg.i.data holds spi_segment_t[count] followed by TX data of all
+ * segments, RX data of all segments is returned in msg.o.data. Segment
+ * with hold set keeps PCS asserted, so the next segment has to use the
+ * same cs and mode. Delay is applied after the segment.
+ */
 typedef struct {
-	enum { spi_config = 0, spi_transaction } type;
+	unsigned short len;
+	unsigned short delay; /* us */
+	unsigned char cs;
+	unsigned char mode;
+	unsigned char hold;
+} spi_segment_t;
+
+
+typedef struct {
+	enum { spi_config = 0, spi_transaction, spi_segments } type;
 
 	union {
 		struct {
@@ -71,12 +143,44 @@ typedef struct {
 			unsigned int frameSize;
 			unsigned char cs;
 		} transaction;
+
+		struct {
+			unsigned int count;
+		} segments;
 	};
 
 } spi_t;
 
 
 
+/* I2C */
+
+
+enum { i2c_speed_standard = 0, i2c_speed_fast, i2c_speed_fastplus };
+
+
+/*
+ * i2c_transaction writes msg.i.size bytes from msg.i.data to the slave,
+ * then (repeated start) reads msg.o.size bytes into msg.o.data. Either
+ * part may be empty, the transaction always ends with a stop condition.
+ */
+typedef struct {
+	enum { i2c_config = 0, i2c_transaction } type;
+
+	union {
+		struct {
+			unsigned char speed;
+		} config;
+
+		struct {
+			unsigned char addr;
+		} transaction;
+	};
+
+} i2c_t;
+
+
+
 /* MULTI */
 
 
@@ -86,6 +190,7 @@ typedef struct _multi_i_t {
 	union {
 		gpio_t gpio;
 		spi_t spi;
+		i2c_t i2c;
 	};
 
 } multi_i_t;
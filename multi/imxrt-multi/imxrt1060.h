@@ -47,6 +47,23 @@
 #define UART7_IRQ 26 + 16
 #define UART8_IRQ 27 + 16
 
+#define UART1_DMA_TX_REQ 2
+#define UART1_DMA_RX_REQ 3
+#define UART2_DMA_TX_REQ 66
+#define UART2_DMA_RX_REQ 67
+#define UART3_DMA_TX_REQ 4
+#define UART3_DMA_RX_REQ 5
+#define UART4_DMA_TX_REQ 68
+#define UART4_DMA_RX_REQ 69
+#define UART5_DMA_TX_REQ 6
+#define UART5_DMA_RX_REQ 7
+#define UART6_DMA_TX_REQ 70
+#define UART6_DMA_RX_REQ 71
+#define UART7_DMA_TX_REQ 8
+#define UART7_DMA_RX_REQ 9
+#define UART8_DMA_TX_REQ 72
+#define UART8_DMA_RX_REQ 73
+
 #define GPIO1_BASE ((void *)0x401b8000)
 #define GPIO2_BASE ((void *)0x401bc000)
 #define GPIO3_BASE ((void *)0x401c0000)
@@ -63,6 +80,22 @@
 #define GPIO4_CLK pctl_clk_gpio4
 #define GPIO5_CLK pctl_clk_gpio5
 
+/* IRQ of pins 0-15, pins 16-31 use the next one */
+#define GPIO1_IRQ 80 + 16
+#define GPIO2_IRQ 82 + 16
+#define GPIO3_IRQ 84 + 16
+#define GPIO4_IRQ 86 + 16
+#define GPIO5_IRQ 88 + 16
+#define GPIO6_IRQ GPIO1_IRQ
+#define GPIO7_IRQ GPIO2_IRQ
+#define GPIO8_IRQ GPIO3_IRQ
+#define GPIO9_IRQ GPIO4_IRQ
+
+/* GPT2 counts microseconds for GPIO event timestamps, GPT1 belongs to the kernel */
+#define GPT2_BASE ((void *)0x401f0000)
+#define GPT2_BUS_CLK pctl_clk_gpt2_bus
+#define GPT2_SERIAL_CLK pctl_clk_gpt2_serial
+
 #define LPSPI1_BASE ((void *)0x40394000)
 #define LPSPI2_BASE ((void *)0x40398000)
 #define LPSPI3_BASE ((void *)0x4039c000)
@@ -78,6 +111,19 @@
 #define LPSPI3_IRQ 34 + 16
 #define LPSPI4_IRQ 35 + 16
 
+#define LPSPI1_DMA_RX_REQ 13
+#define LPSPI1_DMA_TX_REQ 14
+#define LPSPI2_DMA_RX_REQ 77
+#define LPSPI2_DMA_TX_REQ 78
+#define LPSPI3_DMA_RX_REQ 15
+#define LPSPI3_DMA_TX_REQ 16
+#define LPSPI4_DMA_RX_REQ 79
+#define LPSPI4_DMA_TX_REQ 80
+
+#define CCM_BASE ((void *)0x400fc000)
+#define PLL3_SW_CLK 480000000
+#define OSC_CLK 24000000
+
 #define I2C1_BASE ((void *)0x403f0000)
 #define I2C2_BASE ((void *)0x403f4000)
 #define I2C3_BASE ((void *)0x403f8000)
@@ -64,6 +64,10 @@
 #define GPIO4_CLK -1
 #define GPIO5_CLK -1
 
+#define GPT2_BASE ((void *)NULL)
+#define GPT2_BUS_CLK -1
+#define GPT2_SERIAL_CLK -1
+
 #define UART1_TX_PIN ad_24
 #define UART1_RX_PIN ad_25
 #define UART1_RTS_PIN ad_27
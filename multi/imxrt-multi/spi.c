@@ -16,9 +16,13 @@
 #include <sys/threads.h>
 #include <sys/pwman.h>
 #include <sys/msg.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <string.h>
 #include <errno.h>
 
+#include <edma.h>
+#include <spi-pack.h>
 
 #include "imxrt-multi.h"
 #include "common.h"
@@ -35,6 +39,20 @@
 #define MAX_FRAME_SZ 0x1000
 #define WORD_SIZE sizeof(uint32_t)
 #define MAX_FIFOSZ_BYTES 16 * WORD_SIZE
+#define DMA_BUFSZ 0x1000
+#define FIFO_TIMEOUT_US 100000
+
+/* Lowest LPSPI functional clock expected, bounds DMA transfer time */
+#define SPI_CLK_MIN 24000000
+
+/* Longer delays between segments are slept */
+#define SPI_SPIN_US 100
+
+#define TCR_FRAMESZ 0xfff
+#define TCR_CONTC (1 << 20)
+#define TCR_CONT (1 << 21)
+#define TCR_PCS (0x3 << 24)
+#define TCR_MODE (0x3 << 30)
 
 
 enum { spi_verid = 0, spi_param, spi_cr = 0x4, spi_sr, spi_ier, spi_der, spi_cfgr0, spi_cfgr1, spi_dmr0 = 0xc,
@@ -52,6 +70,14 @@ struct {
 	volatile uint32_t *base;
 
 	uint32_t tcr;
+
+	struct {
+		int enabled;
+		unsigned int rxch;
+		unsigned int txch;
+		uint8_t *buff;
+		handle_t inth;
+	} dma;
 } spi_common[SPI_CNT];
 
 
@@ -61,21 +87,20 @@ static const int spiConfig[] = { SPI1, SPI2, SPI3, SPI4 };
 static const int spiPos[] = { SPI1_POS, SPI2_POS, SPI3_POS, SPI4_POS };
 
 
-static inline uint32_t spi_deserializeWord(const uint8_t *buff)
-{
-	uint32_t word = 0;
-
-	word = buff[3] | (buff[2] << 8) | (buff[1] << 16) | (buff[0] << 24);
-
-	return word;
-}
-
-
-static inline void spi_serializeWord(uint8_t *buff, uint32_t word, int8_t start)
-{
-	for (int i = start - 1; i >= 0; --i)
-		*buff++ = (word >> (i * 8)) & 0xff;
-}
+#if SPI_DMA
+static const struct {
+	int enabled;
+	unsigned int rxch;
+	unsigned int txch;
+	unsigned int rxreq;
+	unsigned int txreq;
+} spiDmaConfig[] = {
+	{ SPI1_DMA, SPI1_DMA_RXCH, SPI1_DMA_TXCH, LPSPI1_DMA_RX_REQ, LPSPI1_DMA_TX_REQ },
+	{ SPI2_DMA, SPI2_DMA_RXCH, SPI2_DMA_TXCH, LPSPI2_DMA_RX_REQ, LPSPI2_DMA_TX_REQ },
+	{ SPI3_DMA, SPI3_DMA_RXCH, SPI3_DMA_TXCH, LPSPI3_DMA_RX_REQ, LPSPI3_DMA_TX_REQ },
+	{ SPI4_DMA, SPI4_DMA_RXCH, SPI4_DMA_TXCH, LPSPI4_DMA_RX_REQ, LPSPI4_DMA_TX_REQ }
+};
+#endif
 
 
 static int spi_irqHandler(unsigned int n, void *arg)
@@ -118,62 +143,215 @@ static void spi_initRcv(int spi)
 
 static void spi_txBytes(int spi, const uint8_t *txBuff, int bytesNumber)
 {
-	uint32_t word;
+	/* Partial word goes last */
+	spi_writeFifo(spi_common[spi].base + spi_tdr, txBuff, bytesNumber, 1);
+}
+
+
+static void spi_rxBytes(int spi, uint8_t *rxBuff, int bytesNumber)
+{
+	spi_readFifo(spi_common[spi].base + spi_rdr, rxBuff, bytesNumber, 1);
+}
+
+
+/* Negates PCS after continuous transfer */
+static int spi_endContinuous(int spi, uint32_t tcr)
+{
+	time_t start, now;
 
-	while (bytesNumber / WORD_SIZE) {
-		*(spi_common[spi].base + spi_tdr) = spi_deserializeWord(txBuff);
-		txBuff += WORD_SIZE;
-		bytesNumber -= WORD_SIZE;
+	*(spi_common[spi].base + spi_tcr) = (tcr & ~(TCR_FRAMESZ | TCR_CONT | TCR_CONTC)) | 7;
+
+	gettime(&start, NULL);
+	while (*(spi_common[spi].base + spi_fsr) & 0x1f) {
+		gettime(&now, NULL);
+		if ((now - start) > FIFO_TIMEOUT_US)
+			return -ETIMEDOUT;
 	}
 
-	if (bytesNumber) {
-		word = 0;
-		while (bytesNumber--)
-			word = (word << 8) | *txBuff++;
-		*(spi_common[spi].base + spi_tdr) = word;
+	return EOK;
+}
+
+
+#if SPI_DMA
+static int spi_dmaIrqHandler(unsigned int n, void *arg)
+{
+	int spi = (int)arg;
+
+	/* IRQ line may be shared with other eDMA channel */
+	if (!edma_is_done(spi_common[spi].dma.rxch))
+		return -1;
+
+	edma_clear_interrupt(spi_common[spi].dma.rxch);
+	spi_common[spi].ready = 1;
+
+	return 0;
+}
+
+
+/* Twice the time of len bytes at configured SCK rate, plus time for FIFO handling */
+static time_t spi_dmaTimeout(int spi, int len)
+{
+	uint32_t sckdiv;
+
+	sckdiv = ((*(spi_common[spi].base + spi_ccr) & 0xff) + 2) << ((spi_common[spi].tcr >> 27) & 0x7);
+
+	return (time_t)len * 8 * sckdiv * 2 * 1000000 / SPI_CLK_MIN + FIFO_TIMEOUT_US;
+}
+
+
+static int spi_dmaTransfer(int spi, int len)
+{
+	volatile struct edma_tcd_s tcd;
+	uint32_t chmask = (1 << spi_common[spi].dma.rxch) | (1 << spi_common[spi].dma.txch);
+	time_t now, end;
+	int err = EOK;
+
+	/* RX: RDR -> buffer, interrupt on completion */
+	tcd.saddr = (uint32_t)(spi_common[spi].base + spi_rdr);
+	tcd.soff = 0;
+	tcd.attr = (edma_get_tcd_attr_xsize(1) << 8) | edma_get_tcd_attr_xsize(1);
+	tcd.nbytes_mlno = 1;
+	tcd.slast = 0;
+	tcd.daddr = (uint32_t)spi_common[spi].dma.buff;
+	tcd.doff = 1;
+	tcd.citer_elinkno = len;
+	tcd.biter_elinkno = len;
+	tcd.dlast_sga = 0;
+	tcd.csr = (1 << 3) | (1 << 1);
+	edma_install_tcd(&tcd, spi_common[spi].dma.rxch);
+
+	/*
+	 * TX: buffer -> TDR. The same buffer is used for both directions,
+	 * byte n is received only after it has been read by TX channel.
+	 */
+	tcd.saddr = (uint32_t)spi_common[spi].dma.buff;
+	tcd.soff = 1;
+	tcd.daddr = (uint32_t)(spi_common[spi].base + spi_tdr);
+	tcd.doff = 0;
+	tcd.csr = 1 << 3;
+	edma_install_tcd(&tcd, spi_common[spi].dma.txch);
+
+	common_dataSyncBarrier();
+
+	/* Drop errors left by an earlier transfer */
+	common_dmaErrors(chmask);
+
+	gettime(&now, NULL);
+	end = now + spi_dmaTimeout(spi, len);
+
+	mutexLock(spi_common[spi].irqLock);
+	spi_common[spi].ready = 0;
+
+	edma_channel_enable(spi_common[spi].dma.rxch);
+	edma_channel_enable(spi_common[spi].dma.txch);
+
+	/* Error interrupt doesn't wake us, errors are noticed at the latest on timeout */
+	while (!spi_common[spi].ready) {
+		if (common_dmaErrors(chmask) != 0) {
+			err = -EIO;
+			break;
+		}
+
+		if (now >= end) {
+			err = -ETIMEDOUT;
+			break;
+		}
+
+		condWait(spi_common[spi].cond, spi_common[spi].irqLock, end - now);
+		gettime(&now, NULL);
+	}
+
+	mutexUnlock(spi_common[spi].irqLock);
+
+	if (err == EOK && common_dmaErrors(chmask) != 0)
+		err = -EIO;
+
+	if (err < 0) {
+		edma_channel_disable(spi_common[spi].dma.rxch);
+		edma_channel_disable(spi_common[spi].dma.txch);
+		edma_clear_interrupt(spi_common[spi].dma.rxch);
+
+		/* Reset FIFOs, they may hold data the channels didn't move */
+		*(spi_common[spi].base + spi_cr) |= (1 << 9) | (1 << 8);
 	}
+
+	return err;
 }
 
 
-static void spi_rxBytes(int spi, uint8_t *rxBuff, int bytesNumber)
+static int spi_dmaTransaction(int spi, uint32_t tcr, const uint8_t *txBuff, uint8_t *rxBuff, int len, int hold)
 {
-	uint32_t word;
-
-	/* Get data from RX Fifo */
-	while (bytesNumber / WORD_SIZE) {
-		word = *(spi_common[spi].base + spi_rdr);
-		spi_serializeWord(rxBuff, word, WORD_SIZE);
-		rxBuff += WORD_SIZE;
-		bytesNumber -= WORD_SIZE;
+	int chunk, done, res = 0;
+	uint32_t fcr;
+
+	/* Request TX data when at least half of FIFO is free */
+	fcr = *(spi_common[spi].base + spi_fcr);
+	*(spi_common[spi].base + spi_fcr) = (fcr & ~0xf) | 0x7;
+	*(spi_common[spi].base + spi_der) = 0x3;
+
+	/* Byte frames, continuous transfer keeps PCS asserted until the last byte */
+	*(spi_common[spi].base + spi_tcr) = (tcr & ~TCR_FRAMESZ) | TCR_CONT | 7;
+
+	for (done = 0; done < len; done += chunk) {
+		chunk = len - done;
+		if (chunk > DMA_BUFSZ)
+			chunk = DMA_BUFSZ;
+
+		memcpy(spi_common[spi].dma.buff, txBuff + done, chunk);
+		if ((res = spi_dmaTransfer(spi, chunk)) < 0)
+			break;
+		memcpy(rxBuff + done, spi_common[spi].dma.buff, chunk);
 	}
 
-	if (bytesNumber) {
-		word = *(spi_common[spi].base + spi_rdr);
-		spi_serializeWord(rxBuff, word, bytesNumber);
-		rxBuff += bytesNumber;
+	/* PCS is negated on error even if it was to be held */
+	if (!hold || res < 0) {
+		if (spi_endContinuous(spi, tcr) < 0 && res == 0)
+			res = -ETIMEDOUT;
 	}
+
+	*(spi_common[spi].base + spi_der) = 0;
+	*(spi_common[spi].base + spi_fcr) = fcr;
+
+	return res < 0 ? res : len;
 }
 
 
-static int spi_performTranscation(int spi, unsigned char cs, const uint8_t *txBuff, uint8_t *rxBuff, int len)
+static int spi_dmaInit(int spi, int dev)
 {
-	int size = len;
-	int rxTotalBytes = 0;
-	int txFifoBytes, rxFifoBytes;
-	uint32_t txWordsCnt, rxWordsCnt;
+	if (common_initDma() < 0)
+		return -EIO;
 
-	if (!spiConfig[spi])
-		return -EINVAL;
+	spi_common[spi].dma.buff = mmap(NULL, DMA_BUFSZ, PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_NULL, 0);
 
-	if ((len * 8) > MAX_FRAME_SZ)
-		return -EINVAL;
+	if (spi_common[spi].dma.buff == MAP_FAILED)
+		return -ENOMEM;
 
-	spi = spiPos[spi];
+	spi_common[spi].dma.rxch = spiDmaConfig[dev].rxch;
+	spi_common[spi].dma.txch = spiDmaConfig[dev].txch;
 
-	mutexLock(spi_common[spi].mutex);
+	dmamux_set_source(spi_common[spi].dma.rxch, spiDmaConfig[dev].rxreq);
+	dmamux_set_source(spi_common[spi].dma.txch, spiDmaConfig[dev].txreq);
+	dmamux_channel_enable(spi_common[spi].dma.rxch);
+	dmamux_channel_enable(spi_common[spi].dma.txch);
+
+	interrupt(EDMA_CHANNEL_IRQ(spi_common[spi].dma.rxch), spi_dmaIrqHandler, (void *)spi, spi_common[spi].cond, &spi_common[spi].dma.inth);
+
+	spi_common[spi].dma.enabled = 1;
+
+	return EOK;
+}
+#endif
+
+
+static int spi_fifoTransaction(int spi, uint32_t tcr, const uint8_t *txBuff, uint8_t *rxBuff, int len)
+{
+	int size = len;
+	int rxTotalBytes = 0;
+	int txFifoBytes, rxFifoBytes;
+	uint32_t txWordsCnt, rxWordsCnt;
 
 	/* Initialize Transmit Command Register */
-	*(spi_common[spi].base + spi_tcr) = (spi_common[spi].tcr & ~(0x7ff)) | ((cs & 0x3) << 24) | (len * 8 - 1);
+	*(spi_common[spi].base + spi_tcr) = (tcr & ~TCR_FRAMESZ) | (len * 8 - 1);
 
 	/* Wait until Transmit Command will be taken from  TX fifo */
 	txWordsCnt = *(spi_common[spi].base + spi_fsr) & 0x1f;
@@ -223,9 +401,140 @@ static int spi_performTranscation(int spi, unsigned char cs, const uint8_t *txBu
 		}
 	}
 
+	return rxTotalBytes;
+}
+
+
+/*
+ * Transfers single frame with PCS and mode already set in tcr. With hold
+ * set PCS stays asserted after the frame, next frame has to continue
+ * the transfer (TCR_CONTC) and end it.
+ */
+static int spi_transfer(int spi, uint32_t tcr, const uint8_t *txBuff, uint8_t *rxBuff, int len, int hold)
+{
+	int res;
+
+#if SPI_DMA
+	/* Transfers not fitting in FIFO are handled by DMA if available */
+	if (spi_common[spi].dma.enabled && len > MAX_FIFOSZ_BYTES)
+		return spi_dmaTransaction(spi, tcr, txBuff, rxBuff, len, hold);
+#endif
+
+	if ((len * 8) > MAX_FRAME_SZ)
+		return -EINVAL;
+
+	if (hold)
+		tcr |= TCR_CONT;
+
+	res = spi_fifoTransaction(spi, tcr, txBuff, rxBuff, len);
+
+	if (res >= 0 && !hold && (tcr & TCR_CONT) && spi_endContinuous(spi, tcr) < 0)
+		return -ETIMEDOUT;
+
+	return res;
+}
+
+
+static int spi_performTranscation(int spi, unsigned char cs, const uint8_t *txBuff, uint8_t *rxBuff, int len)
+{
+	int res;
+
+	if (!spiConfig[spi])
+		return -EINVAL;
+
+	spi = spiPos[spi];
+
+	mutexLock(spi_common[spi].mutex);
+	res = spi_transfer(spi, (spi_common[spi].tcr & ~TCR_PCS) | ((cs & 0x3) << 24), txBuff, rxBuff, len, 0);
 	mutexUnlock(spi_common[spi].mutex);
 
-	return rxTotalBytes;
+	return res;
+}
+
+
+/* Bus stays locked, other transactions must not run between segments */
+static void spi_delay(unsigned int us)
+{
+	time_t start, now;
+
+	if (us > SPI_SPIN_US) {
+		usleep(us);
+		return;
+	}
+
+	gettime(&start, NULL);
+	do
+		gettime(&now, NULL);
+	while ((now - start) < us);
+}
+
+
+static int spi_performSegments(int spi, unsigned int count, const void *idata, size_t isize, uint8_t *rxBuff, size_t osize)
+{
+	const spi_segment_t *seg = idata;
+	const uint8_t *txBuff;
+	size_t total = 0;
+	uint32_t tcr = 0;
+	unsigned int i;
+	int res = 0, held = 0;
+
+	if (!spiConfig[spi] || count == 0)
+		return -EINVAL;
+
+	if (count > isize / sizeof(spi_segment_t))
+		return -EINVAL;
+
+	isize -= count * sizeof(spi_segment_t);
+
+	for (i = 0; i < count; ++i) {
+		/* PCS and mode can't change during continuous transfer */
+		if (i > 0 && seg[i - 1].hold && (seg[i].cs != seg[i - 1].cs || seg[i].mode != seg[i - 1].mode))
+			return -EINVAL;
+
+		/* Check against the space left so total can't wrap */
+		if (seg[i].len > isize - total || seg[i].len > osize - total)
+			return -EINVAL;
+
+		total += seg[i].len;
+	}
+
+	if (seg[count - 1].hold)
+		return -EINVAL;
+
+	txBuff = (const uint8_t *)idata + count * sizeof(spi_segment_t);
+	spi = spiPos[spi];
+
+	mutexLock(spi_common[spi].mutex);
+
+	for (i = 0; i < count; ++i) {
+		tcr = (spi_common[spi].tcr & ~(TCR_PCS | TCR_MODE)) | ((seg[i].mode & 0x3) << 30) | ((seg[i].cs & 0x3) << 24);
+		if (held)
+			tcr |= TCR_CONT | TCR_CONTC;
+
+		if (seg[i].len != 0) {
+			if ((res = spi_transfer(spi, tcr, txBuff, rxBuff, seg[i].len, seg[i].hold)) < 0)
+				break;
+		}
+		else if (held && !seg[i].hold) {
+			if ((res = spi_endContinuous(spi, tcr)) < 0)
+				break;
+		}
+
+		held = seg[i].hold;
+		txBuff += seg[i].len;
+		rxBuff += seg[i].len;
+
+		if (seg[i].delay != 0)
+			spi_delay(seg[i].delay);
+	}
+
+	/* Don't leave PCS asserted on error */
+	if (res < 0 && held)
+		spi_endContinuous(spi, tcr);
+
+	mutexUnlock(spi_common[spi].mutex);
+
+	return res < 0 ? res : (int)total;
 }
 
 
@@ -300,6 +609,10 @@ static void spi_handleDevCtl(msg_t *msg, int dev)
 			odevctl->err = spi_performTranscation(dev, idevctl->spi.transaction.cs, txBuff, rxBuff, idevctl->spi.transaction.frameSize);
 			break;
 
+		case spi_segments:
+			odevctl->err = spi_performSegments(dev, idevctl->spi.segments.count, msg->i.data, msg->i.size, rxBuff, msg->o.size);
+			break;
+
 		default:
 			odevctl->err = -ENOSYS;
 			break;
@@ -504,6 +817,9 @@ static void spi_initPins(void)
 int spi_init(void)
 {
 	int i, spi;
+#if SPI_DMA
+	int err;
+#endif
 
 	static const struct {
 		volatile uint32_t *base;
@@ -545,6 +861,11 @@ int spi_init(void)
 
 		interrupt(spi_common[i].irq, spi_irqHandler, (void *)i, spi_common[i].cond, &spi_common[i].inth);
 
+#if SPI_DMA
+		if (spiDmaConfig[spi].enabled && (err = spi_dmaInit(i, spi)) < 0)
+			return err;
+#endif
+
 		/* Disable module */
 		*(spi_common[i].base + spi_cr) = 0;
 		++i;
@@ -20,6 +20,9 @@
 
 #define SPI_TESTS
 
+/* Requires SPI1_DMA enabled in imxrt-multi */
+/* #define SPI_DMA_TESTS */
+
 
 #define TEST_CATEGORY(category)                                         \
 	do {                                                                \
@@ -57,6 +60,10 @@ extern int test_spi_transfer_partially_filled_fifo(void);
 
 extern int test_spi_multiple_transmission(void);
 
+extern int test_spi_transfer_dma_frame(void);
+
+extern int test_spi_transfer_segments(void);
+
 
 int main(int argc, char **argv)
 {
@@ -67,8 +74,17 @@ int main(int argc, char **argv)
 	TEST_CASE(test_spi_transfer_max_frame());
 	TEST_CASE(test_spi_transfer_middle_data_sz());
 	TEST_CASE(test_spi_transfer_partially_filled_fifo());
+#ifndef SPI_DMA_TESTS
 	TEST_CASE(test_spi_transfer_overfilled_frame());
+#endif
 	TEST_CASE(test_spi_multiple_transmission());
+	TEST_CASE(test_spi_transfer_segments());
+#endif
+
+#ifdef SPI_DMA_TESTS
+	TEST_CATEGORY("SPI DMA TESTS");
+
+	TEST_CASE(test_spi_transfer_dma_frame());
 #endif
 
 	return 0;
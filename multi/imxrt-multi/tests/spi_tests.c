@@ -22,7 +22,7 @@
 #include "../imxrt-multi.h"
 
 
-#define MAX_BUFFER_SZ 0x204
+#define MAX_BUFFER_SZ 0x2004
 
 
 struct {
@@ -159,6 +159,27 @@ int test_spi_transfer_overfilled_frame(void)
 }
 
 
+int test_spi_transfer_dma_frame(void)
+{
+	oid_t dir;
+	int rcvSize;
+	const uint16_t buffSz = 0x2000 - 3; /* exceeds DMA bounce buffer */
+
+	dir = test_getOid();
+	test_spiConfig(dir);
+
+	test_setData(buffSz);
+
+	/* Transmit data in a loop - back (MOSI --> MISO) */
+	rcvSize = test_spiTransmit(dir, test_common.tx, test_common.rx, buffSz);
+
+	if ((memcmp(test_common.tx, test_common.rx, buffSz) == 0) && (rcvSize == buffSz))
+		return EOK;
+	else
+		return -EINVAL;
+}
+
+
 int test_spi_transfer_middle_data_sz(void)
 {
 	oid_t dir;
@@ -239,3 +260,56 @@ int test_spi_multiple_transmission(void)
 
 	return EOK;
 }
+
+
+int test_spi_transfer_segments(void)
+{
+	msg_t msg;
+	oid_t dir;
+	multi_i_t *idevctl;
+	multi_o_t *odevctl;
+	spi_segment_t *seg;
+	uint8_t *data;
+	int i, offs;
+	const uint16_t sizes[] = { 3, 0x40, 0x81 };
+	const int count = sizeof(sizes) / sizeof(sizes[0]);
+
+	dir = test_getOid();
+	test_spiConfig(dir);
+
+	/* Segments headers followed by TX data of all segments */
+	seg = (spi_segment_t *)test_common.tx;
+	data = test_common.tx + count * sizeof(spi_segment_t);
+
+	test_setData(MAX_BUFFER_SZ - 4);
+
+	for (i = 0, offs = 0; i < count; offs += sizes[i++]) {
+		seg[i].len = sizes[i];
+		seg[i].delay = 10;
+		seg[i].cs = 0;
+		seg[i].mode = spi_mode_0;
+		seg[i].hold = (i == 0);
+	}
+
+	msg.type = mtDevCtl;
+	msg.i.data = test_common.tx;
+	msg.i.size = count * sizeof(spi_segment_t) + offs;
+	msg.o.data = test_common.rx;
+	msg.o.size = offs;
+
+	idevctl = (multi_i_t *)msg.i.raw;
+	idevctl->id = dir.id;
+	idevctl->spi.type = spi_segments;
+	idevctl->spi.segments.count = count;
+
+	odevctl = (multi_o_t *)msg.o.raw;
+
+	/* Transmit data in a loop - back (MOSI --> MISO) */
+	if (msgSend(dir.port, &msg) < 0)
+		return -EINVAL;
+
+	if ((odevctl->err == offs) && (memcmp(data, test_common.rx, offs) == 0))
+		return EOK;
+	else
+		return -EINVAL;
+}
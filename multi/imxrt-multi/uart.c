@@ -24,8 +24,11 @@
 #include <sys/pwman.h>
 #include <sys/interrupt.h>
 #include <sys/platform.h>
+#include <sys/mman.h>
 
 #include <libtty.h>
+#include <edma.h>
+#include <dma-ring.h>
 
 #include "common.h"
 #include "uart.h"
@@ -44,6 +47,13 @@
 
 #define BUFSIZE 512
 
+/* Has to be power of 2 */
+#define DMA_RXBUFSZ 1024
+#define DMA_TXBUFSZ 256
+
+/* Write-1-to-clear flags of STAT register */
+#define STAT_W1C_MASK 0xc01fc000
+
 
 typedef struct uart_s {
 	char stack[1024] __attribute__ ((aligned(8)));
@@ -59,6 +69,26 @@ typedef struct uart_s {
 	size_t rxFifoSz;
 	size_t txFifoSz;
 
+	struct {
+		unsigned int rxch;
+		unsigned int txch;
+
+		volatile uint8_t *rxbuf;
+		uint8_t *txbuf;
+
+		unsigned int rxtail;
+		unsigned int txlen;
+
+		/* RX progress sampled by interrupts, at least twice per ring lap */
+		dma_ring_t rxring;
+		unsigned int rxcons;
+		unsigned int rxoverrun;
+		volatile unsigned int hwoverrun;
+
+		handle_t rxinth;
+		handle_t txinth;
+	} dma;
+
 	libtty_common_t tty_common;
 } uart_t;
 
@@ -79,6 +109,26 @@ static const int uartPos[] = { UART1_POS, UART2_POS, UART3_POS, UART4_POS, UART5
 enum { veridr = 0, paramr, globalr, pincfgr, baudr, statr, ctrlr, datar, matchr, modirr, fifor, waterr };
 
 
+#if UART_DMA
+static const struct {
+	int enabled;
+	unsigned int rxch;
+	unsigned int txch;
+	unsigned int rxreq;
+	unsigned int txreq;
+} uartDmaConfig[] = {
+	{ UART1_DMA, UART1_DMA_RXCH, UART1_DMA_TXCH, UART1_DMA_RX_REQ, UART1_DMA_TX_REQ },
+	{ UART2_DMA, UART2_DMA_RXCH, UART2_DMA_TXCH, UART2_DMA_RX_REQ, UART2_DMA_TX_REQ },
+	{ UART3_DMA, UART3_DMA_RXCH, UART3_DMA_TXCH, UART3_DMA_RX_REQ, UART3_DMA_TX_REQ },
+	{ UART4_DMA, UART4_DMA_RXCH, UART4_DMA_TXCH, UART4_DMA_RX_REQ, UART4_DMA_TX_REQ },
+	{ UART5_DMA, UART5_DMA_RXCH, UART5_DMA_TXCH, UART5_DMA_RX_REQ, UART5_DMA_TX_REQ },
+	{ UART6_DMA, UART6_DMA_RXCH, UART6_DMA_TXCH, UART6_DMA_RX_REQ, UART6_DMA_TX_REQ },
+	{ UART7_DMA, UART7_DMA_RXCH, UART7_DMA_TXCH, UART7_DMA_RX_REQ, UART7_DMA_TX_REQ },
+	{ UART8_DMA, UART8_DMA_RXCH, UART8_DMA_TXCH, UART8_DMA_RX_REQ, UART8_DMA_TX_REQ }
+};
+#endif
+
+
 static int uart_handleIntr(unsigned int n, void *arg)
 {
 	uart_t *uart = (uart_t *)arg;
@@ -134,6 +184,126 @@ static void uart_intrThread(void *arg)
 }
 
 
+#if UART_DMA
+static unsigned int uart_dmaRxHead(void *arg)
+{
+	uart_t *uart = (uart_t *)arg;
+
+	return (DMA_RXBUFSZ - edma_get_citer(uart->dma.rxch)) & (DMA_RXBUFSZ - 1);
+}
+
+
+static inline void uart_dmaRxSample(uart_t *uart)
+{
+	dma_ringSample(&uart->dma.rxring, uart_dmaRxHead(uart), DMA_RXBUFSZ);
+}
+
+
+static int uart_dmaHandleIntr(unsigned int n, void *arg)
+{
+	uart_t *uart = (uart_t *)arg;
+	uint32_t stat = *(uart->base + statr);
+
+	if (stat & (1 << 19))
+		uart->dma.hwoverrun++;
+
+	/* Clear idle line and overrun flags only */
+	*(uart->base + statr) = (stat & ~STAT_W1C_MASK) | (1 << 20) | (1 << 19);
+
+	uart_dmaRxSample(uart);
+
+	return uart->cond;
+}
+
+
+static int uart_dmaChannelIntr(unsigned int n, void *arg)
+{
+	uart_t *uart = (uart_t *)arg;
+
+	edma_clear_interrupt(uart->dma.rxch);
+	edma_clear_interrupt(uart->dma.txch);
+
+	uart_dmaRxSample(uart);
+
+	return uart->cond;
+}
+
+
+static inline int uart_dmaTxReady(uart_t *uart)
+{
+	return !uart->dma.txlen || edma_is_done(uart->dma.txch);
+}
+
+
+static void uart_dmaTxStart(uart_t *uart)
+{
+	volatile struct edma_tcd_s tcd;
+
+	uart->dma.txlen = 0;
+	while (uart->dma.txlen < DMA_TXBUFSZ && libtty_txready(&uart->tty_common))
+		uart->dma.txbuf[uart->dma.txlen++] = libtty_getchar(&uart->tty_common, NULL);
+
+	if (!uart->dma.txlen)
+		return;
+
+	tcd.saddr = (uint32_t)uart->dma.txbuf;
+	tcd.soff = 1;
+	tcd.attr = (edma_get_tcd_attr_xsize(1) << 8) | edma_get_tcd_attr_xsize(1);
+	tcd.nbytes_mlno = 1;
+	tcd.slast = 0;
+	tcd.daddr = (uint32_t)(uart->base + datar);
+	tcd.doff = 0;
+	tcd.citer_elinkno = uart->dma.txlen;
+	tcd.biter_elinkno = uart->dma.txlen;
+	tcd.dlast_sga = 0;
+	/* Interrupt on major loop completion, disable request afterwards */
+	tcd.csr = (1 << 3) | (1 << 1);
+
+	common_dataSyncBarrier();
+
+	edma_install_tcd(&tcd, uart->dma.txch);
+	edma_channel_enable(uart->dma.txch);
+}
+
+
+static void uart_dmaThread(void *arg)
+{
+	uart_t *uart = (uart_t *)arg;
+	unsigned int head, prod;
+
+	for (;;) {
+		/* wait for received data or transmit request */
+		mutexLock(uart->lock);
+		while (uart_dmaRxHead(uart) == uart->dma.rxtail) {
+			if (libtty_txready(&uart->tty_common) && uart_dmaTxReady(uart))
+				break;
+
+			condWait(uart->cond, uart->lock, 0);
+		}
+		mutexUnlock(uart->lock);
+
+		/* RX, data overwritten by the next lap of the ring is dropped */
+		prod = dma_ringProduced(&uart->dma.rxring, DMA_RXBUFSZ, uart_dmaRxHead, uart, &head);
+		if (prod - uart->dma.rxcons >= DMA_RXBUFSZ) {
+			uart->dma.rxoverrun++;
+			uart->dma.rxtail = head;
+			uart->dma.rxcons = prod;
+		}
+
+		while (uart->dma.rxtail != head) {
+			libtty_putchar(&uart->tty_common, uart->dma.rxbuf[uart->dma.rxtail], NULL);
+			uart->dma.rxtail = (uart->dma.rxtail + 1) & (DMA_RXBUFSZ - 1);
+			uart->dma.rxcons++;
+		}
+
+		/* TX */
+		if (uart_dmaTxReady(uart))
+			uart_dmaTxStart(uart);
+	}
+}
+#endif
+
+
 static void signal_txready(void *_uart)
 {
 	uart_t *uartptr = (uart_t *)_uart;
@@ -234,6 +404,7 @@ int uart_handleMsg(msg_t *msg, int dev)
 {
 	unsigned long request;
 	const void *in_data, *out_data = NULL;
+	uart_overrun_t ov;
 	pid_t pid;
 	int err;
 	uart_t *uart;
@@ -268,6 +439,12 @@ int uart_handleMsg(msg_t *msg, int dev)
 
 		case mtDevCtl:
 			in_data = ioctl_unpack(msg, &request, NULL);
+			if (request == UART_IOC_GETOVERRUN) {
+				ov.rxoverrun = uart->dma.rxoverrun;
+				ov.hwoverrun = uart->dma.hwoverrun;
+				ioctl_setResponse(msg, request, EOK, &ov);
+				break;
+			}
 			pid = ioctl_getSenderPid(msg);
 			err = libtty_ioctl(&uart->tty_common, pid, request, in_data, &out_data);
 			ioctl_setResponse(msg, request, err, out_data);
@@ -426,6 +603,65 @@ static void uart_initPins(void)
 }
 
 
+#if UART_DMA
+static int uart_dmaInit(uart_t *uart, int dev)
+{
+	volatile struct edma_tcd_s tcd;
+	uint8_t *buf;
+
+	if (common_initDma() < 0)
+		return -1;
+
+	buf = mmap(NULL, (DMA_RXBUFSZ + DMA_TXBUFSZ + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1), PROT_READ | PROT_WRITE,
+		MAP_UNCACHED, OID_NULL, 0);
+
+	if (buf == MAP_FAILED)
+		return -1;
+
+	uart->dma.rxch = uartDmaConfig[dev].rxch;
+	uart->dma.txch = uartDmaConfig[dev].txch;
+	uart->dma.rxbuf = buf;
+	uart->dma.txbuf = buf + DMA_RXBUFSZ;
+	uart->dma.rxtail = 0;
+	uart->dma.txlen = 0;
+	dma_ringReset(&uart->dma.rxring);
+	uart->dma.rxcons = 0;
+	uart->dma.rxoverrun = 0;
+	uart->dma.hwoverrun = 0;
+
+	/* Circular RX buffer, single byte minor loop, wrap-around after major loop */
+	tcd.saddr = (uint32_t)(uart->base + datar);
+	tcd.soff = 0;
+	tcd.attr = (edma_get_tcd_attr_xsize(1) << 8) | edma_get_tcd_attr_xsize(1);
+	tcd.nbytes_mlno = 1;
+	tcd.slast = 0;
+	tcd.daddr = (uint32_t)uart->dma.rxbuf;
+	tcd.doff = 1;
+	tcd.citer_elinkno = DMA_RXBUFSZ;
+	tcd.biter_elinkno = DMA_RXBUFSZ;
+	tcd.dlast_sga = -DMA_RXBUFSZ;
+	/* Interrupt on half and full buffer */
+	tcd.csr = (1 << 2) | (1 << 1);
+
+	if (edma_install_tcd(&tcd, uart->dma.rxch) < 0)
+		return -1;
+
+	dmamux_set_source(uart->dma.rxch, uartDmaConfig[dev].rxreq);
+	dmamux_set_source(uart->dma.txch, uartDmaConfig[dev].txreq);
+	dmamux_channel_enable(uart->dma.rxch);
+	dmamux_channel_enable(uart->dma.txch);
+
+	interrupt(EDMA_CHANNEL_IRQ(uart->dma.rxch), uart_dmaChannelIntr, (void *)uart, uart->cond, &uart->dma.rxinth);
+	if (EDMA_CHANNEL_IRQ(uart->dma.txch) != EDMA_CHANNEL_IRQ(uart->dma.rxch))
+		interrupt(EDMA_CHANNEL_IRQ(uart->dma.txch), uart_dmaChannelIntr, (void *)uart, uart->cond, &uart->dma.txinth);
+
+	edma_channel_enable(uart->dma.rxch);
+
+	return 0;
+}
+#endif
+
+
 int uart_init(void)
 {
 	int i, dev;
@@ -502,11 +738,34 @@ int uart_init(void)
 		*(uart->base + fifor) |= 0x3 << 14;
 
 		/* Clear all status flags */
-		*(uart->base + statr) |= 0xc01fc000;
+		*(uart->base + statr) |= STAT_W1C_MASK;
 
 		uart->rxFifoSz = fifoSzLut[*(uart->base + fifor) & 0x7];
 		uart->txFifoSz = fifoSzLut[(*(uart->base + fifor) >> 4) & 0x7];
 
+#if UART_DMA
+		if (uartDmaConfig[dev].enabled) {
+			if (uart_dmaInit(uart, dev) < 0)
+				return -1;
+
+			/* Idle line after 2 idle characters, counted from stop bit */
+			*(uart->base + ctrlr) = (*(uart->base + ctrlr) & ~(0x7 << 8)) | (1 << 8) | (1 << 2);
+
+			/* Enable RX and TX DMA requests */
+			*(uart->base + baudr) |= (1 << 23) | (1 << 21);
+
+			/* Enable idle line and overrun interrupts */
+			*(uart->base + ctrlr) |= (1 << 27) | (1 << 20);
+
+			/* Enable TX and RX */
+			*(uart->base + ctrlr) |= (1 << 19) | (1 << 18);
+
+			beginthread(uart_dmaThread, 2, &uart->stack, sizeof(uart->stack), uart);
+			interrupt(info[dev].irq, uart_dmaHandleIntr, (void *)uart, uart->cond, NULL);
+			continue;
+		}
+#endif
+
 		/* Enable receiver interrupt */
 		*(uart->base + ctrlr) |= 1 << 21;
 
@@ -107,6 +107,13 @@ int exti_configure(unsigned int line, unsigned char mode, unsigned char edge)
 }
 
 
+/* Can be called from interrupt handlers */
+void exti_ack(unsigned int line)
+{
+	*(exti_common.base + pr) = 1 << line;
+}
+
+
 int syscfg_mapexti(unsigned int line, int port)
 {
 	volatile unsigned int *cr;
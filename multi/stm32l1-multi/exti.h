@@ -18,6 +18,9 @@
 int exti_configure(unsigned int line, unsigned char mode, unsigned char edge);
 
 
+void exti_ack(unsigned int line);
+
+
 int syscfg_mapexti(unsigned int line, int port);
 
 
@@ -88,27 +88,14 @@ static void _eeprom_unlock(void)
 }
 
 
-static int _eeprom_eraseByte(uint32_t addr)
-{
-	int err;
-
-	_flash_clearFlags();
-
-	if ((err = _flash_wait()) == 0)
-		*(volatile uint8_t *) addr = 0x0;
-
-	return err;
-}
-
-
-static int _eeprom_writeByte(uint32_t addr, char value)
+static int _eeprom_writeWord(uint32_t addr, uint32_t value)
 {
 	int err;
 
 	_flash_clearFlags();
 
 	if ((err = _flash_wait()) == 0) {
-		*(volatile uint8_t *) addr = value;
+		*(volatile uint32_t *) addr = value;
 		err = _flash_wait();
 	}
 
@@ -131,15 +118,30 @@ static size_t eeprom_readData(uint32_t offset, char *buff, size_t size)
 
 static size_t eeprom_writeData(uint32_t offset, const char *buff, size_t size)
 {
-	unsigned int i;
+	unsigned int i = 0, pos, chunk;
+	uint32_t addr, word;
 
 	mutexLock(flash_common.lock);
 	_eeprom_unlock();
-	for (i = 0; i < size; ++i) {
-		_eeprom_eraseByte(offset + i);
-		if (buff[i] != 0)
-			_eeprom_writeByte(offset + i, buff[i]);
+
+	/* Clear FTDW, word is erased by hardware only if it's not zero already */
+	*(flash_common.flash + flash_pecr) &= ~(1 << 8);
+
+	while (i < size) {
+		addr = (offset + i) & ~((uint32_t) 0x3);
+		pos = offset + i - addr;
+		chunk = min(4 - pos, size - i);
+
+		/* Program whole words, unchanged ones are skipped */
+		word = *(volatile uint32_t *) addr;
+		memcpy((char *)&word + pos, buff + i, chunk);
+
+		if (word != *(volatile uint32_t *) addr && _eeprom_writeWord(addr, word) != 0)
+			break;
+
+		i += chunk;
 	}
+
 	_eeprom_lock();
 	mutexUnlock(flash_common.lock);
 
@@ -28,6 +28,9 @@
 
 #define LCD_MAX_POSITION 10
 
+/* Words of LCD RAM used by COM1 - COM4 */
+#define LCD_RAM_SIZE 8
+
 
 enum { cr = 0, fcr, sr, clr, ram = 5 };
 
@@ -38,6 +41,9 @@ enum { COM1 = 2, COM2 = 0, COM3 = 4, COM4 = 6 };
 struct {
 	volatile unsigned int *base;
 
+	/* Display is built here, only changed words go to LCD RAM */
+	unsigned int shadow[LCD_RAM_SIZE];
+
 	char str[10];
 	char str_small[3];
 	unsigned int sym_mask;
@@ -161,8 +167,10 @@ static inline void _lcd_setRamSegment(unsigned int com, unsigned int pin, unsign
 	if (pin > 31)
 		++com;
 
-	(lcd_common.base + ram)[com] &= ~(!on << pin % 32);
-	(lcd_common.base + ram)[com] |= (!!on << pin % 32);
+	if (on)
+		lcd_common.shadow[com] |= 1 << pin % 32;
+	else
+		lcd_common.shadow[com] &= ~(1 << pin % 32);
 }
 
 
@@ -195,16 +203,34 @@ static void _lcd_showChar(char ch, unsigned int pos)
 
 static void _lcd_update(void)
 {
-	if (lcd_common.on) {
-		/* Request update */
-		*(lcd_common.base + fcr) |= 1 << 3;
-		*(lcd_common.base + sr) |= 0x04;
-		/* Wait for update done */
-		while (!(*(lcd_common.base + sr) & 0x08))
-			condWait(lcd_common.cond, lcd_common.lock, 0);
-
-		*(lcd_common.base + clr) |= 0x08;
+	unsigned int i;
+
+	if (!lcd_common.on)
+		return;
+
+	for (i = 0; i < LCD_RAM_SIZE; ++i) {
+		if ((lcd_common.base + ram)[i] != lcd_common.shadow[i])
+			break;
+	}
+
+	if (i == LCD_RAM_SIZE)
+		return;
+
+	/* LCD RAM is write protected until previous update is done */
+	*(lcd_common.base + fcr) |= 1 << 3;
+	while (*(lcd_common.base + sr) & 0x04)
+		condWait(lcd_common.cond, lcd_common.lock, 0);
+	*(lcd_common.base + fcr) &= ~(1 << 3);
+
+	for (; i < LCD_RAM_SIZE; ++i) {
+		if ((lcd_common.base + ram)[i] != lcd_common.shadow[i])
+			(lcd_common.base + ram)[i] = lcd_common.shadow[i];
 	}
+
+	/* Request update, it's done at the end of a frame. Changes made in
+	 * the meantime are coalesced into the next update */
+	*(lcd_common.base + clr) |= 0x08;
+	*(lcd_common.base + sr) |= 0x04;
 }
 
 
@@ -307,7 +333,7 @@ void lcd_setDisplay(lcdmsg_t *disp)
 int lcd_init(void)
 {
 #if LCD
-	int port, pin;
+	int port, pin, i;
 
 	lcd_common.base = (void *)0x40002400;
 	lcd_common.str[0] = 0;
@@ -332,7 +358,10 @@ int lcd_init(void)
 	while (!(*(lcd_common.base + sr) & 0x20));
 
 	/* clear RAM */
-	memset((void *)(lcd_common.base + ram), 0, 8);
+	for (i = 0; i < LCD_RAM_SIZE; ++i) {
+		(lcd_common.base + ram)[i] = 0;
+		lcd_common.shadow[i] = 0;
+	}
 
 	/* Init gpio pins */
 	for (port = 0; port < 5; port++) {
@@ -13,14 +13,24 @@
 
 
 #include <errno.h>
+#include <sys/time.h>
 #include <sys/threads.h>
 #include <sys/platform.h>
+#include <sys/interrupt.h>
 
 #include "common.h"
+#include "exti.h"
 #include "rcc.h"
 #include "rtc.h"
 
 
+/* Wakeup timer is routed to EXTI line 20 */
+#define RTC_WAKEUP_EXTI 20
+
+/* RSF is set every two RTCCLK cycles, allow for a few of them */
+#define RTC_SYNC_US 1000
+
+
 enum { pwr_cr = 0, pwr_csr };
 
 
@@ -31,6 +41,11 @@ struct {
 	volatile unsigned int *base;
 
 	handle_t lock;
+	handle_t cond;
+
+	volatile rtcpage_t page;
+
+	char stack[512] __attribute__ ((aligned(8)));
 } rtc_common;
 
 
@@ -101,6 +116,19 @@ void rtc_setCalib(int value)
 }
 
 
+static void rtc_toTimestamp(unsigned int time, unsigned int date, rtctimestamp_t *timestamp)
+{
+	timestamp->hours = rtc_bcdToBin((time >> 16) & 0x3f);
+	timestamp->minutes = rtc_bcdToBin((time >> 8) & 0x7f);
+	timestamp->seconds = rtc_bcdToBin(time & 0x7f);
+
+	timestamp->day = rtc_bcdToBin(date & 0x3f);
+	timestamp->month = rtc_bcdToBin((date >> 8) & 0x1f);
+	timestamp->year = rtc_bcdToBin((date >> 16) & 0xff);
+	timestamp->wday = (date >> 13) & 0x7;
+}
+
+
 int rtc_getTime(rtctimestamp_t *timestamp)
 {
 	unsigned int time, date;
@@ -112,19 +140,76 @@ int rtc_getTime(rtctimestamp_t *timestamp)
 
 	mutexUnlock(rtc_common.lock);
 
-	timestamp->hours = rtc_bcdToBin((time >> 16) & 0x3f);
-	timestamp->minutes = rtc_bcdToBin((time >> 8) & 0x7f);
-	timestamp->seconds = rtc_bcdToBin(time & 0x7f);
+	rtc_toTimestamp(time, date, timestamp);
+
+	return EOK;
+}
+
+
+void *rtc_getPage(void)
+{
+	return (void *)&rtc_common.page;
+}
 
-	timestamp->day = rtc_bcdToBin(date & 0x3f);
-	timestamp->month = rtc_bcdToBin((date >> 8) & 0x1f);
-	timestamp->year = rtc_bcdToBin((date >> 16) & 0xff);
-	timestamp->wday = (date >> 13) & 0x7;
+
+static int _rtc_publish(void)
+{
+	unsigned int subsec, time, date, prediv;
+	rtctimestamp_t timestamp;
+	time_t now, start;
+
+	gettime(&start, NULL);
+
+	/* Wait for shadow registers to be synchronized after rtc_setTime */
+	while (!(*(rtc_common.base + isr) & (1 << 5))) {
+		gettime(&now, NULL);
+
+		/* RTC clock stopped, keep the old page until the next wakeup */
+		if ((now - start) > RTC_SYNC_US)
+			return -ETIMEDOUT;
+	}
+
+	gettime(&now, NULL);
+
+	/* Reading SSR locks TR and DR until DR is read */
+	subsec = *(rtc_common.base + ssr) & 0xffff;
+	time = *(rtc_common.base + tr);
+	date = *(rtc_common.base + dr);
+	prediv = *(rtc_common.base + prer) & 0x7fff;
+
+	rtc_toTimestamp(time, date, &timestamp);
+	subsec = (subsec > prediv) ? 0 : ((unsigned long long)(prediv - subsec) * 1000000) / (prediv + 1);
+
+	++rtc_common.page.seq;
+	rtc_common.page.time = timestamp;
+	rtc_common.page.subsec = subsec;
+	rtc_common.page.uptime = now;
+	++rtc_common.page.seq;
 
 	return EOK;
 }
 
 
+static void rtc_thread(void *arg)
+{
+	mutexLock(rtc_common.lock);
+
+	for (;;) {
+		_rtc_publish();
+		condWait(rtc_common.cond, rtc_common.lock, 0);
+	}
+}
+
+
+static int rtc_wakeupHandler(unsigned int n, void *arg)
+{
+	*(rtc_common.base + isr) &= ~(1 << 10);
+	exti_ack(RTC_WAKEUP_EXTI);
+
+	return 1;
+}
+
+
 int rtc_setTime(rtctimestamp_t *timestamp)
 {
 	unsigned int time, date;
@@ -156,6 +241,7 @@ int rtc_setTime(rtctimestamp_t *timestamp)
 
 	_rtc_lock();
 
+	condSignal(rtc_common.cond);
 	mutexUnlock(rtc_common.lock);
 
 	return EOK;
@@ -167,10 +253,27 @@ int rtc_init(void)
 	rtc_common.base = (void *)0x40002800;
 
 	mutexCreate(&rtc_common.lock);
+	condCreate(&rtc_common.cond);
 
 	pwr_unlock();
 	rcc_devClk(pctl_rtc, 1);
 	pwr_lock();
 
+	/* Wakeup timer clocked from ck_spre (1 Hz) updates the time page */
+	_rtc_unlock();
+	*(rtc_common.base + cr) &= ~((1 << 14) | (1 << 10));
+	while (!(*(rtc_common.base + isr) & (1 << 2)))
+		;
+
+	*(rtc_common.base + wutr) = 0;
+	*(rtc_common.base + cr) = (*(rtc_common.base + cr) & ~0x7) | 0x4;
+	*(rtc_common.base + cr) |= (1 << 14) | (1 << 10);
+	_rtc_lock();
+
+	interrupt(rtc_wkup_irq, rtc_wakeupHandler, NULL, rtc_common.cond, NULL);
+	exti_configure(RTC_WAKEUP_EXTI, exti_irq, exti_rising);
+
+	beginthread(rtc_thread, 0, rtc_common.stack, sizeof(rtc_common.stack), NULL);
+
 	return EOK;
 }
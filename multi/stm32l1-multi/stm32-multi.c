@@ -69,6 +69,10 @@ static void handleMsg(msg_t *msg)
 		case rtc_set:
 			rtc_setTime(&imsg->rtc_timestamp);
 			break;
+
+		case rtc_page:
+			omsg->rtc_page = (unsigned int)rtc_getPage();
+			break;
 #if LCD
 		case lcd_get:
 			lcd_getDisplay(&imsg->lcd_msg);
@@ -210,13 +214,13 @@ int main(void)
 	rcc_init();
 	uart_init();
 	gpio_init();
+	exti_init();
 	rtc_init();
 	lcd_init();
 	adc_init();
 	i2c_init();
 	flash_init();
 	spi_init();
-	exti_init();
 
 	portCreate(&common.port);
 	portRegister(common.port, "/multi", &oid);
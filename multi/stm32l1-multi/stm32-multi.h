@@ -19,7 +19,7 @@
 
 enum { adc_get = 0, rtc_setcal, rtc_get, rtc_set, lcd_get, lcd_set, i2c_get,
 	i2c_set, gpio_def, gpio_get, gpio_set, uart_def, uart_get, uart_set,
-	flash_get, flash_set, spi_get, spi_set, spi_rw, spi_def, exti_def, exti_map };
+	flash_get, flash_set, spi_get, spi_set, spi_rw, spi_def, exti_def, exti_map, rtc_page };
 
 /* RTC */
 
@@ -36,6 +36,44 @@ typedef struct {
 } __attribute__((packed)) rtctimestamp_t;
 
 
+/*
+ * Time page published by the server, rtc_page returns its address. It's
+ * updated every second and after rtc_set, seq is odd during an update.
+ * subsec is the part of the second (in us) elapsed at uptime (gettime()),
+ * so current time is time + subsec + (gettime() - uptime).
+ */
+typedef struct {
+	unsigned int seq;
+	rtctimestamp_t time;
+	unsigned int subsec;
+	long long uptime;
+} rtcpage_t;
+
+
+/* Spins during an update, the page is written by a thread with priority 0 */
+static inline void rtc_readPage(const volatile rtcpage_t *page, rtcpage_t *snap)
+{
+	unsigned int seq;
+
+	do {
+		while ((seq = page->seq) & 1)
+			;
+
+		snap->time.year = page->time.year;
+		snap->time.month = page->time.month;
+		snap->time.day = page->time.day;
+		snap->time.wday = page->time.wday;
+		snap->time.hours = page->time.hours;
+		snap->time.minutes = page->time.minutes;
+		snap->time.seconds = page->time.seconds;
+		snap->subsec = page->subsec;
+		snap->uptime = page->uptime;
+	} while (page->seq != seq);
+
+	snap->seq = seq;
+}
+
+
 /* LCD */
 
 
@@ -236,6 +274,7 @@ typedef struct {
 	union {
 		unsigned short adc_val;
 		rtctimestamp_t rtc_timestamp;
+		unsigned int rtc_page;
 		lcdmsg_t lcd_msg;
 		unsigned int gpio_get;
 	};
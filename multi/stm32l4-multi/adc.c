@@ -13,15 +13,23 @@
 
 
 #include <errno.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/threads.h>
 #include <sys/platform.h>
 #include <sys/pwman.h>
+#include <dma-ring.h>
 
 #include "common.h"
 #include "rcc.h"
+#include "dma.h"
+#include "adc.h"
 #include "stm32-multi.h"
 
+
+/* Samples, rounded down to a multiple of sequence length */
+#define ADC_STREAM_BUFSZ 512
+
 enum { adc1_offs = 0, adc2_offs = 64, adc3_offs = 128, common_offs = 192 };
 
 enum { isr = 0, ier, cr, cfgr, cfgr2, smpr1, smpr2, tr1 = smpr2 + 2, tr2, tr3, sqr1 = tr3 + 2, sqr2, sqr3, sqr4, dr,
@@ -36,14 +44,37 @@ enum { common_csr = common_offs, common_ccr = common_csr + 2, common_cdr };
 static const unsigned short * const vrefint = (void *)0x1fff75aa;
 
 
+enum { tim_cr1 = 0, tim_cr2, tim_dier = 3, tim_sr, tim_egr, tim_cnt = 9, tim_psc, tim_arr };
+
+
 struct {
 	volatile unsigned int *base;
 	unsigned int calibration[3];
 
 	handle_t lock[3];
+
+	/* ADC1 streaming */
+	struct {
+		volatile unsigned int *tim;
+		unsigned short *buff;
+		unsigned int size;
+		unsigned int len;
+		unsigned int tail;
+		dma_ring_t ring;            /* Samples converted, sampled in interrupts */
+		unsigned int cons;          /* Samples consumed in total */
+		unsigned int lost;          /* Samples overwritten before being read */
+		int mode;
+
+		handle_t lock;
+		handle_t cond;
+	} stream;
 } adc_common;
 
 
+/* ADC1 on DMA1 channel 1 */
+static const dma_channel_t adc_dma = { dma1, 0, 0 };
+
+
 static void adc_delay(int delay)
 {
 	volatile int i;
@@ -64,11 +95,10 @@ static int adc_getOffs(int adc)
 }
 
 
-static void adc_wakeup(int adc)
+static void _adc_wakeup(int adc)
 {
 	volatile unsigned int *base = adc_common.base + adc_getOffs(adc);
 
-	mutexLock(adc_common.lock[adc]);
 	keepidle(1);
 
 	/* Exit deep power down */
@@ -86,7 +116,7 @@ static void adc_wakeup(int adc)
 }
 
 
-static void adc_disable(int adc)
+static void _adc_disable(int adc)
 {
 	volatile unsigned int *base = adc_common.base + adc_getOffs(adc);
 
@@ -102,6 +132,27 @@ static void adc_disable(int adc)
 	dataBarier();
 
 	keepidle(0);
+}
+
+
+static int adc_wakeup(int adc)
+{
+	mutexLock(adc_common.lock[adc]);
+
+	if (adc == adc1 && adc_common.stream.mode != adc_stream_stop) {
+		mutexUnlock(adc_common.lock[adc]);
+		return -EBUSY;
+	}
+
+	_adc_wakeup(adc);
+
+	return EOK;
+}
+
+
+static void adc_disable(int adc)
+{
+	_adc_disable(adc);
 	mutexUnlock(adc_common.lock[adc]);
 }
 
@@ -167,18 +218,24 @@ static void adc_enable(int adc)
 }
 
 
-unsigned short adc_conversion(int adc, char chan)
+int adc_conversion(int adc, char chan, unsigned short *mv)
 {
 	unsigned short vref, val;
 	unsigned int out;
 
-	adc_wakeup(adc);
-	adc_calibration(adc);
+	if (adc < adc1 || adc > adc3)
+		return -EINVAL;
+
+	/* Calibration is done once in adc_init(), factor is injected on enable */
+	if (adc_wakeup(adc) < 0)
+		return -EBUSY;
 	adc_enable(adc);
 
 	if (adc != adc1) {
-		adc_wakeup(adc1);
-		adc_calibration(adc1);
+		if (adc_wakeup(adc1) < 0) {
+			adc_disable(adc);
+			return -EBUSY;
+		}
 		adc_enable(adc1);
 	}
 
@@ -197,7 +254,215 @@ unsigned short adc_conversion(int adc, char chan)
 	if (adc != adc1)
 		adc_disable(adc1);
 
-	return out;
+	*mv = out;
+
+	return EOK;
+}
+
+
+static unsigned int adc_streamHead(void *arg)
+{
+	return (adc_common.stream.size - dma_remaining(&adc_dma)) % adc_common.stream.size;
+}
+
+
+static int adc_dmaIrqHandler(unsigned int n, void *arg)
+{
+	if (dma_events(&adc_dma) == 0)
+		return -1;
+
+	/* HT/TC come at least every half of the ring, so no lap is missed */
+	dma_ringSample(&adc_common.stream.ring, adc_streamHead(NULL), adc_common.stream.size);
+
+	return 1;
+}
+
+
+static int adc_timerStart(unsigned int freq)
+{
+	volatile unsigned int *tim = adc_common.stream.tim;
+	unsigned int div, psc;
+
+	if (freq == 0 || (div = rcc_getApb1TimerFreq() / freq) < 2)
+		return -EINVAL;
+
+	psc = (div - 1) >> 16;
+
+	rcc_devClk(pctl_tim6, 1);
+
+	*(tim + tim_cr1) = 0;
+	*(tim + tim_psc) = psc;
+	*(tim + tim_arr) = div / (psc + 1) - 1;
+
+	/* Update event as TRGO */
+	*(tim + tim_cr2) = 0x2 << 4;
+	*(tim + tim_egr) = 1;
+	*(tim + tim_sr) = 0;
+	dataBarier();
+
+	*(tim + tim_cr1) = 1;
+
+	return EOK;
+}
+
+
+static void adc_timerStop(void)
+{
+	*(adc_common.stream.tim + tim_cr1) = 0;
+	rcc_devClk(pctl_tim6, 0);
+}
+
+
+static void _adc_streamStop(void)
+{
+	volatile unsigned int *base = adc_common.base + adc1_offs;
+
+	/* Stop regular conversions */
+	if (*(base + cr) & (1 << 2)) {
+		*(base + cr) |= 1 << 4;
+		while (*(base + cr) & (1 << 2))
+			;
+	}
+
+	if (adc_common.stream.mode == adc_stream_timer)
+		adc_timerStop();
+
+	dma_stop(&adc_dma);
+
+	*(base + cfgr) = (1 << 31) | (1 << 12);
+	_adc_disable(adc1);
+
+	adc_common.stream.mode = adc_stream_stop;
+}
+
+
+int adc_streamConfigure(int mode, unsigned int freq, const unsigned char *channels, unsigned int len)
+{
+	volatile unsigned int *base = adc_common.base + adc1_offs;
+	unsigned int i, reg, t;
+	int err = EOK;
+
+	if (mode < adc_stream_stop || mode > adc_stream_timer)
+		return -EINVAL;
+
+	if (mode != adc_stream_stop && (len == 0 || len > 16))
+		return -EINVAL;
+
+	if (adc_common.stream.buff == NULL)
+		return -ENOMEM;
+
+	mutexLock(adc_common.lock[adc1]);
+	mutexLock(adc_common.stream.lock);
+
+	if (adc_common.stream.mode != adc_stream_stop)
+		_adc_streamStop();
+
+	if (mode != adc_stream_stop) {
+		_adc_wakeup(adc1);
+		adc_enable(adc1);
+
+		/* Regular sequence */
+		for (t = len - 1, i = 0; i < len; ++i) {
+			reg = (i + 1) / 5;
+			t |= (unsigned int)(channels[i] & 0x1f) << (((i + 1) % 5) * 6);
+
+			if (((i + 2) % 5) == 0 || i == len - 1) {
+				*(base + sqr1 + reg) = t;
+				t = 0;
+			}
+		}
+
+		/* Keep whole sequences in the ring */
+		adc_common.stream.len = len;
+		adc_common.stream.size = (ADC_STREAM_BUFSZ / len) * len;
+		adc_common.stream.tail = 0;
+		dma_ringReset(&adc_common.stream.ring);
+		adc_common.stream.cons = 0;
+		adc_common.stream.lost = 0;
+
+		dma_start(&adc_dma, adc_common.stream.buff, adc_common.stream.size, 1, dma_ht | dma_tc);
+
+		/* Circular DMA, overrun overwrites data */
+		t = (1 << 31) | (1 << 12) | (1 << 1) | 1;
+		if (mode == adc_stream_continuous)
+			t |= 1 << 13;
+		else
+			t |= (1 << 10) | (13 << 6); /* TIM6_TRGO, rising edge */
+		*(base + cfgr) = t;
+
+		adc_common.stream.mode = mode;
+
+		if (mode == adc_stream_timer && (err = adc_timerStart(freq)) < 0) {
+			_adc_streamStop();
+		}
+		else {
+			*(base + isr) |= 0x7ff;
+			dataBarier();
+			*(base + cr) |= 1 << 2;
+		}
+	}
+
+	mutexUnlock(adc_common.stream.lock);
+	mutexUnlock(adc_common.lock[adc1]);
+
+	return err;
+}
+
+
+static unsigned int _adc_streamAvailable(void)
+{
+	unsigned int head, prod;
+
+	prod = dma_ringProduced(&adc_common.stream.ring, adc_common.stream.size, adc_streamHead, NULL, &head);
+
+	/* Ring lapped the reader, drop all up to the sequence being converted */
+	if (prod - adc_common.stream.cons > adc_common.stream.size) {
+		prod -= prod % adc_common.stream.len;
+		adc_common.stream.lost += prod - adc_common.stream.cons;
+		adc_common.stream.tail = head - (head % adc_common.stream.len);
+		adc_common.stream.cons = prod;
+	}
+
+	return prod - adc_common.stream.cons;
+}
+
+
+int adc_streamRead(unsigned short *buff, unsigned int count, unsigned int timeout, unsigned int *lost)
+{
+	unsigned int n, i;
+
+	mutexLock(adc_common.stream.lock);
+
+	if (adc_common.stream.mode == adc_stream_stop) {
+		mutexUnlock(adc_common.stream.lock);
+		return -EIO;
+	}
+
+	count -= count % adc_common.stream.len;
+
+	if (count == 0) {
+		mutexUnlock(adc_common.stream.lock);
+		return -EINVAL;
+	}
+
+	if (_adc_streamAvailable() < adc_common.stream.len && timeout != 0)
+		condWait(adc_common.stream.cond, adc_common.stream.lock, timeout);
+
+	n = min(_adc_streamAvailable(), count);
+	n -= n % adc_common.stream.len;
+
+	for (i = 0; i < n; ++i) {
+		buff[i] = adc_common.stream.buff[adc_common.stream.tail++];
+		adc_common.stream.tail %= adc_common.stream.size;
+	}
+	adc_common.stream.cons += n;
+
+	*lost = adc_common.stream.lost;
+	adc_common.stream.lost = 0;
+
+	mutexUnlock(adc_common.stream.lock);
+
+	return n;
 }
 
 
@@ -210,6 +475,17 @@ int adc_init(void)
 
 	*(adc_common.base + common_ccr) = (1 << 22) | (0xe << 18) | (0x3 << 16) | (0xf << 8);
 
+	adc_common.stream.tim = (void *)0x40001000;
+	adc_common.stream.mode = adc_stream_stop;
+	adc_common.stream.buff = malloc(ADC_STREAM_BUFSZ * sizeof(unsigned short));
+
+	mutexCreate(&adc_common.stream.lock);
+	condCreate(&adc_common.stream.cond);
+
+	if (adc_common.stream.buff != NULL)
+		dma_configure(&adc_dma, dma_per2mem, dma_priorityMedium, adc_common.base + adc1_offs + dr, 2, 1,
+			adc_dmaIrqHandler, NULL, adc_common.stream.cond, NULL);
+
 	for (i = adc1; i <= adc3; ++i) {
 		mutexCreate(&adc_common.lock[i]);
 		adc_wakeup(i);
@@ -15,7 +15,13 @@
 #define _ADC_H_
 
 
-unsigned short adc_conversion(int adc, char chan);
+int adc_conversion(int adc, char chan, unsigned short *mv);
+
+
+int adc_streamConfigure(int mode, unsigned int freq, const unsigned char *channels, unsigned int len);
+
+
+int adc_streamRead(unsigned short *buff, unsigned int count, unsigned int timeout, unsigned int *lost);
 
 
 int adc_init(void);
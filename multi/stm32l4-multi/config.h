@@ -37,6 +37,33 @@
 #define LPUART1 0
 #endif
 
+/* Circular DMA reception and DMA transmission */
+#ifndef UART1_DMA
+#define UART1_DMA 0
+#endif
+
+#ifndef UART2_DMA
+#define UART2_DMA 0
+#endif
+
+#ifndef UART3_DMA
+#define UART3_DMA 0
+#endif
+
+#ifndef UART4_DMA
+#define UART4_DMA 0
+#endif
+
+#ifndef UART5_DMA
+#define UART5_DMA 0
+#endif
+
+#ifndef LPUART1_DMA
+#define LPUART1_DMA 0
+#endif
+
+#define UART_DMA (UART1_DMA || UART2_DMA || UART3_DMA || UART4_DMA || UART5_DMA || LPUART1_DMA)
+
 #ifndef UART_CONSOLE
 #define UART_CONSOLE 4
 #endif
@@ -53,6 +80,31 @@
 #define SPI3 0
 #endif
 
+/* SPI1, SPI2 and SPI3 DMA channels are shared with USART3, USART1 and UART5 */
+#ifndef SPI1_DMA
+#define SPI1_DMA 0
+#endif
+
+#ifndef SPI2_DMA
+#define SPI2_DMA 0
+#endif
+
+#ifndef SPI3_DMA
+#define SPI3_DMA 0
+#endif
+
+#if SPI1_DMA && UART3_DMA
+#error "SPI1_DMA and UART3_DMA use the same DMA1 channels"
+#endif
+
+#if SPI2_DMA && UART1_DMA
+#error "SPI2_DMA and UART1_DMA use the same DMA1 channels"
+#endif
+
+#if SPI3_DMA && UART5_DMA
+#error "SPI3_DMA and UART5_DMA use the same DMA2 channels"
+#endif
+
 #ifndef FLASH_PROGRAM_1_ADDR
 #define FLASH_PROGRAM_1_ADDR 0x08000000
 #endif
@@ -65,4 +117,17 @@
 #define FLASH_PROGRAM_BANK_SIZE (320 * 1024)
 #endif
 
+/* EEPROM emulation, pages are reserved at the end of the second bank */
+#ifndef EEPROM_EMUL_PAGES
+#define EEPROM_EMUL_PAGES 0
+#endif
+
+#ifndef EEPROM_EMUL_ADDR
+#define EEPROM_EMUL_ADDR (FLASH_PROGRAM_2_ADDR + FLASH_PROGRAM_BANK_SIZE - EEPROM_EMUL_PAGES * FLASH_PAGE_SIZE)
+#endif
+
+#ifndef EEPROM_EMUL_VARS
+#define EEPROM_EMUL_VARS 64
+#endif
+
 #endif
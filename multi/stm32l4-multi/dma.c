@@ -0,0 +1,135 @@
+/*
+ * Phoenix-RTOS
+ *
+ * STM32L4 DMA controller driver
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+
+#include <errno.h>
+#include <sys/threads.h>
+#include <sys/interrupt.h>
+#include <sys/platform.h>
+
+#include "common.h"
+#include "rcc.h"
+#include "dma.h"
+
+
+#define DMA_CHANNELS 7
+
+
+struct {
+	volatile unsigned int *base[2];
+	unsigned int ccr[2][DMA_CHANNELS];
+	int clk[2];
+
+	handle_t lock;
+} dma_common;
+
+
+enum { isr = 0, ifcr, ccr1, cndtr1, cpar1, cmar1, cselr = 42 };
+
+
+/* Channel registers are 5 words apart */
+#define DMA_CHREG(ch, reg) (dma_common.base[(ch)->dma] + (reg) + 5 * (ch)->channel)
+
+
+static const int dmairq[2][DMA_CHANNELS] = {
+	{ dma1ch1_irq, dma1ch2_irq, dma1ch3_irq, dma1ch4_irq, dma1ch5_irq, dma1ch6_irq, dma1ch7_irq },
+	{ dma2ch1_irq, dma2ch2_irq, dma2ch3_irq, dma2ch4_irq, dma2ch5_irq, dma2ch6_irq, dma2ch7_irq }
+};
+
+
+int dma_configure(const dma_channel_t *ch, int dir, int priority, volatile void *paddr, int size, int circular,
+	int (*handler)(unsigned int, void *), void *arg, handle_t cond, handle_t *inth)
+{
+	unsigned int t, bits;
+
+	if (ch->dma > dma2 || ch->channel >= DMA_CHANNELS || ch->reqmap > 0xf)
+		return -EINVAL;
+
+	switch (size) {
+		case 1: bits = 0; break;
+		case 2: bits = 1; break;
+		case 4: bits = 2; break;
+		default: return -EINVAL;
+	}
+
+	mutexLock(dma_common.lock);
+
+	if (!dma_common.clk[ch->dma]) {
+		rcc_devClk(ch->dma == dma1 ? pctl_dma1 : pctl_dma2, 1);
+		dma_common.clk[ch->dma] = 1;
+	}
+
+	*DMA_CHREG(ch, ccr1) = 0;
+
+	t = *(dma_common.base[ch->dma] + cselr) & ~(0xf << (4 * ch->channel));
+	*(dma_common.base[ch->dma] + cselr) = t | ((unsigned int)ch->reqmap << (4 * ch->channel));
+
+	dma_common.ccr[ch->dma][ch->channel] = ((priority & 0x3) << 12) | (bits << 10) | (bits << 8) |
+		(!!circular << 5) | ((dir == dma_mem2per) << 4);
+
+	*DMA_CHREG(ch, cpar1) = (unsigned int)paddr;
+
+	mutexUnlock(dma_common.lock);
+
+	if (handler != NULL)
+		interrupt(dmairq[ch->dma][ch->channel], handler, arg, cond, inth);
+
+	return EOK;
+}
+
+
+void dma_start(const dma_channel_t *ch, void *maddr, unsigned int len, int minc, int events)
+{
+	*DMA_CHREG(ch, ccr1) = 0;
+	*(dma_common.base[ch->dma] + ifcr) = 0xf << (4 * ch->channel);
+
+	*DMA_CHREG(ch, cmar1) = (unsigned int)maddr;
+	*DMA_CHREG(ch, cndtr1) = len & 0xffff;
+	dataBarier();
+
+	*DMA_CHREG(ch, ccr1) = dma_common.ccr[ch->dma][ch->channel] | (!!minc << 7) |
+		(events & (dma_tc | dma_ht | dma_te)) | 1;
+}
+
+
+void dma_stop(const dma_channel_t *ch)
+{
+	*DMA_CHREG(ch, ccr1) = 0;
+	*(dma_common.base[ch->dma] + ifcr) = 0xf << (4 * ch->channel);
+}
+
+
+unsigned int dma_remaining(const dma_channel_t *ch)
+{
+	return *DMA_CHREG(ch, cndtr1) & 0xffff;
+}
+
+
+int dma_events(const dma_channel_t *ch)
+{
+	int events = (*(dma_common.base[ch->dma] + isr) >> (4 * ch->channel)) & (dma_tc | dma_ht | dma_te);
+
+	*(dma_common.base[ch->dma] + ifcr) = events << (4 * ch->channel);
+
+	return events;
+}
+
+
+int dma_init(void)
+{
+	dma_common.base[dma1] = (void *)0x40020000;
+	dma_common.base[dma2] = (void *)0x40020400;
+
+	mutexCreate(&dma_common.lock);
+
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Phoenix-RTOS
+ *
+ * STM32L4 DMA controller driver
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _DMA_H_
+#define _DMA_H_
+
+#include <sys/types.h>
+#include <sys/interrupt.h>
+
+
+enum { dma1 = 0, dma2 };
+
+
+enum { dma_per2mem = 0, dma_mem2per };
+
+
+enum { dma_priorityLow = 0, dma_priorityMedium, dma_priorityHigh, dma_priorityVeryHigh };
+
+
+/* Channel events, also used as interrupt enable flags in dma_start() */
+enum { dma_tc = 1 << 1, dma_ht = 1 << 2, dma_te = 1 << 3 };
+
+
+typedef struct {
+	unsigned char dma;
+	unsigned char channel; /* 0 - 6 */
+	unsigned char reqmap;  /* CSELR request number */
+} dma_channel_t;
+
+
+int dma_configure(const dma_channel_t *ch, int dir, int priority, volatile void *paddr, int size, int circular,
+	int (*handler)(unsigned int, void *), void *arg, handle_t cond, handle_t *inth);
+
+
+void dma_start(const dma_channel_t *ch, void *maddr, unsigned int len, int minc, int events);
+
+
+void dma_stop(const dma_channel_t *ch);
+
+
+unsigned int dma_remaining(const dma_channel_t *ch);
+
+
+/* Returns and clears pending events, safe to call from interrupt handler */
+int dma_events(const dma_channel_t *ch);
+
+
+int dma_init(void);
+
+
+#endif
@@ -11,6 +11,8 @@
 
 
 #include <errno.h>
+#include <sys/msg.h>
+#include <sys/time.h>
 #include <sys/threads.h>
 #include <sys/interrupt.h>
 
@@ -20,11 +22,53 @@
 #include "rcc.h"
 
 
+#define EXTI_LINES 16
+
+/* Has to be power of 2 */
+#define EXTI_QUEUE 4
+
+/* Blocked exti_wait requests, responded by exti_thread */
+#define EXTI_WAITERS 8
+
+
 struct {
 	volatile unsigned int *base;
 	volatile unsigned int *syscfg;
 
 	handle_t lock;
+
+	/* Edges counted by interrupt handlers, accepted by exti_thread */
+	volatile unsigned int hits[EXTI_LINES];
+	unsigned int seen[EXTI_LINES];
+
+	struct {
+		unsigned int count;
+		unsigned int overflow;
+		unsigned int debounce;
+		time_t last;
+
+		unsigned int head;
+		unsigned int tail;
+		time_t stamps[EXTI_QUEUE];
+	} line[EXTI_LINES];
+
+	struct {
+		msg_t msg;
+		unsigned int rid;
+		unsigned int port;
+		unsigned int mask;
+		time_t deadline; /* 0 - wait forever */
+		int used;
+	} waiters[EXTI_WAITERS];
+
+	/* Set when a waiter with a deadline is added */
+	volatile int rearm;
+
+	handle_t irqLock;
+	handle_t irqCond;
+	handle_t evLock;
+
+	char stack[512] __attribute__ ((aligned(8)));
 } exti_common;
 
 
@@ -34,52 +78,218 @@ enum { imr1 = 0, emr1, rtsr1, ftsr1, swier1, pr1, imr2 = 8, emr2, rtsr2, ftsr2,
 enum { memrmp = 0, cfgr1, exticr1, exticr2, exticr3, exticr4 };
 
 
-static int exti0_handler(unsigned int n, void *arg)
+static int exti_handler(unsigned int n, void *arg)
+{
+	unsigned int pending, line;
+
+	pending = *(exti_common.base + pr1) & (unsigned int)arg;
+	*(exti_common.base + pr1) = pending;
+
+	if (!pending)
+		return -1;
+
+	for (line = 0; line < EXTI_LINES; ++line) {
+		if (pending & (1 << line))
+			++exti_common.hits[line];
+	}
+
+	return 1;
+}
+
+
+static int exti_pending(void)
 {
-	*(exti_common.base + pr1) |= 0x1;
-	return -1;
+	unsigned int line;
+
+	for (line = 0; line < EXTI_LINES; ++line) {
+		if (exti_common.hits[line] != exti_common.seen[line])
+			return 1;
+	}
+
+	return 0;
 }
 
 
-static int exti1_handler(unsigned int n, void *arg)
+/* Returns line with the oldest queued event */
+static int _exti_oldest(unsigned int mask)
 {
-	*(exti_common.base + pr1) |= 0x2;
-	return -1;
+	unsigned int line;
+	int oldest = -1;
+	time_t t, min = 0;
+
+	for (line = 0; line < EXTI_LINES; ++line) {
+		if (!(mask & (1 << line)) || exti_common.line[line].head == exti_common.line[line].tail)
+			continue;
+
+		t = exti_common.line[line].stamps[exti_common.line[line].tail & (EXTI_QUEUE - 1)];
+		if (oldest < 0 || t < min) {
+			oldest = line;
+			min = t;
+		}
+	}
+
+	return oldest;
 }
 
 
-static int exti2_handler(unsigned int n, void *arg)
+static void _exti_pop(int line, extievent_t *ev)
 {
-	*(exti_common.base + pr1) |= 0x4;
-	return -1;
+	ev->line = line;
+	ev->timestamp = exti_common.line[line].stamps[exti_common.line[line].tail++ & (EXTI_QUEUE - 1)];
+	ev->count = exti_common.line[line].count;
+	ev->overflow = exti_common.line[line].overflow;
 }
 
 
-static int exti3_handler(unsigned int n, void *arg)
+/* Responds to waiters with events or expired deadlines, returns us to the nearest deadline */
+static time_t _exti_serve(time_t now)
 {
-	*(exti_common.base + pr1) |= 0x8;
-	return -1;
+	multi_o_t *omsg;
+	time_t wait = 0;
+	int i, line;
+
+	for (i = 0; i < EXTI_WAITERS; ++i) {
+		if (!exti_common.waiters[i].used)
+			continue;
+
+		omsg = (multi_o_t *)exti_common.waiters[i].msg.o.raw;
+
+		if ((line = _exti_oldest(exti_common.waiters[i].mask)) >= 0) {
+			_exti_pop(line, &omsg->exti_event);
+			omsg->err = EOK;
+		}
+		else if (exti_common.waiters[i].deadline != 0 && now >= exti_common.waiters[i].deadline) {
+			omsg->err = -ETIME;
+		}
+		else {
+			if (exti_common.waiters[i].deadline != 0 && (wait == 0 || exti_common.waiters[i].deadline - now < wait))
+				wait = exti_common.waiters[i].deadline - now;
+			continue;
+		}
+
+		msgRespond(exti_common.waiters[i].port, &exti_common.waiters[i].msg, exti_common.waiters[i].rid);
+		exti_common.waiters[i].used = 0;
+	}
+
+	return wait;
 }
 
 
-static int exti4_handler(unsigned int n, void *arg)
+static void exti_thread(void *arg)
 {
-	*(exti_common.base + pr1) |= 0x10;
-	return -1;
+	unsigned int line, edges, first;
+	time_t now, wait = 0;
+
+	for (;;) {
+		/* Sleep until an edge or the nearest waiter deadline */
+		mutexLock(exti_common.irqLock);
+		if (!exti_pending() && !exti_common.rearm)
+			condWait(exti_common.irqCond, exti_common.irqLock, wait);
+		exti_common.rearm = 0;
+		mutexUnlock(exti_common.irqLock);
+
+		gettime(&now, NULL);
+
+		mutexLock(exti_common.evLock);
+		for (line = 0; line < EXTI_LINES; ++line) {
+			if (exti_common.hits[line] == exti_common.seen[line])
+				continue;
+
+			/* Edges coalesced since last pass make up one event, but all of them are counted */
+			edges = exti_common.hits[line] - exti_common.seen[line];
+			exti_common.seen[line] = exti_common.hits[line];
+
+			first = (exti_common.line[line].count == 0);
+			exti_common.line[line].count += edges;
+
+			if (!first && (now - exti_common.line[line].last) < exti_common.line[line].debounce)
+				continue;
+
+			exti_common.line[line].last = now;
+
+			/* Drop the oldest event if queue is full */
+			if ((exti_common.line[line].head - exti_common.line[line].tail) == EXTI_QUEUE) {
+				++exti_common.line[line].tail;
+				++exti_common.line[line].overflow;
+			}
+
+			exti_common.line[line].stamps[exti_common.line[line].head++ & (EXTI_QUEUE - 1)] = now;
+		}
+		wait = _exti_serve(now);
+		mutexUnlock(exti_common.evLock);
+	}
 }
 
 
-static int exti9_5_handler(unsigned int n, void *arg)
+/* Returns 1 if response is deferred to exti_thread, otherwise err and event are set in msg */
+int exti_waitEvent(unsigned int port, msg_t *msg, unsigned int rid)
 {
-	*(exti_common.base + pr1) |= 0x3e0;
-	return -1;
+	multi_i_t *imsg = (multi_i_t *)msg->i.raw;
+	multi_o_t *omsg = (multi_o_t *)msg->o.raw;
+	unsigned int mask = imsg->exti_wait.mask & ((1 << EXTI_LINES) - 1);
+	time_t now;
+	int i, line;
+
+	if (!mask) {
+		omsg->err = -EINVAL;
+		return 0;
+	}
+
+	mutexLock(exti_common.evLock);
+	if ((line = _exti_oldest(mask)) >= 0) {
+		_exti_pop(line, &omsg->exti_event);
+		omsg->err = EOK;
+		mutexUnlock(exti_common.evLock);
+		return 0;
+	}
+
+	/* Don't block a pool thread, exti_thread responds on event or timeout */
+	for (i = 0; i < EXTI_WAITERS; ++i) {
+		if (!exti_common.waiters[i].used)
+			break;
+	}
+
+	if (i == EXTI_WAITERS) {
+		omsg->err = -EBUSY;
+		mutexUnlock(exti_common.evLock);
+		return 0;
+	}
+
+	exti_common.waiters[i].deadline = 0;
+	if (imsg->exti_wait.timeout != 0) {
+		gettime(&now, NULL);
+		exti_common.waiters[i].deadline = now + imsg->exti_wait.timeout;
+	}
+
+	exti_common.waiters[i].msg = *msg;
+	exti_common.waiters[i].rid = rid;
+	exti_common.waiters[i].port = port;
+	exti_common.waiters[i].mask = mask;
+	exti_common.waiters[i].used = 1;
+	mutexUnlock(exti_common.evLock);
+
+	/* Let exti_thread account for the new deadline */
+	if (imsg->exti_wait.timeout != 0) {
+		mutexLock(exti_common.irqLock);
+		exti_common.rearm = 1;
+		condSignal(exti_common.irqCond);
+		mutexUnlock(exti_common.irqLock);
+	}
+
+	return 1;
 }
 
 
-static int exti15_10_handler(unsigned int n, void *arg)
+int exti_setDebounce(unsigned int line, unsigned int us)
 {
-	*(exti_common.base + pr1) |= 0xfc00;
-	return -1;
+	if (line >= EXTI_LINES)
+		return -EINVAL;
+
+	mutexLock(exti_common.evLock);
+	exti_common.line[line].debounce = us;
+	mutexUnlock(exti_common.evLock);
+
+	return EOK;
 }
 
 
@@ -133,6 +343,16 @@ int exti_configure(unsigned int line, unsigned char mode, unsigned char edge)
 }
 
 
+/* Can be called from interrupt handlers */
+void exti_ack(unsigned int line)
+{
+	if (line > 31)
+		*(exti_common.base + pr2) = 1 << (line - 32);
+	else
+		*(exti_common.base + pr1) = 1 << line;
+}
+
+
 int syscfg_mapexti(unsigned int line, int port)
 {
 	volatile unsigned int *cr;
@@ -169,14 +389,20 @@ int exti_init(void)
 	exti_common.syscfg = (void *)0x40010000;
 
 	mutexCreate(&exti_common.lock);
-
-	interrupt(exti0_irq, exti0_handler, NULL, 0, NULL);
-	interrupt(exti1_irq, exti1_handler, NULL, 0, NULL);
-	interrupt(exti2_irq, exti2_handler, NULL, 0, NULL);
-	interrupt(exti3_irq, exti3_handler, NULL, 0, NULL);
-	interrupt(exti4_irq, exti4_handler, NULL, 0, NULL);
-	interrupt(exti9_5_irq, exti9_5_handler, NULL, 0, NULL);
-	interrupt(exti15_10_irq, exti15_10_handler, NULL, 0, NULL);
+	mutexCreate(&exti_common.irqLock);
+	condCreate(&exti_common.irqCond);
+	mutexCreate(&exti_common.evLock);
+
+	/* EXTI interrupts wake up the core from STOP mode, no need for keepidle */
+	interrupt(exti0_irq, exti_handler, (void *)0x1, exti_common.irqCond, NULL);
+	interrupt(exti1_irq, exti_handler, (void *)0x2, exti_common.irqCond, NULL);
+	interrupt(exti2_irq, exti_handler, (void *)0x4, exti_common.irqCond, NULL);
+	interrupt(exti3_irq, exti_handler, (void *)0x8, exti_common.irqCond, NULL);
+	interrupt(exti4_irq, exti_handler, (void *)0x10, exti_common.irqCond, NULL);
+	interrupt(exti9_5_irq, exti_handler, (void *)0x3e0, exti_common.irqCond, NULL);
+	interrupt(exti15_10_irq, exti_handler, (void *)0xfc00, exti_common.irqCond, NULL);
+
+	beginthread(exti_thread, 0, exti_common.stack, sizeof(exti_common.stack), NULL);
 
 	return 0;
 }
@@ -13,14 +13,26 @@
 #define _EXTI_H_
 
 #include <sys/interrupt.h>
+#include <sys/msg.h>
+
+#include "stm32-multi.h"
 
 
 int exti_configure(unsigned int line, unsigned char mode, unsigned char edge);
 
 
+void exti_ack(unsigned int line);
+
+
 int syscfg_mapexti(unsigned int line, int port);
 
 
+int exti_setDebounce(unsigned int line, unsigned int us);
+
+
+int exti_waitEvent(unsigned int port, msg_t *msg, unsigned int rid);
+
+
 int exti_init(void);
 
 
@@ -24,6 +24,11 @@
 #include "common.h"
 
 
+/* Programming unit and fast programming row */
+#define FLASH_DW 8
+#define FLASH_ROW (32 * FLASH_DW)
+
+
 enum { flash_acr = 0, flash_pdkeyr, flash_keyr, flash_optkeyr, flash_sr, flash_cr, flash_eccr,
 	flash_optr = flash_eccr + 2, flash_pcrop1sr, flash_pcrop1er, flash_wrp1ar, flash_wrp1br,
 	flash_pcrop2sr = flash_wrp1br + 5, flash_pcrop2er, flash_wrp2ar, flash_wrp2br };
@@ -37,7 +42,7 @@ struct {
 	handle_t irqlock;
 	handle_t irqh;
 
-	char page[FLASH_PAGE_SIZE];
+	char page[FLASH_PAGE_SIZE] __attribute__ ((aligned(8)));
 } flash_common;
 
 
@@ -105,6 +110,17 @@ static inline int program_isValidAddress(uint32_t addr, size_t size)
 }
 
 
+/* EEPROM emulation pages are written by eeprom_write() only */
+static inline int program_isReserved(uint32_t addr, size_t size)
+{
+#if EEPROM_EMUL_PAGES
+	return addr < (EEPROM_EMUL_ADDR + EEPROM_EMUL_PAGES * FLASH_PAGE_SIZE) && addr + size > EEPROM_EMUL_ADDR;
+#else
+	return 0;
+#endif
+}
+
+
 static size_t _program_readData(uint32_t offset, char *buff, size_t size)
 {
 	memcpy(buff, (void *)offset, size);
@@ -156,48 +172,167 @@ static int _program_erasePage(uint32_t addr)
 }
 
 
-static int _program_writePage(uint32_t offset)
+static int _program_isErased(const void *ptr, size_t size)
+{
+	const uint32_t *w = ptr;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(uint32_t); ++i) {
+		if (w[i] != 0xffffffff)
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static int _program_dw(uint32_t addr, const char *data)
 {
-	int pos = 0;
-	volatile uint32_t *ptr = (void *)offset;
+	volatile uint32_t *ptr = (void *)addr;
 	uint32_t t[2];
+	int err;
 
-	if (offset & (FLASH_PAGE_SIZE - 1))
+	if (_flash_wait() != 0)
 		return -1;
 
+	_flash_clearFlags();
+
+	*(flash_common.flash + flash_cr) |= 1;
+	memcpy(t, data, sizeof(t));
+	*(ptr++) = t[0];
+	dataBarier();
+	*(ptr++) = t[1];
+	dataBarier();
+
+	err = _flash_wait();
+	_flash_clearFlags();
+	*(flash_common.flash + flash_cr) &= ~1;
+
+	return err;
+}
+
+
+static int _program_row(uint32_t addr, const char *data)
+{
+	volatile uint32_t *ptr = (void *)addr;
+	const uint32_t *w = (const void *)data;
+	int i, err;
+
 	if (_flash_wait() != 0)
 		return -1;
 
 	_flash_clearFlags();
 
-	for (pos = 0; pos < FLASH_PAGE_SIZE; pos += 2 * sizeof(uint32_t)) {
-		*(flash_common.flash + flash_cr) |= 1;
-		memcpy(t, flash_common.page + pos, 2 * sizeof(uint32_t));
-		*(ptr++) = t[0];
-		dataBarier();
-		*(ptr++) = t[1];
-		dataBarier();
-
-		if (_flash_wait() != 0) {
-			*(flash_common.flash + flash_cr) &= ~1;
-			return -1;
-		}
+	/* Row has to be written without gaps, otherwise MISSERR aborts programming */
+	*(flash_common.flash + flash_cr) |= 1 << 18;
+	dataBarier();
 
-		_flash_clearFlags();
+	for (i = 0; i < FLASH_ROW / sizeof(uint32_t); ++i)
+		ptr[i] = w[i];
+	dataBarier();
+
+	err = _flash_wait();
+	if (*(flash_common.flash + flash_sr) & ((1 << 9) | (1 << 8)))
+		err = -1;
+
+	_flash_clearFlags();
+	*(flash_common.flash + flash_cr) &= ~(1 << 18);
+
+	return err;
+}
+
+
+/*
+ * Fast programming is aborted by any read of the bank being programmed,
+ * so it's only used when code is executed from RAM or the other bank.
+ */
+static int _program_fastAllowed(uint32_t addr)
+{
+	if (getPC() >= 0x10000000)
+		return 1;
+
+	return flash_activeBank() != ((addr < FLASH_PROGRAM_2_ADDR) ? 0 : 1);
+}
+
+
+/* Double words which differ and are not erased can't be programmed */
+static int _program_needsErase(uint32_t cpage, size_t start, size_t end)
+{
+	size_t pos;
+
+	for (pos = start; pos < end; pos += FLASH_DW) {
+		if (memcmp((void *)(cpage + pos), flash_common.page + pos, FLASH_DW) != 0 &&
+				!_program_isErased((void *)(cpage + pos), FLASH_DW))
+			return 1;
 	}
 
-	*(flash_common.flash + flash_cr) &= ~1;
+	return 0;
+}
+
+
+static int _program_writeRange(uint32_t cpage, size_t start, size_t end, int fast)
+{
+	size_t pos = start, i;
+	int row;
+
+	while (pos < end) {
+		/* Erased double words are never programmed, so they can be written later */
+		row = fast && !(pos & (FLASH_ROW - 1)) && (pos + FLASH_ROW) <= end &&
+			_program_isErased((void *)(cpage + pos), FLASH_ROW);
+
+		for (i = 0; row && i < FLASH_ROW; i += FLASH_DW) {
+			if (_program_isErased(flash_common.page + pos + i, FLASH_DW))
+				row = 0;
+		}
+
+		if (row) {
+			if (_program_row(cpage + pos, flash_common.page + pos) == 0 &&
+					memcmp((void *)(cpage + pos), flash_common.page + pos, FLASH_ROW) == 0) {
+				pos += FLASH_ROW;
+				continue;
+			}
+
+			/* Aborted row, finish it with double words, erased ones don't need erase */
+			fast = 0;
+			continue;
+		}
+
+		if (memcmp((void *)(cpage + pos), flash_common.page + pos, FLASH_DW) != 0) {
+			if (!_program_isErased((void *)(cpage + pos), FLASH_DW) ||
+					_program_dw(cpage + pos, flash_common.page + pos) < 0)
+				return -1;
+		}
+
+		pos += FLASH_DW;
+	}
 
 	return 0;
 }
 
 
+static int _program_rewritePage(uint32_t cpage, int fast)
+{
+	if (_program_erasePage(cpage) < 0)
+		return -1;
+
+	if (_program_writeRange(cpage, 0, FLASH_PAGE_SIZE, fast) == 0)
+		return 0;
+
+	/* Aborted row left partially programmed double words, retry with double words only */
+	if (!fast || _program_erasePage(cpage) < 0)
+		return -1;
+
+	return _program_writeRange(cpage, 0, FLASH_PAGE_SIZE, 0);
+}
+
+
 size_t flash_writeData(uint32_t offset, const char *buff, size_t size)
 {
-	size_t towrite = size, chunk;
+	size_t towrite = size, chunk, start, end;
 	uint32_t coffset = offset, cpage, missalign;
+	int err, fast;
 
-	if (!program_isValidAddress(offset, size))
+	if (!program_isValidAddress(offset, size) || program_isReserved(offset, size))
 		return 0;
 
 	mutexLock(flash_common.lock);
@@ -209,15 +344,22 @@ size_t flash_writeData(uint32_t offset, const char *buff, size_t size)
 		missalign = coffset - cpage;
 		chunk = (towrite > FLASH_PAGE_SIZE - missalign) ? FLASH_PAGE_SIZE - missalign : towrite;
 
-		if (chunk != FLASH_PAGE_SIZE) {
-			if (_program_readData(cpage, flash_common.page, FLASH_PAGE_SIZE) != FLASH_PAGE_SIZE)
-				break;
-		}
-		if (_program_erasePage(cpage) < 0)
+		start = missalign & ~(FLASH_DW - 1);
+		end = (missalign + chunk + FLASH_DW - 1) & ~(FLASH_DW - 1);
+
+		if (_program_readData(cpage, flash_common.page, FLASH_PAGE_SIZE) != FLASH_PAGE_SIZE)
 			break;
 		memcpy(flash_common.page + missalign, buff + size - towrite, chunk);
-		if (_program_writePage(cpage) < 0)
+
+		/* Skip erase if only erased double words have to be programmed */
+		fast = _program_fastAllowed(cpage);
+		err = -1;
+		if (!_program_needsErase(cpage, start, end))
+			err = _program_writeRange(cpage, start, end, fast);
+
+		if (err < 0 && _program_rewritePage(cpage, fast) < 0)
 			break;
+
 		towrite -= chunk;
 		coffset += chunk;
 	}
@@ -229,6 +371,331 @@ size_t flash_writeData(uint32_t offset, const char *buff, size_t size)
 }
 
 
+#if EEPROM_EMUL_PAGES
+
+/*
+ * EEPROM emulation. Every page starts with a header (magic and sequence
+ * number, then a completion mark) followed by records appended one double
+ * word at a time. A record holds the value, the virtual address and a
+ * checksum, the last one of a variable is valid. When the active page fills
+ * up, live variables are copied to the next page (round-robin for wear
+ * leveling) and the old page is erased by the background thread.
+ */
+
+#define EEPROM_MAGIC 0x554d4545
+#define EEPROM_RECORDS (FLASH_PAGE_SIZE / FLASH_DW)
+#define EEPROM_FIRST 2
+
+/* Free records left when compaction is started in background */
+#define EEPROM_LOWWATER 16
+
+/* Interrupted transfer is redone into a third page, keeping the last complete one */
+#if EEPROM_EMUL_PAGES < 3 || EEPROM_EMUL_PAGES > 32
+#error "EEPROM_EMUL_PAGES has to be in range 3 - 32"
+#endif
+
+#if EEPROM_EMUL_VARS > (EEPROM_RECORDS - EEPROM_FIRST - EEPROM_LOWWATER)
+#error "EEPROM_EMUL_VARS doesn't fit in a page"
+#endif
+
+
+typedef struct {
+	uint32_t val;
+	uint16_t addr;
+	uint16_t check;
+} eeprom_record_t;
+
+
+struct {
+	uint32_t val[EEPROM_EMUL_VARS];
+	uint8_t valid[EEPROM_EMUL_VARS];
+	handle_t lock;
+
+	unsigned int page;
+	unsigned int next;
+	uint32_t seq;
+	uint32_t erase;
+	int compact;
+	handle_t cond;
+
+	char stack[512] __attribute__ ((aligned(8)));
+} eeprom_common;
+
+
+static inline uint32_t eeprom_pageAddr(unsigned int page)
+{
+	return EEPROM_EMUL_ADDR + page * FLASH_PAGE_SIZE;
+}
+
+
+static inline const eeprom_record_t *eeprom_record(unsigned int page, unsigned int n)
+{
+	return (const void *)(eeprom_pageAddr(page) + n * FLASH_DW);
+}
+
+
+static uint16_t eeprom_check(uint16_t addr, uint32_t val)
+{
+	return ~(addr + (val & 0xffff) + (val >> 16));
+}
+
+
+static int _eeprom_append(unsigned int page, unsigned int n, uint16_t addr, uint32_t val)
+{
+	eeprom_record_t r;
+
+	r.val = val;
+	r.addr = addr;
+	r.check = eeprom_check(addr, val);
+
+	return _program_dw(eeprom_pageAddr(page) + n * FLASH_DW, (const char *)&r);
+}
+
+
+static int _eeprom_erase(unsigned int page)
+{
+	eeprom_common.erase &= ~(1u << page);
+
+	if (_program_isErased((void *)eeprom_pageAddr(page), FLASH_PAGE_SIZE))
+		return EOK;
+
+	return _program_erasePage(eeprom_pageAddr(page));
+}
+
+
+/* Copies live variables to the page, the old one is erased later */
+static int _eeprom_transfer(unsigned int page)
+{
+	unsigned int n = EEPROM_FIRST, i;
+	uint32_t hdr[2];
+
+	if (_eeprom_erase(page) < 0)
+		return -EIO;
+
+	hdr[0] = EEPROM_MAGIC;
+	hdr[1] = eeprom_common.seq + 1;
+	if (_program_dw(eeprom_pageAddr(page), (const char *)hdr) < 0)
+		return -EIO;
+
+	for (i = 0; i < EEPROM_EMUL_VARS; ++i) {
+		if (eeprom_common.valid[i] && _eeprom_append(page, n++, i, eeprom_common.val[i]) < 0)
+			return -EIO;
+	}
+
+	/* Page without completion mark is redone after reset */
+	hdr[0] = 0;
+	hdr[1] = 0;
+	if (_program_dw(eeprom_pageAddr(page) + FLASH_DW, (const char *)hdr) < 0)
+		return -EIO;
+
+	eeprom_common.erase |= 1u << eeprom_common.page;
+	eeprom_common.page = page;
+	eeprom_common.next = n;
+	++eeprom_common.seq;
+	condSignal(eeprom_common.cond);
+
+	return EOK;
+}
+
+
+int eeprom_read(unsigned int addr, uint32_t *val)
+{
+	int err = EOK;
+
+	if (addr >= EEPROM_EMUL_VARS)
+		return -EINVAL;
+
+	mutexLock(eeprom_common.lock);
+	if (eeprom_common.valid[addr])
+		*val = eeprom_common.val[addr];
+	else
+		err = -ENOENT;
+	mutexUnlock(eeprom_common.lock);
+
+	return err;
+}
+
+
+int eeprom_write(unsigned int addr, uint32_t val)
+{
+	int err = EOK;
+
+	if (addr >= EEPROM_EMUL_VARS)
+		return -EINVAL;
+
+	mutexLock(flash_common.lock);
+
+	if (!eeprom_common.valid[addr] || eeprom_common.val[addr] != val) {
+		_program_unlock();
+		_flash_clearFlags();
+
+		if (eeprom_common.next >= EEPROM_RECORDS)
+			err = _eeprom_transfer((eeprom_common.page + 1) % EEPROM_EMUL_PAGES);
+
+		/* Failed record is skipped, it's ignored after reset anyway */
+		if (err == EOK && _eeprom_append(eeprom_common.page, eeprom_common.next++, addr, val) < 0)
+			err = -EIO;
+
+		_program_lock();
+
+		if (err == EOK) {
+			mutexLock(eeprom_common.lock);
+			eeprom_common.val[addr] = val;
+			eeprom_common.valid[addr] = 1;
+			mutexUnlock(eeprom_common.lock);
+		}
+
+		if (EEPROM_RECORDS - eeprom_common.next < EEPROM_LOWWATER) {
+			eeprom_common.compact = 1;
+			condSignal(eeprom_common.cond);
+		}
+	}
+
+	mutexUnlock(flash_common.lock);
+
+	return err;
+}
+
+
+static void eeprom_thread(void *arg)
+{
+	unsigned int page;
+
+	mutexLock(flash_common.lock);
+
+	for (;;) {
+		while (!eeprom_common.erase && !eeprom_common.compact)
+			condWait(eeprom_common.cond, flash_common.lock, 0);
+
+		_program_unlock();
+		_flash_clearFlags();
+
+		if (eeprom_common.compact) {
+			eeprom_common.compact = 0;
+			_eeprom_transfer((eeprom_common.page + 1) % EEPROM_EMUL_PAGES);
+		}
+		else {
+			/* One page at a time, so that writes are not stalled for long */
+			for (page = 0; !(eeprom_common.erase & (1u << page)); ++page)
+				;
+			_eeprom_erase(page);
+		}
+
+		_program_lock();
+
+		mutexUnlock(flash_common.lock);
+		mutexLock(flash_common.lock);
+	}
+}
+
+
+static int eeprom_init(void)
+{
+	const uint32_t *hdr;
+	const eeprom_record_t *r;
+	unsigned int page, last = EEPROM_EMUL_PAGES, complete = EEPROM_EMUL_PAGES, i, n;
+	uint32_t seq;
+	int err = EOK;
+
+	mutexCreate(&eeprom_common.lock);
+	condCreate(&eeprom_common.cond);
+
+	/* Replay pages starting from the oldest one, the newest is active */
+	for (;;) {
+		page = EEPROM_EMUL_PAGES;
+		for (i = 0; i < EEPROM_EMUL_PAGES; ++i) {
+			hdr = (const void *)eeprom_pageAddr(i);
+			if (hdr[0] == EEPROM_MAGIC && hdr[1] > eeprom_common.seq && (page == EEPROM_EMUL_PAGES || hdr[1] < seq)) {
+				page = i;
+				seq = hdr[1];
+			}
+		}
+
+		if (page == EEPROM_EMUL_PAGES)
+			break;
+
+		for (n = EEPROM_FIRST; n < EEPROM_RECORDS; ++n) {
+			r = eeprom_record(page, n);
+			if (_program_isErased(r, FLASH_DW))
+				break;
+
+			if (r->addr < EEPROM_EMUL_VARS && r->check == eeprom_check(r->addr, r->val)) {
+				eeprom_common.val[r->addr] = r->val;
+				eeprom_common.valid[r->addr] = 1;
+			}
+		}
+
+		if (last != EEPROM_EMUL_PAGES)
+			eeprom_common.erase |= 1u << last;
+
+		if (!_program_isErased(eeprom_record(page, 1), FLASH_DW))
+			complete = page;
+
+		last = page;
+		eeprom_common.seq = seq;
+		eeprom_common.next = n;
+	}
+
+	for (i = 0; i < EEPROM_EMUL_PAGES; ++i) {
+		hdr = (const void *)eeprom_pageAddr(i);
+		if (hdr[0] != EEPROM_MAGIC && !_program_isErased(hdr, FLASH_PAGE_SIZE))
+			eeprom_common.erase |= 1u << i;
+	}
+
+	_program_unlock();
+	_flash_clearFlags();
+
+	if (last == EEPROM_EMUL_PAGES) {
+		/* Nothing stored yet, start from the first page */
+		eeprom_common.page = EEPROM_EMUL_PAGES - 1;
+		err = _eeprom_transfer(0);
+	}
+	else {
+		eeprom_common.page = last;
+
+		/*
+		 * Transfer was interrupted, values are already replayed from all pages.
+		 * It's redone into a page which is neither the interrupted one nor
+		 * the last complete one, the latter is kept until the redo is done.
+		 */
+		if (complete != last) {
+			page = (last + 1) % EEPROM_EMUL_PAGES;
+			if (page == complete)
+				page = (page + 1) % EEPROM_EMUL_PAGES;
+
+			if (complete != EEPROM_EMUL_PAGES)
+				eeprom_common.erase &= ~(1u << complete);
+
+			if ((err = _eeprom_transfer(page)) == EOK && complete != EEPROM_EMUL_PAGES)
+				eeprom_common.erase |= 1u << complete;
+		}
+		else if (EEPROM_RECORDS - eeprom_common.next < EEPROM_LOWWATER)
+			eeprom_common.compact = 1;
+	}
+
+	_program_lock();
+
+	beginthread(eeprom_thread, 3, eeprom_common.stack, sizeof(eeprom_common.stack), NULL);
+
+	return err;
+}
+
+#else
+
+int eeprom_read(unsigned int addr, uint32_t *val)
+{
+	return -ENODEV;
+}
+
+
+int eeprom_write(unsigned int addr, uint32_t val)
+{
+	return -ENODEV;
+}
+
+#endif
+
+
 int flash_init(void)
 {
 	flash_common.flash = (void *) 0x40022000;
@@ -245,5 +712,9 @@ int flash_init(void)
 	*(flash_common.flash + flash_cr) |= (1 << 25) | (1 << 24);
 	_program_lock();
 
+#if EEPROM_EMUL_PAGES
+	return eeprom_init();
+#else
 	return EOK;
+#endif
 }
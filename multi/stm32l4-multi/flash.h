@@ -41,6 +41,12 @@ extern size_t flash_readData(uint32_t offset, char *buff, size_t size);
 extern size_t flash_writeData(uint32_t offset, const char *buff, size_t size);
 
 
+extern int eeprom_read(unsigned int addr, uint32_t *val);
+
+
+extern int eeprom_write(unsigned int addr, uint32_t val);
+
+
 extern int flash_init(void);
 
 
@@ -79,6 +79,19 @@ int rcc_getCpufreq(void)
 }
 
 
+int rcc_getApb1TimerFreq(void)
+{
+	unsigned int t = *(rcc_common.base + cfgr);
+	int freq = rcc_getCpufreq(); /* HCLK */
+
+	/* APB1 timers run at twice PCLK1 if it's divided */
+	if (t & (1 << 10))
+		freq = (freq >> (((t >> 8) & 0x3) + 1)) << 1;
+
+	return freq;
+}
+
+
 void pwr_lock(void)
 {
 	mutexLock(rcc_common.lock);
@@ -30,6 +30,9 @@ int rcc_devClk(int dev, int state);
 int rcc_getCpufreq(void);
 
 
+int rcc_getApb1TimerFreq(void);
+
+
 int rcc_init(void);
 
 
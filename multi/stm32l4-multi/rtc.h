@@ -27,6 +27,9 @@ int rtc_getTime(rtctimestamp_t *timestamp);
 int rtc_setTime(rtctimestamp_t *timestamp);
 
 
+void *rtc_getPage(void);
+
+
 int rtc_init(void);
 
 #endif
@@ -23,6 +23,7 @@
 #include "stm32-multi.h"
 #include "common.h"
 #include "rcc.h"
+#include "dma.h"
 #include "spi.h"
 
 
@@ -30,11 +31,17 @@
 #define SPI2_POS (SPI1_POS + SPI1)
 #define SPI3_POS (SPI2_POS + SPI2)
 
+/* Shorter transfers are done by polling FIFO */
+#define SPI_DMA_THRESHOLD 32
+
 
 struct {
 	volatile uint16_t *base;
 	volatile int ready;
 
+	const dma_channel_t *rxdma;
+	const dma_channel_t *txdma;
+
 	handle_t mutex;
 	handle_t irqLock;
 	handle_t cond;
@@ -42,6 +49,22 @@ struct {
 } spi_common[SPI1 + SPI2 + SPI3];
 
 
+static const int spiDma[] = { SPI1_DMA, SPI2_DMA, SPI3_DMA };
+
+
+/* RX and TX channels, SPI1, SPI2 and SPI3 share them with USART3, USART1 and UART5 (see config.h) */
+static const dma_channel_t spiDmaChannels[][2] = {
+	{ { dma1, 1, 1 }, { dma1, 2, 1 } },
+	{ { dma1, 3, 1 }, { dma1, 4, 1 } },
+	{ { dma2, 0, 3 }, { dma2, 1, 3 } }
+};
+
+
+/* Sent when there is no TX data and written when RX data is discarded */
+static const uint8_t spi_txDummy = 0;
+static uint8_t spi_rxDummy;
+
+
 static const int spi2pctl[] = { pctl_spi1, pctl_spi2, pctl_spi3 };
 
 
@@ -54,73 +77,143 @@ static const int spiPos[] = { SPI1_POS, SPI2_POS, SPI3_POS };
 enum { cr1 = 0, cr2 = 2, sr = 4, dr = 6, crcpr = 8, rxcrcr = 10, txcrcr = 12 };
 
 
-static int spi_irqHandler(unsigned int n, void *arg)
+static int spi_dmaIrqHandler(unsigned int n, void *arg)
 {
-	*(spi_common[(int)arg].base + cr2) &= ~(1 << 7);
+	if (!(dma_events(spi_common[(int)arg].rxdma) & (dma_tc | dma_te)))
+		return -1;
+
 	spi_common[(int)arg].ready = 1;
 
 	return 1;
 }
 
 
-static unsigned char _spi_readwrite(int spi, unsigned char txd)
+static void _spi_fifoReadWrite(int spi, const unsigned char *obuff, unsigned char *ibuff, size_t len)
+{
+	volatile uint16_t *base = spi_common[spi].base;
+	size_t txd = 0, rxd = 0;
+	uint16_t t;
+
+	/* RXNE on 16 bits, received bytes are read in pairs */
+	*(base + cr2) &= ~(1 << 12);
+
+	while (rxd < len) {
+		/* Up to 4 bytes in flight, RX FIFO can't overflow */
+		if (txd < len && (txd - rxd) <= 2 && (*(base + sr) & (1 << 1))) {
+			if ((len - txd) > 1) {
+				/* Data packing, two frames per write */
+				t = (obuff != NULL) ? (obuff[txd] | (obuff[txd + 1] << 8)) : 0;
+				*(base + dr) = t;
+				txd += 2;
+			}
+			else {
+				*((volatile uint8_t *)(base + dr)) = (obuff != NULL) ? obuff[txd] : 0;
+				++txd;
+			}
+		}
+
+		if ((len - rxd) == 1)
+			*(base + cr2) |= 1 << 12;
+
+		if (*(base + sr) & 1) {
+			if ((len - rxd) > 1) {
+				t = *(base + dr);
+				if (ibuff != NULL) {
+					ibuff[rxd] = t & 0xff;
+					ibuff[rxd + 1] = t >> 8;
+				}
+				rxd += 2;
+			}
+			else {
+				t = *((volatile uint8_t *)(base + dr));
+				if (ibuff != NULL)
+					ibuff[rxd] = t;
+				++rxd;
+			}
+		}
+	}
+
+	*(base + cr2) |= 1 << 12;
+}
+
+
+static void _spi_dmaReadWrite(int spi, const unsigned char *obuff, unsigned char *ibuff, size_t len)
 {
-	unsigned char rxd;
+	size_t chunk;
+
+	while (len > 0) {
+		chunk = min(len, 0xffff);
+
+		mutexLock(spi_common[spi].irqLock);
+		spi_common[spi].ready = 0;
 
-	spi_common[spi].ready = 0;
+		/* RX has to be enabled first, TX request starts the transfer */
+		dma_start(spi_common[spi].rxdma, (ibuff != NULL) ? ibuff : &spi_rxDummy, chunk, ibuff != NULL, dma_tc | dma_te);
+		*(spi_common[spi].base + cr2) |= 1;
+		dma_start(spi_common[spi].txdma, (void *)((obuff != NULL) ? obuff : &spi_txDummy), chunk, obuff != NULL, 0);
+		*(spi_common[spi].base + cr2) |= 1 << 1;
 
-	/* Initiate transmission */
-	*((uint8_t *)(spi_common[spi].base + dr)) = txd;
-	*(spi_common[spi].base + cr2) |= 1 << 7;
+		while (!spi_common[spi].ready)
+			condWait(spi_common[spi].cond, spi_common[spi].irqLock, 0);
+		mutexUnlock(spi_common[spi].irqLock);
 
-	mutexLock(spi_common[spi].irqLock);
-	while (!spi_common[spi].ready)
-		condWait(spi_common[spi].cond, spi_common[spi].irqLock, 1);
-	mutexUnlock(spi_common[spi].irqLock);
+		*(spi_common[spi].base + cr2) &= ~0x3;
+		dma_stop(spi_common[spi].rxdma);
+		dma_stop(spi_common[spi].txdma);
+
+		if (obuff != NULL)
+			obuff += chunk;
+		if (ibuff != NULL)
+			ibuff += chunk;
+		len -= chunk;
+	}
+}
 
-	rxd = *((uint8_t *)(spi_common[spi].base + dr));
 
-	return rxd;
+static void _spi_readwrite(int spi, const unsigned char *obuff, unsigned char *ibuff, size_t len)
+{
+	if (spi_common[spi].rxdma != NULL && len >= SPI_DMA_THRESHOLD)
+		_spi_dmaReadWrite(spi, obuff, ibuff, len);
+	else
+		_spi_fifoReadWrite(spi, obuff, ibuff, len);
 }
 
 
 int spi_transaction(int spi, int dir, unsigned char cmd, unsigned int addr, unsigned char flags, unsigned char *ibuff, unsigned char *obuff, size_t bufflen)
 {
-	int i;
+	unsigned char hdr[5];
+	size_t hdrlen = 0;
 
 	if (spi < spi1 || spi > spi3 || !spiConfig[spi])
 		return -EINVAL;
 
 	spi = spiPos[spi];
 
-	mutexLock(spi_common[spi].mutex);
-	keepidle(1);
-
 	if (flags & spi_cmd)
-		_spi_readwrite(spi, cmd);
+		hdr[hdrlen++] = cmd;
 
 	if (flags & spi_address) {
-		for (i = 0; i < 3; ++i) {
-			_spi_readwrite(spi, (addr >> 16) & 0xff);
-			addr <<= 8;
-		}
+		hdr[hdrlen++] = (addr >> 16) & 0xff;
+		hdr[hdrlen++] = (addr >> 8) & 0xff;
+		hdr[hdrlen++] = addr & 0xff;
 	}
 
 	if (flags & spi_dummy)
-		_spi_readwrite(spi, 0);
+		hdr[hdrlen++] = 0;
 
-	if (dir == spi_read) {
-		for (i = 0; i < bufflen; ++i)
-			ibuff[i] = _spi_readwrite(spi, 0);
-	}
-	else if (dir == spi_write) {
-		for (i = 0; i < bufflen; ++i)
-			_spi_readwrite(spi, obuff[i]);
-	}
-	else {
-		for (i = 0; i < bufflen; ++i)
-			ibuff[i] = _spi_readwrite(spi, obuff[i]);
-	}
+	if (dir == spi_read)
+		obuff = NULL;
+	else if (dir == spi_write)
+		ibuff = NULL;
+
+	mutexLock(spi_common[spi].mutex);
+	keepidle(1);
+
+	if (hdrlen != 0)
+		_spi_fifoReadWrite(spi, hdr, NULL, hdrlen);
+
+	if (bufflen != 0)
+		_spi_readwrite(spi, obuff, ibuff, bufflen);
 
 	keepidle(0);
 	mutexUnlock(spi_common[spi].mutex);
@@ -163,16 +256,13 @@ void spi_init(void)
 {
 	int i, spi;
 
-	static const struct {
-		unsigned int base;
-		int irq;
-	} spiinfo[3] = { { 0x40013000, spi1_irq }, { 0x40003800, spi2_irq }, { 0x40003c00, spi3_irq } };
+	static const unsigned int spibase[3] = { 0x40013000, 0x40003800, 0x40003c00 };
 
 	for (i = 0, spi = 0; spi < 3; ++spi) {
 		if (!spiConfig[spi])
 			continue;
 
-		spi_common[i].base = (void *)spiinfo[spi].base;
+		spi_common[i].base = (void *)spibase[spi];
 		spi_common[i].ready = 1;
 
 		mutexCreate(&spi_common[i].mutex);
@@ -188,13 +278,24 @@ void spi_init(void)
 		/* 1 MHz baudrate, master, mode 0 */
 		*(spi_common[i].base + cr1) = (1 << 2);
 
-		/* 8 bits, motorola frame format */
-		*(spi_common[i].base + cr2) = (0x7 << 8) | (1 << 2);
+		/* 8 bits, motorola frame format, RXNE on 8 bits */
+		*(spi_common[i].base + cr2) = (1 << 12) | (0x7 << 8) | (1 << 2);
 
 		/* Enable SPI */
 		*(spi_common[i].base + cr1) |= 1 << 6;
 
-		interrupt(spiinfo[spi].irq, spi_irqHandler, (void *)i, spi_common[i].cond, &spi_common[i].inth);
+		spi_common[i].rxdma = NULL;
+		spi_common[i].txdma = NULL;
+
+		if (spiDma[spi]) {
+			dma_configure(&spiDmaChannels[spi][0], dma_per2mem, dma_priorityHigh, spi_common[i].base + dr, 1, 0,
+				spi_dmaIrqHandler, (void *)i, spi_common[i].cond, &spi_common[i].inth);
+			dma_configure(&spiDmaChannels[spi][1], dma_mem2per, dma_priorityMedium, spi_common[i].base + dr, 1, 0,
+				NULL, NULL, 0, NULL);
+
+			spi_common[i].rxdma = &spiDmaChannels[spi][0];
+			spi_common[i].txdma = &spiDmaChannels[spi][1];
+		}
 
 		++i;
 	}
@@ -32,6 +32,7 @@
 #include "uart.h"
 #include "spi.h"
 #include "exti.h"
+#include "dma.h"
 
 #define THREADS_NO 4
 #define THREADS_PRIORITY 1
@@ -45,12 +46,15 @@ struct {
 } common;
 
 
-static void handleMsg(msg_t *msg)
+/* Returns 1 if response is deferred */
+static int handleMsg(msg_t *msg, unsigned int rid)
 {
 	multi_i_t *imsg = (multi_i_t *)msg->i.raw;
 	multi_o_t *omsg = (multi_o_t *)msg->o.raw;
 	int err = EOK;
 	unsigned int t;
+	unsigned short mv;
+	uint32_t val;
 
 	switch (imsg->type) {
 #if 0
@@ -70,6 +74,13 @@ static void handleMsg(msg_t *msg)
 			err = syscfg_mapexti(imsg->exti_map.line, imsg->exti_map.port);
 			break;
 
+		case exti_wait:
+			return exti_waitEvent(common.port, msg, rid);
+
+		case exti_debounce:
+			err = exti_setDebounce(imsg->exti_debounce.line, imsg->exti_debounce.us);
+			break;
+
 		case flash_get:
 			err = flash_readData(imsg->flash_addr, msg->o.data, msg->o.size);
 			break;
@@ -78,6 +89,15 @@ static void handleMsg(msg_t *msg)
 			err = flash_writeData(imsg->flash_addr, msg->i.data, msg->i.size);
 			break;
 
+		case eeprom_get:
+			if ((err = eeprom_read(imsg->eeprom.addr, &val)) == EOK)
+				omsg->eeprom_val = val;
+			break;
+
+		case eeprom_set:
+			err = eeprom_write(imsg->eeprom.addr, imsg->eeprom.val);
+			break;
+
 		case rtc_setcal:
 			rtc_setCalib(imsg->rtc_calib);
 			break;
@@ -90,8 +110,24 @@ static void handleMsg(msg_t *msg)
 			rtc_setTime(&imsg->rtc_timestamp);
 			break;
 
+		case rtc_page:
+			omsg->rtc_page = (unsigned int)rtc_getPage();
+			break;
+
 		case adc_get:
-			omsg->adc_valmv = adc_conversion(imsg->adc_get.adcno, imsg->adc_get.channel);
+			if ((err = adc_conversion(imsg->adc_get.adcno, imsg->adc_get.channel, &mv)) == EOK)
+				omsg->adc_valmv = mv;
+			break;
+
+		case adc_stream_def:
+			err = adc_streamConfigure(imsg->adc_stream_def.mode, imsg->adc_stream_def.freq,
+				imsg->adc_stream_def.channels, imsg->adc_stream_def.len);
+			break;
+
+		case adc_stream_get:
+			t = 0;
+			err = adc_streamRead(msg->o.data, msg->o.size / sizeof(unsigned short), imsg->adc_stream_get.timeout, &t);
+			omsg->adc_lost = t;
 			break;
 
 		case spi_get:
@@ -141,11 +177,17 @@ static void handleMsg(msg_t *msg)
 			err = uart_write(imsg->uart_set.uart, msg->i.data, msg->i.size);
 			break;
 
+		case uart_overrun:
+			err = uart_getOverrun(imsg->uart_overrun, &omsg->uart_overrun);
+			break;
+
 		default:
 			err = -EINVAL;
 	}
 
 	omsg->err = err;
+
+	return 0;
 }
 
 
@@ -175,7 +217,10 @@ static void thread(void *arg)
 				break;
 
 			case mtDevCtl:
-				handleMsg(&msg);
+				if (handleMsg(&msg, rid) != 0) {
+					priority(THREADS_PRIORITY);
+					continue;
+				}
 				break;
 
 			case mtCreate:
@@ -204,13 +249,14 @@ int main(void)
 	oid_t oid;
 
 	rcc_init();
+	dma_init();
 	uart_init();
 	gpio_init();
 	spi_init();
 	adc_init();
+	exti_init();
 	rtc_init();
 	flash_init();
-	exti_init();
 
 /*
 	i2c_init();
@@ -19,7 +19,8 @@
 
 enum { adc_get = 0, rtc_setcal, rtc_get, rtc_set, i2c_get, i2c_set, gpio_def, gpio_get,
 	gpio_set, uart_def, uart_get, uart_set, flash_get, flash_set, spi_get, spi_set,
-	spi_rw, spi_def, exti_def, exti_map };
+	spi_rw, spi_def, exti_def, exti_map, adc_stream_def, adc_stream_get,
+	exti_wait, exti_debounce, eeprom_get, eeprom_set, rtc_page, uart_overrun };
 
 /* RTC */
 
@@ -36,6 +37,44 @@ typedef struct {
 } __attribute__((packed)) rtctimestamp_t;
 
 
+/*
+ * Time page published by the server, rtc_page returns its address. It's
+ * updated every second and after rtc_set, seq is odd during an update.
+ * subsec is the part of the second (in us) elapsed at uptime (gettime()),
+ * so current time is time + subsec + (gettime() - uptime).
+ */
+typedef struct {
+	unsigned int seq;
+	rtctimestamp_t time;
+	unsigned int subsec;
+	long long uptime;
+} rtcpage_t;
+
+
+/* Spins during an update, the page is written by a thread with priority 0 */
+static inline void rtc_readPage(const volatile rtcpage_t *page, rtcpage_t *snap)
+{
+	unsigned int seq;
+
+	do {
+		while ((seq = page->seq) & 1)
+			;
+
+		snap->time.year = page->time.year;
+		snap->time.month = page->time.month;
+		snap->time.day = page->time.day;
+		snap->time.wday = page->time.wday;
+		snap->time.hours = page->time.hours;
+		snap->time.minutes = page->time.minutes;
+		snap->time.seconds = page->time.seconds;
+		snap->subsec = page->subsec;
+		snap->uptime = page->uptime;
+	} while (page->seq != seq);
+
+	snap->seq = seq;
+}
+
+
 /* I2C */
 
 
@@ -107,6 +146,13 @@ typedef struct {
 } __attribute__((packed)) uartdef_t;
 
 
+/* Returned by uart_overrun for UART in multi_i_t uart_overrun, counted only with DMA */
+typedef struct {
+	unsigned int rxoverrun; /* times received data was overwritten before it was read */
+	unsigned int hwoverrun; /* overrun errors reported by USART */
+} __attribute__((packed)) uartoverrun_t;
+
+
 /* SPI */
 
 
@@ -154,6 +200,33 @@ typedef struct {
 } extimap_t;
 
 
+/*
+ * Events of GPIO lines (0 - 15) with interrupt enabled are queued with
+ * timestamps. exti_wait returns the oldest event of lines in mask, timeout
+ * 0 waits forever. Edges closer than debounce us to the last accepted
+ * event on the line are dropped. Up to 8 requests can wait at once, more
+ * fail with -EBUSY.
+ */
+typedef struct {
+	unsigned int mask;
+	unsigned int timeout;
+} extiwait_t;
+
+
+typedef struct {
+	unsigned int line;
+	unsigned int us;
+} extidebounce_t;
+
+
+typedef struct {
+	unsigned long long timestamp; /* us, when the edge was handled by the driver thread, not latched on the edge */
+	unsigned int line;
+	unsigned int count;    /* edges on line, including coalesced and debounced ones */
+	unsigned int overflow; /* events lost on line */
+} __attribute__((packed)) extievent_t;
+
+
 /* ADC */
 
 
@@ -166,6 +239,44 @@ typedef struct {
 } adcget_t;
 
 
+enum { adc_stream_stop = 0, adc_stream_continuous, adc_stream_timer };
+
+
+/*
+ * ADC1 streaming. Channel sequence is converted continuously or at freq Hz
+ * into a ring buffer. adc_stream_get returns raw 12-bit samples of whole
+ * sequences in msg.o.data and their number in err. It waits up to timeout
+ * us if no samples are available. Unread samples are overwritten, their
+ * number since the previous read is returned in adc_lost. Include channel 0
+ * (VREFINT) in the sequence to scale results to mV. While streaming, adc_get
+ * fails with -EBUSY on all ADCs, as they are scaled by VREFINT read on ADC1.
+ */
+typedef struct {
+	int mode;
+	unsigned int freq;
+	unsigned char len;
+	unsigned char channels[16];
+} __attribute__((packed)) adcstreamdef_t;
+
+
+typedef struct {
+	unsigned int timeout;
+} __attribute__((packed)) adcstreamget_t;
+
+
+/* EEPROM emulation */
+
+
+/*
+ * Variables are 32-bit words addressed by virtual address 0 - EEPROM_EMUL_VARS-1.
+ * eeprom_get returns -ENOENT for a variable which was never written.
+ */
+typedef struct {
+	unsigned short addr;
+	unsigned int val;
+} __attribute__((packed)) eeprommsg_t;
+
+
 /* MULTI */
 
 
@@ -174,12 +285,15 @@ typedef struct {
 
 	union {
 		adcget_t adc_get;
+		adcstreamdef_t adc_stream_def;
+		adcstreamget_t adc_stream_get;
 		int rtc_calib;
 		rtctimestamp_t rtc_timestamp;
 		i2cmsg_t i2c_msg;
 		uartget_t uart_get;
 		uartset_t uart_set;
 		uartdef_t uart_def;
+		int uart_overrun;
 		gpiodef_t gpio_def;
 		gpioget_t gpio_get;
 		gpioset_t gpio_set;
@@ -187,7 +301,10 @@ typedef struct {
 		spidef_t spi_def;
 		extidef_t exti_def;
 		extimap_t exti_map;
+		extiwait_t exti_wait;
+		extidebounce_t exti_debounce;
 		unsigned int flash_addr;
+		eeprommsg_t eeprom;
 	};
 } __attribute__((packed)) multi_i_t;
 
@@ -197,8 +314,13 @@ typedef struct {
 
 	union {
 		unsigned short adc_valmv;
+		unsigned int adc_lost;
 		rtctimestamp_t rtc_timestamp;
+		unsigned int rtc_page;
 		unsigned int gpio_get;
+		extievent_t exti_event;
+		unsigned int eeprom_val;
+		uartoverrun_t uart_overrun;
 	};
 } __attribute__((packed)) multi_o_t;
 
@@ -19,12 +19,14 @@
 #include <sys/pwman.h>
 #include <sys/interrupt.h>
 #include <sys/platform.h>
+#include <dma-ring.h>
 
 #include "stm32-multi.h"
 #include "common.h"
 #include "gpio.h"
 #include "uart.h"
 #include "rcc.h"
+#include "dma.h"
 
 #define UART1_POS 0
 #define UART2_POS (UART1_POS + UART1)
@@ -35,6 +37,8 @@
 
 #define UART_CNT (UART1 + UART2 + UART3 + UART4 + UART5 + LPUART1)
 
+#define UART_DMA_RXBUFSZ 256
+
 struct {
 	volatile unsigned int *base;
 	unsigned int port;
@@ -52,6 +56,19 @@ struct {
 	volatile char * volatile rxend;
 	volatile unsigned int *read;
 
+#if UART_DMA
+	const dma_channel_t *rxdma;
+	const dma_channel_t *txdma;
+	volatile char *rxbuf;
+	unsigned int rxtail;
+	dma_ring_t rxring;               /* Bytes received, sampled in interrupts */
+	unsigned int rxcons;             /* Bytes consumed in total */
+	unsigned int rxoverrun;          /* Times the ring was overwritten before being read */
+	volatile unsigned int hwoverrun; /* Overrun errors reported by the USART */
+	volatile int txdone;
+	int rxactive;
+#endif
+
 	handle_t rxlock;
 	handle_t rxcond;
 	handle_t txlock;
@@ -69,6 +86,86 @@ static const int uartPos[] = { UART1_POS, UART2_POS, UART3_POS, UART4_POS, UART5
 enum { cr1 = 0, cr2, cr3, brr, gtpr, rtor, rqr, isr, icr, rdr, tdr };
 
 
+#if UART_DMA
+static const int uartDma[] = { UART1_DMA, UART2_DMA, UART3_DMA, UART4_DMA, UART5_DMA, LPUART1_DMA };
+
+
+/* RX and TX channels */
+static const dma_channel_t uartDmaChannels[][2] = {
+	{ { dma1, 4, 2 }, { dma1, 3, 2 } },
+	{ { dma1, 5, 2 }, { dma1, 6, 2 } },
+	{ { dma1, 2, 2 }, { dma1, 1, 2 } },
+	{ { dma2, 4, 2 }, { dma2, 2, 2 } },
+	{ { dma2, 1, 2 }, { dma2, 0, 2 } },
+	{ { dma2, 6, 4 }, { dma2, 5, 4 } }
+};
+
+
+static unsigned int uart_dmaRxHead(void *arg)
+{
+	int uart = (int)arg;
+
+	return (UART_DMA_RXBUFSZ - dma_remaining(uart_common[uart].rxdma)) % UART_DMA_RXBUFSZ;
+}
+
+
+/* Called at least every half of the ring (HT/TC), so no lap is missed */
+static inline void uart_dmaRxSample(int uart)
+{
+	dma_ringSample(&uart_common[uart].rxring, uart_dmaRxHead((void *)uart), UART_DMA_RXBUFSZ);
+}
+
+
+static int uart_dmaRxirq(unsigned int n, void *arg)
+{
+	int uart = (int)arg;
+
+	/* Half and full transfer, data is flushed to the waiting reader */
+	if (dma_events(uart_common[uart].rxdma) == 0)
+		return -1;
+
+	uart_dmaRxSample(uart);
+
+	return 1;
+}
+
+
+static int uart_dmaTxirq(unsigned int n, void *arg)
+{
+	int uart = (int)arg;
+
+	if (!(dma_events(uart_common[uart].txdma) & (dma_tc | dma_te)))
+		return -1;
+
+	uart_common[uart].txdone = 1;
+
+	return 1;
+}
+
+
+static unsigned int _uart_dmaRxCopy(int uart, char *buff, unsigned int count)
+{
+	unsigned int head, prod, n = 0;
+
+	/* Data overwritten by the next lap of the ring is dropped, full ring can't be told from empty one */
+	prod = dma_ringProduced(&uart_common[uart].rxring, UART_DMA_RXBUFSZ, uart_dmaRxHead, (void *)uart, &head);
+	if (prod - uart_common[uart].rxcons >= UART_DMA_RXBUFSZ) {
+		uart_common[uart].rxoverrun++;
+		uart_common[uart].rxtail = head;
+		uart_common[uart].rxcons = prod;
+	}
+
+	while (uart_common[uart].rxtail != head && n < count) {
+		buff[n++] = uart_common[uart].rxbuf[uart_common[uart].rxtail++];
+		uart_common[uart].rxtail %= UART_DMA_RXBUFSZ;
+		uart_common[uart].rxcons++;
+	}
+
+	return n;
+}
+#endif
+
+
 static int uart_txirq(unsigned int n, void *arg)
 {
 	int uart = (int)arg, release = -1;
@@ -98,6 +195,22 @@ static int uart_rxirq(unsigned int n, void *arg)
 	if (n == lpuart1_irq)
 		*(uart_common[uart].base + icr) |= 1 << 20;
 
+#if UART_DMA
+	if (uart_common[uart].rxdma != NULL) {
+		/* Idle line, flush received data to the waiting reader */
+		if (*(uart_common[uart].base + isr) & ((1 << 4) | (1 << 3))) {
+			if (*(uart_common[uart].base + isr) & (1 << 3))
+				uart_common[uart].hwoverrun++;
+
+			*(uart_common[uart].base + icr) = (1 << 4) | (1 << 3);
+			uart_dmaRxSample(uart);
+			release = 1;
+		}
+
+		return release;
+	}
+#endif
+
 	if (*(uart_common[uart].base + isr) & ((1 << 5) | (1 << 3))) {
 		/* Clear overrun error bit */
 		*(uart_common[uart].base + icr) |= (1 << 3);
@@ -150,6 +263,17 @@ int uart_configure(int uart, char bits, char parity, unsigned int baud, char ena
 
 	dataBarier();
 
+#if UART_DMA
+	if (uart_common[pos].rxactive) {
+		dma_stop(uart_common[pos].rxdma);
+		keepidle(0);
+		uart_common[pos].rxactive = 0;
+	}
+	uart_common[pos].rxtail = 0;
+	dma_ringReset(&uart_common[pos].rxring);
+	uart_common[pos].rxcons = 0;
+#endif
+
 	uart_common[pos].txbeg = NULL;
 	uart_common[pos].txend = NULL;
 
@@ -206,6 +330,17 @@ int uart_configure(int uart, char bits, char parity, unsigned int baud, char ena
 		(void)*(uart_common[pos].base + rdr);
 
 		if (enable) {
+#if UART_DMA
+			if (uart_common[pos].rxdma != NULL) {
+				/* Idle line interrupt instead of RXNE, DMA doesn't work in STOP mode */
+				dma_start(uart_common[pos].rxdma, (void *)uart_common[pos].rxbuf, UART_DMA_RXBUFSZ, 1, dma_ht | dma_tc);
+				*(uart_common[pos].base + cr3) |= (1 << 7) | (1 << 6);
+				*(uart_common[pos].base + cr1) |= (1 << 4) | (1 << 3) | (1 << 2);
+				keepidle(1);
+				uart_common[pos].rxactive = 1;
+			}
+			else
+#endif
 			*(uart_common[pos].base + cr1) |= (1 << 5) | (1 << 3) | (1 << 2);
 			dataBarier();
 			*(uart_common[pos].base + cr1) |= 1;
@@ -223,8 +358,33 @@ int uart_configure(int uart, char bits, char parity, unsigned int baud, char ena
 }
 
 
+int uart_getOverrun(int uart, uartoverrun_t *ov)
+{
+	if (uart < usart1 || uart > lpuart1 || !uartConfig[uart])
+		return -EINVAL;
+
+	uart = uartPos[uart];
+
+	ov->rxoverrun = 0;
+	ov->hwoverrun = 0;
+
+#if UART_DMA
+	mutexLock(uart_common[uart].lock);
+	ov->rxoverrun = uart_common[uart].rxoverrun;
+	ov->hwoverrun = uart_common[uart].hwoverrun;
+	mutexUnlock(uart_common[uart].lock);
+#endif
+
+	return EOK;
+}
+
+
 int uart_write(int uart, void* buff, unsigned int bufflen)
 {
+#if UART_DMA
+	unsigned int done, chunk;
+#endif
+
 	if (uart < usart1 || uart > lpuart1 || !uartConfig[uart])
 		return -EINVAL;
 
@@ -241,6 +401,22 @@ int uart_write(int uart, void* buff, unsigned int bufflen)
 
 	keepidle(1);
 
+#if UART_DMA
+	if (uart_common[uart].txdma != NULL) {
+		for (done = 0; done < bufflen; done += chunk) {
+			chunk = min(bufflen - done, 0xffff);
+
+			uart_common[uart].txdone = 0;
+			dma_start(uart_common[uart].txdma, (unsigned char *)buff + done, chunk, 1, dma_tc | dma_te);
+
+			while (!uart_common[uart].txdone)
+				condWait(uart_common[uart].txcond, uart_common[uart].lock, 0);
+		}
+
+		dma_stop(uart_common[uart].txdma);
+	}
+	else {
+#endif
 	*(uart_common[uart].base + tdr) = *((unsigned char *)buff);
 	uart_common[uart].txbeg = (void *)((unsigned char *)buff + 1);
 	uart_common[uart].txend = (void *)((unsigned char *)buff + bufflen);
@@ -248,6 +424,9 @@ int uart_write(int uart, void* buff, unsigned int bufflen)
 
 	while (uart_common[uart].txbeg != uart_common[uart].txend)
 		condWait(uart_common[uart].txcond, uart_common[uart].lock, 0);
+#if UART_DMA
+	}
+#endif
 	mutexUnlock(uart_common[uart].lock);
 
 	keepidle(0);
@@ -277,6 +456,20 @@ int uart_read(int uart, void* buff, unsigned int count, char mode, unsigned int
 	mutexLock(uart_common[uart].rxlock);
 	mutexLock(uart_common[uart].lock);
 
+#if UART_DMA
+	if (uart_common[uart].rxdma != NULL) {
+		read = _uart_dmaRxCopy(uart, buff, count);
+
+		while (read < count && mode != uart_mnblock && uart_common[uart].enabled) {
+			err = condWait(uart_common[uart].rxcond, uart_common[uart].lock, timeout);
+			read += _uart_dmaRxCopy(uart, (char *)buff + read, count - read);
+
+			if (timeout && err == -ETIME)
+				break;
+		}
+	}
+	else {
+#endif
 	uart_common[uart].read = &read;
 	uart_common[uart].rxend = (char *)buff + count;
 
@@ -300,6 +493,9 @@ int uart_read(int uart, void* buff, unsigned int count, char mode, unsigned int
 			break;
 		}
 	}
+#if UART_DMA
+	}
+#endif
 
 	if (uart_common[uart].bits < 8) {
 		if (uart_common[uart].bits == 6)
@@ -356,6 +552,24 @@ int uart_init(void)
 		uart_common[i].rxdr = 0;
 		uart_common[i].rxdw = 0;
 
+#if UART_DMA
+		uart_common[i].rxdma = NULL;
+		uart_common[i].txdma = NULL;
+
+		if (uartDma[uart] && (uart_common[i].rxbuf = malloc(UART_DMA_RXBUFSZ)) != NULL) {
+			dma_configure(&uartDmaChannels[uart][0], dma_per2mem, dma_priorityHigh, info[uart].base + rdr, 1, 1,
+				uart_dmaRxirq, (void *)i, uart_common[i].rxcond, NULL);
+			dma_configure(&uartDmaChannels[uart][1], dma_mem2per, dma_priorityLow, info[uart].base + tdr, 1, 0,
+				uart_dmaTxirq, (void *)i, uart_common[i].txcond, NULL);
+
+			uart_common[i].rxdma = &uartDmaChannels[uart][0];
+			uart_common[i].txdma = &uartDmaChannels[uart][1];
+		}
+
+		uart_common[i].rxtail = 0;
+		uart_common[i].rxactive = 0;
+#endif
+
 		if (uart == lpuart1) {
 			/* Enable clock and wakeup from STOP mode */
 			*(uart_common[i].base + cr3) |= (1 << 23) | (1 << 22) | (0x3 << 20);
@@ -14,6 +14,8 @@
 #ifndef _UART_H_
 #define _UART_H_
 
+#include "stm32-multi.h"
+
 
 int uart_configure(int uart, char bits, char parity, unsigned int baud, char enable);
 
@@ -24,6 +26,9 @@ int uart_write(int uart, void* buff, unsigned int bufflen);
 int uart_read(int uart, void* buff, unsigned int count, char mode, unsigned int timeout);
 
 
+int uart_getOverrun(int uart, uartoverrun_t *ov);
+
+
 int uart_init(void);
 
 
@@ -0,0 +1,162 @@
+/*
+ * Phoenix-RTOS
+ *
+ * SPI FIFO word packing
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _SPI_PACK_H_
+#define _SPI_PACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/* FIFO register store, tests override it to record the written words */
+#ifndef SPI_FIFO_WRITE
+#define SPI_FIFO_WRITE(fifo, word) (*(fifo) = (word))
+#endif
+
+
+/*
+ * SPI controllers shift FIFO words out MSB first, so byte stream goes into
+ * words in big-endian order. Full words are loaded at once (memcpy compiles
+ * to a single, possibly unaligned, load) and byte-swapped with rev.
+ * Partial words hold 1 - 3 bytes right-aligned.
+ */
+
+
+static inline uint32_t spi_packWord(const uint8_t *buff)
+{
+	uint32_t word;
+
+	memcpy(&word, buff, sizeof(word));
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return __builtin_bswap32(word);
+#else
+	return word;
+#endif
+}
+
+
+static inline void spi_unpackWord(uint8_t *buff, uint32_t word)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	word = __builtin_bswap32(word);
+#endif
+
+	memcpy(buff, &word, sizeof(word));
+}
+
+
+static inline uint32_t spi_packTail(const uint8_t *buff, size_t len)
+{
+	uint32_t word = 0;
+
+	switch (len) {
+		case 3: word = (uint32_t)*buff++ << 16; /* fall-through */
+		case 2: word |= (uint32_t)*buff++ << 8; /* fall-through */
+		case 1: word |= *buff;
+	}
+
+	return word;
+}
+
+
+static inline void spi_unpackTail(uint8_t *buff, uint32_t word, size_t len)
+{
+	switch (len) {
+		case 3: *buff++ = word >> 16; /* fall-through */
+		case 2: *buff++ = word >> 8; /* fall-through */
+		case 1: *buff = word;
+	}
+}
+
+
+/* Packs len bytes into (len + 3) / 4 words, partial word goes last if tail != 0, first otherwise */
+static inline void spi_packWords(uint32_t *words, const uint8_t *buff, size_t len, int tail)
+{
+	size_t part = len % sizeof(uint32_t);
+
+	if (part != 0 && !tail) {
+		*words++ = spi_packTail(buff, part);
+		buff += part;
+	}
+
+	for (len -= part; len != 0; len -= sizeof(uint32_t)) {
+		*words++ = spi_packWord(buff);
+		buff += sizeof(uint32_t);
+	}
+
+	if (part != 0 && tail)
+		*words = spi_packTail(buff, part);
+}
+
+
+/* Reverse of spi_packWords() */
+static inline void spi_unpackWords(uint8_t *buff, const uint32_t *words, size_t len, int tail)
+{
+	size_t part = len % sizeof(uint32_t);
+
+	if (part != 0 && !tail) {
+		spi_unpackTail(buff, *words++, part);
+		buff += part;
+	}
+
+	for (len -= part; len != 0; len -= sizeof(uint32_t)) {
+		spi_unpackWord(buff, *words++);
+		buff += sizeof(uint32_t);
+	}
+
+	if (part != 0 && tail)
+		spi_unpackTail(buff, *words, part);
+}
+
+
+/* Writes len bytes to FIFO register, as spi_packWords() */
+static inline void spi_writeFifo(volatile uint32_t *fifo, const uint8_t *buff, size_t len, int tail)
+{
+	size_t part = len % sizeof(uint32_t);
+
+	if (part != 0 && !tail) {
+		SPI_FIFO_WRITE(fifo, spi_packTail(buff, part));
+		buff += part;
+	}
+
+	for (len -= part; len != 0; len -= sizeof(uint32_t)) {
+		SPI_FIFO_WRITE(fifo, spi_packWord(buff));
+		buff += sizeof(uint32_t);
+	}
+
+	if (part != 0 && tail)
+		SPI_FIFO_WRITE(fifo, spi_packTail(buff, part));
+}
+
+
+/* Reads len bytes from FIFO register, as spi_unpackWords() */
+static inline void spi_readFifo(volatile uint32_t *fifo, uint8_t *buff, size_t len, int tail)
+{
+	size_t part = len % sizeof(uint32_t);
+
+	if (part != 0 && !tail) {
+		spi_unpackTail(buff, *fifo, part);
+		buff += part;
+	}
+
+	for (len -= part; len != 0; len -= sizeof(uint32_t)) {
+		spi_unpackWord(buff, *fifo);
+		buff += sizeof(uint32_t);
+	}
+
+	if (part != 0 && tail)
+		spi_unpackTail(buff, *fifo, part);
+}
+
+#endif
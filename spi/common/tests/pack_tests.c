@@ -0,0 +1,291 @@
+/*
+ * Phoenix-RTOS
+ *
+ * SPI FIFO word packing tests and benchmark
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+/*
+ * Doesn't depend on hardware, can be run on the host as well:
+ * gcc -O2 -Ispi/common spi/common/tests/pack_tests.c -o pack-tests && ./pack-tests
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Records every word stored to the fake FIFO register */
+#define SPI_FIFO_WRITE(fifo, word) test_fifoWrite((fifo), (word))
+
+static void test_fifoWrite(volatile uint32_t *fifo, uint32_t word);
+
+#include "../spi-pack.h"
+
+#ifndef EOK
+#define EOK 0
+#endif
+
+
+#define TEST_CATEGORY(category)                                         \
+	do {                                                                \
+		printf("\n\n##        %d. %s :", ++categoryCounter, category);  \
+		testCounter = 1;                                                \
+	} while(0)
+
+
+#define TEST_CASE(test)                                                                    \
+	do {                                                                                   \
+		if ((test) == EOK) {                                                               \
+			printf("\nTEST CASE %d.%d : %-45s\t", categoryCounter, testCounter++, #test);  \
+			printf("\033[0;32m");                                                          \
+			printf("-- PASSED"); }                                                         \
+		else {                                                                             \
+			failed++;                                                                      \
+			printf("\033[1;31m");                                                          \
+			printf("\nTEST CASE %d.%d : %-45s\t", categoryCounter, testCounter++, #test);  \
+			printf("-- FAILED");                                                           \
+		}                                                                                  \
+		printf("\033[0m");                                                                 \
+	} while (0)
+
+
+#define MAX_LEN    (64 * 4 + 3)
+#define BENCH_LEN  256
+#define BENCH_REPS 20000
+
+
+static int testCounter = 1;
+
+static int categoryCounter = 0;
+
+static int failed = 0;
+
+
+struct {
+	uint8_t src[MAX_LEN + 4];
+	uint8_t dst[MAX_LEN + 4];
+	uint32_t words[MAX_LEN / 4 + 1];
+	uint32_t ref[MAX_LEN / 4 + 1];
+	volatile uint32_t fifo;
+	uint32_t written[MAX_LEN / 4 + 2];
+	size_t nwritten;
+} test_common;
+
+
+static void test_fifoWrite(volatile uint32_t *fifo, uint32_t word)
+{
+	if (test_common.nwritten < sizeof(test_common.written) / sizeof(test_common.written[0]))
+		test_common.written[test_common.nwritten] = word;
+	test_common.nwritten++;
+
+	*fifo = word;
+}
+
+
+/* Byte by byte packing the drivers used before */
+static size_t ref_packWords(uint32_t *words, const uint8_t *buff, size_t len, int tail)
+{
+	size_t n = 0, part = len % 4;
+	uint32_t word;
+
+	if (part != 0 && !tail) {
+		for (word = 0; part > 0; part--, len--)
+			word = (word << 8) | *buff++;
+		words[n++] = word;
+	}
+
+	while (len >= 4) {
+		words[n++] = buff[3] | ((uint32_t)buff[2] << 8) | ((uint32_t)buff[1] << 16) | ((uint32_t)buff[0] << 24);
+		buff += 4;
+		len -= 4;
+	}
+
+	if (len != 0) {
+		for (word = 0; len > 0; len--)
+			word = (word << 8) | *buff++;
+		words[n++] = word;
+	}
+
+	return n;
+}
+
+
+static void ref_unpackWords(uint8_t *buff, const uint32_t *words, size_t len, int tail)
+{
+	size_t part = len % 4;
+	int i;
+
+	if (part != 0 && !tail) {
+		for (i = part; i >= 1; i--)
+			*buff++ = (*words >> ((i - 1) * 8)) & 0xff;
+		words++;
+		len -= part;
+	}
+
+	while (len >= 4) {
+		*buff++ = (*words >> 24) & 0xff;
+		*buff++ = (*words >> 16) & 0xff;
+		*buff++ = (*words >> 8) & 0xff;
+		*buff++ = *words & 0xff;
+		words++;
+		len -= 4;
+	}
+
+	for (i = len; i >= 1; i--)
+		*buff++ = (*words >> ((i - 1) * 8)) & 0xff;
+}
+
+
+static void test_fill(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(test_common.src); i++)
+		test_common.src[i] = (i * 7 + 3) & 0xff;
+}
+
+
+static int test_pack_word(void)
+{
+	const uint8_t b[4] = { 0x12, 0x34, 0x56, 0x78 };
+	uint8_t out[4];
+
+	if (spi_packWord(b) != 0x12345678)
+		return -1;
+
+	if (spi_packTail(b, 1) != 0x12 || spi_packTail(b, 2) != 0x1234 || spi_packTail(b, 3) != 0x123456)
+		return -1;
+
+	spi_unpackWord(out, 0x9abcdef0);
+	if (out[0] != 0x9a || out[1] != 0xbc || out[2] != 0xde || out[3] != 0xf0)
+		return -1;
+
+	memset(out, 0, sizeof(out));
+	spi_unpackTail(out, 0xffabcdef, 3);
+	if (out[0] != 0xab || out[1] != 0xcd || out[2] != 0xef || out[3] != 0)
+		return -1;
+
+	return EOK;
+}
+
+
+/* Every length and source alignment, partial word first (ECSPI) or last (LPSPI) */
+static int test_pack_words(int tail)
+{
+	size_t len, off, n;
+
+	for (off = 0; off < 4; off++) {
+		for (len = 0; len <= MAX_LEN; len++) {
+			n = ref_packWords(test_common.ref, test_common.src + off, len, tail);
+			memset(test_common.words, 0xa5, sizeof(test_common.words));
+			spi_packWords(test_common.words, test_common.src + off, len, tail);
+
+			if (memcmp(test_common.words, test_common.ref, n * 4) != 0)
+				return -1;
+
+			/* Nothing beyond the last word is written */
+			if (n < sizeof(test_common.words) / 4 && test_common.words[n] != 0xa5a5a5a5)
+				return -1;
+		}
+	}
+
+	return EOK;
+}
+
+
+static int test_unpack_words(int tail)
+{
+	size_t len, off;
+
+	for (off = 0; off < 4; off++) {
+		for (len = 0; len <= MAX_LEN; len++) {
+			ref_packWords(test_common.words, test_common.src, len, tail);
+
+			memset(test_common.dst, 0xa5, sizeof(test_common.dst));
+			spi_unpackWords(test_common.dst + off, test_common.words, len, tail);
+
+			if (memcmp(test_common.dst + off, test_common.src, len) != 0 || test_common.dst[off + len] != 0xa5)
+				return -1;
+
+			/* Round trip through reference */
+			memset(test_common.dst, 0, sizeof(test_common.dst));
+			ref_unpackWords(test_common.dst, test_common.words, len, tail);
+			if (memcmp(test_common.dst, test_common.src, len) != 0)
+				return -1;
+		}
+	}
+
+	return EOK;
+}
+
+
+/* Every word stored to the register, in order */
+static int test_fifo(int tail)
+{
+	size_t len, n;
+
+	for (len = 1; len <= MAX_LEN; len++) {
+		n = ref_packWords(test_common.ref, test_common.src, len, tail);
+
+		test_common.nwritten = 0;
+		spi_writeFifo(&test_common.fifo, test_common.src, len, tail);
+
+		if (test_common.nwritten != n || memcmp(test_common.written, test_common.ref, n * 4) != 0)
+			return -1;
+	}
+
+	return EOK;
+}
+
+
+static double bench(int fast, int tail)
+{
+	clock_t start;
+	int i;
+
+	start = clock();
+	for (i = 0; i < BENCH_REPS; i++) {
+		if (fast) {
+			spi_packWords(test_common.words, test_common.src + (i & 1), BENCH_LEN, tail);
+			spi_unpackWords(test_common.dst, test_common.words, BENCH_LEN, tail);
+		}
+		else {
+			ref_packWords(test_common.words, test_common.src + (i & 1), BENCH_LEN, tail);
+			ref_unpackWords(test_common.dst, test_common.words, BENCH_LEN, tail);
+		}
+		__asm__ volatile ("" : : "r" (test_common.dst) : "memory");
+	}
+
+	return (double)(clock() - start) * 1000000000.0 / CLOCKS_PER_SEC / BENCH_REPS / (2 * BENCH_LEN);
+}
+
+
+int main(int argc, char **argv)
+{
+	test_fill();
+
+	TEST_CATEGORY("SPI PACKING TESTS");
+
+	TEST_CASE(test_pack_word());
+	TEST_CASE(test_pack_words(0));
+	TEST_CASE(test_pack_words(1));
+	TEST_CASE(test_unpack_words(0));
+	TEST_CASE(test_unpack_words(1));
+	TEST_CASE(test_fifo(0));
+	TEST_CASE(test_fifo(1));
+
+	TEST_CATEGORY("SPI PACKING BENCHMARK");
+
+	printf("\nbyte by byte : %.3f ns/B", bench(0, 1));
+	printf("\nword packing : %.3f ns/B", bench(1, 1));
+
+	printf("\n\n");
+
+	return failed ? 1 : 0;
+}
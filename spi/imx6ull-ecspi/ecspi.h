@@ -20,10 +20,35 @@
 
 enum { ecspi1 = 1, ecspi2, ecspi3, ecspi4 };
 
+/* Longest single SDMA run, longer transfers are split, see ecspi_initDma() */
+#define ECSPI_DMA_MAXLEN (16 * 1024)
+
+/* Number of transactions which can be submitted at once, see ecspi_initQueue() */
+#define ECSPI_QUEUE_LEN 16
+
 
 typedef int ecspi_writerProc_t(const uint8_t *rx, size_t len, uint8_t *out);
 
 
+struct _ecspi_xfer_t;
+
+typedef void ecspi_xferDone_t(struct _ecspi_xfer_t *xfer);
+
+
+/* Queued transaction, see ecspi_submit() */
+typedef struct _ecspi_xfer_t {
+	uint8_t chan;
+	const uint8_t *out;
+	uint8_t *in;
+	size_t len;
+
+	ecspi_xferDone_t *done;
+	void *arg;
+
+	volatile int status;
+} ecspi_xfer_t;
+
+
 typedef struct {
 	int dev_no;
 	handle_t inth;
@@ -37,8 +62,44 @@ typedef struct {
 } ecspi_ctx_t;
 
 
+/* Buffer of a periodic capture ring, see ecspi_captureStart() */
+typedef struct {
+	uint8_t *data;
+
+	unsigned int seq;
+	unsigned int overrun;
+	time_t timestamp;
+} ecspi_capbuf_t;
+
+
+typedef struct {
+	int dev_no;
+	handle_t inth;
+	handle_t irqcond;
+	handle_t cond;
+	handle_t lock;
+
+	ecspi_capbuf_t *bufs;
+	unsigned int n;
+	unsigned int frames;
+	const uint8_t *out;
+	size_t len;
+	unsigned int prev_wait_states;
+
+	volatile unsigned int wr;
+	volatile unsigned int rd;
+	volatile unsigned int frame;
+	volatile unsigned int dropped;
+	volatile unsigned int stamped;
+	volatile int stop;
+	volatile int running;
+	unsigned int waiting;
+} ecspi_capture_t;
+
+
 int ecspi_init(int dev_no, uint8_t chan_msk);
 int ecspi_registerContext(int dev_no, ecspi_ctx_t *ctx, handle_t cond);
+int ecspi_initDma(int dev_no, const char *tx_dev, const char *rx_dev);
 
 int ecspi_exchange(int dev_no, const uint8_t *out, uint8_t *in, size_t len);
 int ecspi_exchangeBusy(int dev_no, const uint8_t *out, uint8_t *in, size_t len);
@@ -54,6 +115,15 @@ int ecspi_exchangeAsync(ecspi_ctx_t *ctx, const uint8_t *out, size_t len);
 int ecspi_exchangePeriodically(ecspi_ctx_t *ctx, uint8_t *out, uint8_t *in, size_t len, unsigned int wait_states, ecspi_writerProc_t writer_proc);
 int ecspi_readFifo(ecspi_ctx_t *ctx, uint8_t *buf, size_t len);
 
+int ecspi_initQueue(int dev_no);
+int ecspi_submit(int dev_no, ecspi_xfer_t *xfer);
+int ecspi_wait(int dev_no, ecspi_xfer_t *xfer);
+
+int ecspi_captureStart(int dev_no, ecspi_capture_t *cap, ecspi_capbuf_t *bufs, unsigned int n, unsigned int frames, const uint8_t *out, size_t len, unsigned int wait_states);
+ecspi_capbuf_t *ecspi_captureWait(ecspi_capture_t *cap);
+void ecspi_captureRelease(ecspi_capture_t *cap);
+int ecspi_captureStop(ecspi_capture_t *cap);
+
 addr_t ecspi_getTxFifoPAddr(int dev_no);
 addr_t ecspi_getRxFifoPAddr(int dev_no);
 
@@ -9,15 +9,22 @@
  * %LICENSE%
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/interrupt.h>
 #include <sys/mman.h>
 #include <sys/platform.h>
 #include <sys/threads.h>
+#include <sys/time.h>
 
 #include <phoenix/arch/imx6ull.h>
 
+#include <sdma.h>
+#include <spi-pack.h>
+
 #include "ecspi.h"
 
 
@@ -25,10 +32,46 @@
 #define BITS_2_BYTES_ROUND_UP(LEN) (((LEN) + 7) / 8)
 #define GET_BURST_IN_BYTES(ECSPI) (BITS_2_BYTES_ROUND_UP((*((ECSPI)->base + conreg) >> 20) + 1))
 
+/* Transfers which do not fit into FIFO are handed over to SDMA */
+#define ECSPI_DMA_THRESHOLD (64 * 4)
+#define ECSPI_DMA_PRIORITY  (SDMA_CHANNEL_PRIORITY_MAX - 1)
+#define ECSPI_DMA_TIMEOUT   1000000 /* us */
+
 
 enum { rxdata = 0, txdata, conreg, configreg, intreg, dmareg, statreg, periodreg, testreg, msgdata = 16 };
 
-typedef enum { mode_sync_exchange, mode_async_write, mode_async_exchange, mode_async_periodical } ecspi_mode_t;
+/* GPT2 counts microseconds for capture timestamps, shared with imx6ull-gpio which sets it up the same way */
+enum { gpt_cr = 0, gpt_pr, gpt_sr, gpt_ir, gpt_ocr1, gpt_ocr2, gpt_ocr3, gpt_icr1, gpt_icr2, gpt_cnt };
+
+typedef enum { mode_sync_exchange, mode_async_write, mode_async_exchange, mode_async_periodical, mode_queue, mode_capture } ecspi_mode_t;
+
+typedef struct {
+	sdma_t tx;
+	sdma_t rx;
+
+	sdma_buffer_desc_t *txbd;
+	sdma_buffer_desc_t *rxbd;
+	uint8_t *txbuf;
+	uint8_t *rxbuf;
+	addr_t txbuf_paddr;
+	addr_t rxbuf_paddr;
+
+	unsigned int wml;
+} ecspi_dma_t;
+
+typedef struct {
+	ecspi_xfer_t *ring[ECSPI_QUEUE_LEN];
+	volatile unsigned int rd;
+	volatile unsigned int wr;
+	volatile int busy;
+
+	volatile unsigned int done;
+	unsigned int seen;
+
+	handle_t inth;
+	handle_t cond;
+	handle_t lock;
+} ecspi_queue_t;
 
 typedef struct {
 	volatile uint32_t *base;
@@ -38,6 +81,9 @@ typedef struct {
 	handle_t inth;
 	handle_t cond;
 	handle_t irqlock;
+
+	ecspi_dma_t *dma;
+	ecspi_queue_t *queue;
 } ecspi_t;
 
 typedef struct {
@@ -48,6 +94,8 @@ typedef struct {
 
 static const addr_t ecspi_addr[4] = { 0x2008000, 0x200C000, 0x2010000, 0x2014000 };
 static const unsigned int ecspi_intr_number[4] = { 63, 64, 65, 66 };
+static const unsigned int ecspi_dma_rx_event[4] = { 3, 5, 7, 9 };
+static const unsigned int ecspi_dma_tx_event[4] = { 4, 6, 8, 10 };
 
 ecspi_pctl_t ecspi_pctl_mux[4][7] = {
 	{ { pctl_mux_csi_d7,      3 }, { pctl_mux_csi_d6,     3 }, { pctl_mux_csi_d4,    3 }, { pctl_mux_csi_d5,     3 },
@@ -69,7 +117,10 @@ ecspi_pctl_t ecspi_pctl_isel[4][4] = {
 
 uint32_t ecspi_pctl_clk[4] = { pctl_clk_ecspi1, pctl_clk_ecspi2, pctl_clk_ecspi3, pctl_clk_ecspi4 };
 
+static const addr_t ecspi_gpt_addr = 0x020e8000;
+
 static ecspi_t ecspi[4] = {0};
+static volatile uint32_t *ecspi_gpt;
 
 
 #define RESET_ECSPI(ECSPI) do { \
@@ -119,7 +170,7 @@ static int ecspi_irqHandlerAsync(unsigned int n, void *arg)
 	ecspi_ctx_t *ctx = arg;
 	ecspi_t *e = &ecspi[ctx->dev_no - 1];
 
-	if (e->mode == mode_sync_exchange) {
+	if (e->mode == mode_sync_exchange || e->mode == mode_queue || e->mode == mode_capture) {
 		return -1;
 	}
 
@@ -230,59 +281,14 @@ static void set_clk(int dev_no)
 
 static void writeFifo(int dev_no, const uint8_t *out, size_t len)
 {
-	uint32_t word;
-	ecspi_t *e = &ecspi[dev_no - 1];
-	size_t fill_len = len % 4;
-
-	if (fill_len > 0) {
-		word = 0;
-
-		while (fill_len > 0) {
-			word = (word << 8) | *out++;
-			fill_len--;
-			len--;
-		}
-
-		*(e->base + txdata) = word;
-	}
-
-	while (len > 0) {
-		word = out[3] | ((uint32_t) out[2] << 8) | ((uint32_t) out[1] << 16) | ((uint32_t) out[0] << 24);
-
-		*(e->base + txdata) = word;
-
-		len -= 4;
-		out += 4;
-	}
+	/* Partial word goes first */
+	spi_writeFifo(ecspi[dev_no - 1].base + txdata, out, len, 0);
 }
 
 
 static void readFifo(int dev_no, uint8_t *in, size_t len)
 {
-	uint32_t word;
-	ecspi_t *e = &ecspi[dev_no - 1];
-	size_t len_fill = len % 4;
-
-	if (len_fill > 0) {
-		word = *(e->base + rxdata);
-
-		for (int i = len_fill; i >= 1; i--) {
-			*in++ = (word >> ((i - 1) * 8)) & 0xFF;
-		}
-
-		len -= len_fill;
-	}
-
-	while (len > 0) {
-		word = *(e->base + rxdata);
-
-		*in++ = (word >> 24) & 0xFF;
-		*in++ = (word >> 16) & 0xFF;
-		*in++ = (word >> 8) & 0xFF;
-		*in++ = (word) & 0xFF;
-
-		len -= 4;
-	}
+	spi_readFifo(ecspi[dev_no - 1].base + rxdata, in, len, 0);
 }
 
 
@@ -389,6 +395,165 @@ int ecspi_setSSDelay(int dev_no, uint16_t delay)
 }
 
 
+static unsigned int ecspi_dmaWatermark(size_t len)
+{
+	unsigned int wml = 32;
+
+	/* Largest FIFO watermark dividing the transfer, so no words are left below the RX threshold */
+	while (((len / 4) % wml) != 0) {
+		wml >>= 1;
+	}
+
+	return wml;
+}
+
+
+static int ecspi_dmaContext(sdma_t *s, sdma_script_t script, unsigned int event, addr_t fifo, unsigned int wml)
+{
+	sdma_context_t ctx;
+
+	sdma_context_init(&ctx);
+	sdma_context_set_pc(&ctx, script);
+
+	/* Event mask (events 0-31), peripheral FIFO address and watermark in bytes */
+	ctx.gr[1] = 1 << event;
+	ctx.gr[6] = fifo;
+	ctx.gr[7] = wml * 4;
+
+	return sdma_context_set(s, &ctx);
+}
+
+
+static void ecspi_dmaPrepareBd(sdma_buffer_desc_t *bd, addr_t paddr, size_t len, uint8_t flags)
+{
+	bd->buffer_addr = paddr;
+	bd->ext_buffer_addr = 0;
+	bd->count = len;
+	bd->command = SDMA_CMD_MODE_32_BIT;
+	/* Setting DONE hands the descriptor over to SDMA, so it goes last */
+	bd->flags = flags | SDMA_BD_DONE | SDMA_BD_WRAP | SDMA_BD_LAST;
+}
+
+
+/* Waits until SDMA gives the RX descriptor back, interrupts left by a timed out exchange are skipped */
+static int ecspi_dmaWaitRx(ecspi_dma_t *dma)
+{
+	time_t now, end;
+	int res = 0;
+
+	gettime(&now, NULL);
+	end = now + ECSPI_DMA_TIMEOUT;
+
+	while (dma->rxbd->flags & SDMA_BD_DONE) {
+		if (now >= end) {
+			return -ETIME;
+		}
+
+		if ((res = sdma_wait_for_intr_timeout(&dma->rx, NULL, end - now)) < 0) {
+			return res;
+		}
+
+		gettime(&now, NULL);
+	}
+
+	return 0;
+}
+
+
+static int ecspi_exchangeDmaChunk(int dev_no, const uint8_t *out, uint8_t *in, size_t len)
+{
+	ecspi_t *e = &ecspi[dev_no - 1];
+	ecspi_dma_t *dma = e->dma;
+	uint32_t conreg_backup;
+	unsigned int wml;
+	int res;
+
+	/* Wait until the previous transaction has ended. */
+	while ((*(e->base + conreg) & (1 << 2)) || (*(e->base + testreg) & 0x7F) != 0) {
+		;
+	}
+
+	wml = ecspi_dmaWatermark(len);
+	if (wml != dma->wml) {
+		dma->wml = 0;
+		if (ecspi_dmaContext(&dma->tx, sdma_script__mcu_2_shp, ecspi_dma_tx_event[dev_no - 1], ecspi_getTxFifoPAddr(dev_no), wml) < 0 ||
+				ecspi_dmaContext(&dma->rx, sdma_script__shp_2_mcu, ecspi_dma_rx_event[dev_no - 1], ecspi_getRxFifoPAddr(dev_no), wml) < 0) {
+			return -3;
+		}
+		dma->wml = wml;
+	}
+
+	spi_packWords((uint32_t *) dma->txbuf, out, len, 0);
+
+	ecspi_dmaPrepareBd(dma->txbd, dma->txbuf_paddr, len, 0);
+	ecspi_dmaPrepareBd(dma->rxbd, dma->rxbuf_paddr, len, SDMA_BD_INTR);
+
+	e->mode = mode_sync_exchange;
+
+	/* Single burst mode */
+	*(e->base + configreg) &= ~(0xF << 8);
+
+	/* 32-bit bursts started as soon as SDMA puts data into TXFIFO */
+	conreg_backup = *(e->base + conreg);
+	*(e->base + conreg) = (conreg_backup & ~(0xFFF << 20)) | (31 << 20) | (1 << 3);
+
+	/* TX request while TXFIFO holds at most wml words, RX request while RXFIFO holds more than wml - 1 words */
+	*(e->base + dmareg) = wml | (1 << 7) | ((wml - 1) << 16) | (1 << 23);
+
+	/* Interrupts counted so far belong to earlier exchanges */
+	if (dma->rx.status != NULL) {
+		dma->rx.intr_seen = sdma_intr_cnt(&dma->rx);
+	}
+
+	/* Only the RX channel interrupts - it finishes last */
+	if (sdma_enable(&dma->rx) < 0 || sdma_enable(&dma->tx) < 0) {
+		*(e->base + dmareg) = 0;
+		*(e->base + conreg) = conreg_backup;
+		return -3;
+	}
+
+	res = ecspi_dmaWaitRx(dma);
+
+	*(e->base + dmareg) = 0;
+	*(e->base + conreg) = conreg_backup;
+
+	if (res < 0) {
+		/* Take the descriptors back, flush the FIFOs and restart scripts with fresh contexts next time */
+		dma->txbd->flags &= ~SDMA_BD_DONE;
+		dma->rxbd->flags &= ~SDMA_BD_DONE;
+		RESET_ECSPI(e);
+		dma->wml = 0;
+		return -3;
+	}
+
+	spi_unpackWords(in, (uint32_t *) dma->rxbuf, len, 0);
+
+	return 0;
+}
+
+
+/* Transfers longer than the DMA buffers are done in successive runs */
+static int ecspi_exchangeDma(int dev_no, const uint8_t *out, uint8_t *in, size_t len)
+{
+	size_t done, chunk;
+	int res;
+
+	if ((len % 4) != 0) {
+		return -2;
+	}
+
+	for (done = 0; done < len; done += chunk) {
+		chunk = (len - done > ECSPI_DMA_MAXLEN) ? ECSPI_DMA_MAXLEN : len - done;
+
+		if ((res = ecspi_exchangeDmaChunk(dev_no, out + done, in + done, chunk)) < 0) {
+			return res;
+		}
+	}
+
+	return 0;
+}
+
+
 int ecspi_exchange(int dev_no, const uint8_t *out, uint8_t *in, size_t len)
 {
 	ecspi_t *e;
@@ -397,11 +562,15 @@ int ecspi_exchange(int dev_no, const uint8_t *out, uint8_t *in, size_t len)
 		return -1;
 	}
 
+	e = &ecspi[dev_no - 1];
+	if (len > ECSPI_DMA_THRESHOLD && e->dma != NULL) {
+		return ecspi_exchangeDma(dev_no, out, in, len);
+	}
+
 	if (len > (64 * 4) || len == 0) {
 		return -2;
 	}
 
-	e = &ecspi[dev_no - 1];
 	// Wait until the previous transaction has ended.
 	while ((*(e->base + conreg) & (1 << 2)) || (*(e->base + testreg) & 0x7F) != 0) {
 		;
@@ -634,6 +803,492 @@ int ecspi_writeAsync(ecspi_ctx_t *ctx, const uint8_t *out, size_t len)
 }
 
 
+static void ecspi_queueStart(int dev_no, ecspi_xfer_t *xfer)
+{
+	ecspi_t *e = &ecspi[dev_no - 1];
+
+	/* Channel and burst length of the transaction */
+	*(e->base + conreg) = (*(e->base + conreg) & ~((0xFFF << 20) | (0x03 << 18))) | ((xfer->len * 8 - 1) << 20) | (xfer->chan << 18);
+
+	writeFifo(dev_no, xfer->out, xfer->len);
+
+	/* Clear Transfer Completed bit. */
+	*(e->base + statreg) |= (1 << 7);
+	/* Enable Transfer Completed interrupt. */
+	*(e->base + intreg) |= (1 << 7);
+	/* Begin transmission. */
+	*(e->base + conreg) |= (1 << 2);
+}
+
+
+static int ecspi_irqHandlerQueue(unsigned int n, void *arg)
+{
+	(void) n;
+
+	int dev_no = (int) arg;
+	ecspi_t *e = &ecspi[dev_no - 1];
+	ecspi_queue_t *q = e->queue;
+	ecspi_xfer_t *xfer;
+	size_t i;
+
+	if (e->mode != mode_queue || !(*(e->base + intreg) & (1 << 7)) || !(*(e->base + statreg) & (1 << 7))) {
+		return -1;
+	}
+
+	/* Disable Transfer Completed interrupt. */
+	*(e->base + intreg) &= ~(1 << 7);
+	/* Clear Transfer Completed bit. */
+	*(e->base + statreg) |= (1 << 7);
+
+	xfer = q->ring[q->rd % ECSPI_QUEUE_LEN];
+
+	if (xfer->in != NULL) {
+		readFifo(dev_no, xfer->in, xfer->len);
+	}
+	else {
+		for (i = 0; i < xfer->len; i += 4) {
+			(void) *(e->base + rxdata);
+		}
+	}
+
+	q->rd++;
+	q->busy = 0;
+
+	/* Chain the next transaction before notifying anybody, unless submitter got ahead */
+	if (q->rd != q->wr && __sync_bool_compare_and_swap(&q->busy, 0, 1)) {
+		ecspi_queueStart(dev_no, q->ring[q->rd % ECSPI_QUEUE_LEN]);
+	}
+
+	xfer->status = 0;
+	q->done++;
+
+	if (xfer->done != NULL) {
+		xfer->done(xfer);
+	}
+
+	return 1;
+}
+
+
+int ecspi_initQueue(int dev_no)
+{
+	ecspi_t *e;
+	ecspi_queue_t *q;
+
+	if (dev_no < 1 || dev_no > 4) {
+		return -1;
+	}
+
+	e = &ecspi[dev_no - 1];
+	if (e->base == NULL) {
+		return -1;
+	}
+
+	if (e->queue != NULL) {
+		return 0;
+	}
+
+	if ((q = calloc(1, sizeof(ecspi_queue_t))) == NULL) {
+		return -2;
+	}
+
+	if (mutexCreate(&q->lock) < 0) {
+		free(q);
+		return -2;
+	}
+
+	if (condCreate(&q->cond) < 0) {
+		resourceDestroy(q->lock);
+		free(q);
+		return -2;
+	}
+
+	/* Wait until the previous transaction has ended. */
+	while ((*(e->base + conreg) & (1 << 2)) || (*(e->base + testreg) & 0x7F) != 0) {
+		;
+	}
+
+	/* Single burst mode, SS is asserted for the whole transaction */
+	*(e->base + configreg) &= ~(0xF << 8);
+
+	e->queue = q;
+	e->mode = mode_queue;
+
+	return interrupt(ecspi_intr_number[dev_no - 1], ecspi_irqHandlerQueue, (void *) dev_no, q->cond, &q->inth);
+}
+
+
+int ecspi_submit(int dev_no, ecspi_xfer_t *xfer)
+{
+	ecspi_t *e;
+	ecspi_queue_t *q;
+
+	if (dev_no < 1 || dev_no > 4) {
+		return -1;
+	}
+
+	e = &ecspi[dev_no - 1];
+	if ((q = e->queue) == NULL) {
+		return -1;
+	}
+
+	if (xfer->len > (64 * 4) || xfer->len == 0 || xfer->out == NULL) {
+		return -2;
+	}
+
+	if (xfer->chan > 3 || !(e->chan_msk & (1 << xfer->chan))) {
+		return -3;
+	}
+
+	mutexLock(q->lock);
+
+	if (q->wr - q->rd >= ECSPI_QUEUE_LEN) {
+		mutexUnlock(q->lock);
+		return -4;
+	}
+
+	xfer->status = 1;
+	q->ring[q->wr % ECSPI_QUEUE_LEN] = xfer;
+	__sync_synchronize();
+	q->wr++;
+
+	/* Bus is idle - start the transaction here, otherwise the interrupt handler chains it */
+	if (__sync_bool_compare_and_swap(&q->busy, 0, 1)) {
+		if (q->rd != q->wr) {
+			ecspi_queueStart(dev_no, q->ring[q->rd % ECSPI_QUEUE_LEN]);
+		}
+		else {
+			q->busy = 0;
+		}
+	}
+
+	mutexUnlock(q->lock);
+
+	return 0;
+}
+
+
+int ecspi_wait(int dev_no, ecspi_xfer_t *xfer)
+{
+	ecspi_queue_t *q;
+
+	if (dev_no < 1 || dev_no > 4 || (q = ecspi[dev_no - 1].queue) == NULL) {
+		return -1;
+	}
+
+	mutexLock(q->lock);
+	while (xfer->status != 0) {
+		condWait(q->cond, q->lock, 0);
+
+		/* Interrupt wakes up a single waiter - pass each completion on to the others */
+		if (q->seen != q->done) {
+			q->seen = q->done;
+			condBroadcast(q->cond);
+		}
+	}
+	mutexUnlock(q->lock);
+
+	return 0;
+}
+
+
+static int ecspi_irqHandlerCapture(unsigned int n, void *arg)
+{
+	(void) n;
+
+	ecspi_capture_t *cap = arg;
+	ecspi_t *e = &ecspi[cap->dev_no - 1];
+	ecspi_capbuf_t *buf;
+	uint32_t ticks;
+	size_t i;
+
+	if (e->mode != mode_capture || !(*(e->base + statreg) & (1 << 7))) {
+		return -1;
+	}
+
+	ticks = *(ecspi_gpt + gpt_cnt);
+
+	/* Clear Transfer Completed bit. */
+	*(e->base + statreg) |= (1 << 7);
+
+	if (cap->stop) {
+		/* Disable Transfer Completed interrupt. */
+		*(e->base + intreg) &= ~(1 << 7);
+		ecspi_setSSDelay(cap->dev_no, cap->prev_wait_states);
+		/* The only way to reset the internal period counter is to reenable the ECSPI. */
+		RESET_ECSPI(e);
+		e->mode = mode_sync_exchange;
+		return 1;
+	}
+
+	/* Frames are dropped, not overwritten, while the consumer holds all buffers */
+	if (cap->frame == 0 && cap->wr - cap->rd >= cap->n) {
+		for (i = 0; i < cap->len; i += 4) {
+			(void) *(e->base + rxdata);
+		}
+		cap->dropped++;
+		buf = NULL;
+	}
+	else {
+		buf = &cap->bufs[cap->wr % cap->n];
+		readFifo(cap->dev_no, buf->data + cap->frame * cap->len, cap->len);
+	}
+
+	/* Start the next period right away */
+	writeFifo(cap->dev_no, cap->out, cap->len);
+	*(e->base + conreg) |= (1 << 2);
+
+	if (buf == NULL) {
+		return -1;
+	}
+
+	if (cap->frame == 0) {
+		buf->overrun = cap->dropped;
+		cap->dropped = 0;
+	}
+
+	if (++cap->frame < cap->frames) {
+		return -1;
+	}
+
+	/* Holds GPT ticks until stamped by the consumer */
+	buf->timestamp = ticks;
+	buf->seq = cap->wr;
+	cap->frame = 0;
+	cap->wr++;
+
+	return 1;
+}
+
+
+/* Must be called with cap->lock held, converts GPT ticks latched by interrupt handler to time */
+static void ecspi_captureStamp(ecspi_capture_t *cap)
+{
+	ecspi_capbuf_t *buf;
+	time_t now;
+	uint32_t ticks;
+
+	if (cap->stamped == cap->wr) {
+		return;
+	}
+
+	gettime(&now, NULL);
+	ticks = *(ecspi_gpt + gpt_cnt);
+
+	while (cap->stamped != cap->wr) {
+		buf = &cap->bufs[cap->stamped++ % cap->n];
+		buf->timestamp = now - (uint32_t)(ticks - (uint32_t)buf->timestamp);
+	}
+}
+
+
+/*
+ * Must be called with cap->lock held. The interrupt wakes only one of the threads
+ * waiting in ecspi_captureWait() and ecspi_captureStop(), the one seeing the end passes it on.
+ */
+static void ecspi_captureCheckEnd(ecspi_capture_t *cap)
+{
+	if (cap->running && cap->stop && ecspi[cap->dev_no - 1].mode != mode_capture) {
+		cap->running = 0;
+		condBroadcast(cap->irqcond);
+	}
+}
+
+
+static int ecspi_gptInit(void)
+{
+	platformctl_t ctl;
+	static const int clocks[] = { pctl_clk_gpt2_bus, pctl_clk_gpt2_serial };
+	int i;
+
+	if (ecspi_gpt != NULL) {
+		return 0;
+	}
+
+	if ((ecspi_gpt = mmap(NULL, _PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_DEVICE, OID_PHYSMEM, ecspi_gpt_addr)) == MAP_FAILED) {
+		ecspi_gpt = NULL;
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(clocks) / sizeof(clocks[0]); ++i) {
+		ctl.action = pctl_set;
+		ctl.type = pctl_devclock;
+		ctl.devclock.dev = clocks[i];
+		ctl.devclock.state = 0x03;
+
+		if (platformctl(&ctl) < 0) {
+			return -1;
+		}
+	}
+
+	/* Already counting, set up by another user */
+	if (*(ecspi_gpt + gpt_cr) & 1) {
+		return 0;
+	}
+
+	*(ecspi_gpt + gpt_ir) = 0;
+
+	/* Software reset */
+	*(ecspi_gpt + gpt_cr) = 1 << 15;
+	while (*(ecspi_gpt + gpt_cr) & (1 << 15)) {
+		;
+	}
+
+	/* 24 MHz oscillator / 12 / 2 = 1 MHz */
+	*(ecspi_gpt + gpt_pr) = (11 << 12) | 1;
+
+	/* Free running, 24M clock source, counter reset on enable, running in wait mode */
+	*(ecspi_gpt + gpt_cr) = (1 << 10) | (1 << 9) | (5 << 6) | (1 << 3) | (1 << 1);
+	*(ecspi_gpt + gpt_cr) |= 1;
+
+	return 0;
+}
+
+
+int ecspi_captureStart(int dev_no, ecspi_capture_t *cap, ecspi_capbuf_t *bufs, unsigned int n, unsigned int frames, const uint8_t *out, size_t len, unsigned int wait_states)
+{
+	ecspi_t *e;
+
+	if (dev_no < 1 || dev_no > 4) {
+		return -1;
+	}
+
+	if (len > (64 * 4) || len == 0 || n == 0 || frames == 0) {
+		return -2;
+	}
+
+	e = &ecspi[dev_no - 1];
+
+	/* Wait until the previous transaction has ended. */
+	while ((*(e->base + conreg) & (1 << 2)) || (*(e->base + testreg) & 0x7F) != 0 || (*(e->base + intreg) & (1 << 7))) {
+		;
+	}
+
+	*cap = (ecspi_capture_t) {
+		.dev_no = dev_no,
+		.bufs = bufs,
+		.n = n,
+		.frames = frames,
+		.out = out,
+		.len = len,
+		.running = 1,
+	};
+
+	if (ecspi_gptInit() < 0) {
+		return -3;
+	}
+
+	if (mutexCreate(&cap->lock) < 0) {
+		return -3;
+	}
+
+	if (condCreate(&cap->cond) < 0) {
+		goto fail_cond;
+	}
+
+	if (condCreate(&cap->irqcond) < 0) {
+		goto fail_irqcond;
+	}
+
+	/* Transfer Completed interrupt is still disabled, so the handler doesn't run yet */
+	if (interrupt(ecspi_intr_number[dev_no - 1], ecspi_irqHandlerCapture, cap, cap->irqcond, &cap->inth) < 0) {
+		goto fail_intr;
+	}
+
+	e->mode = mode_capture;
+	ecspi_setBurst(dev_no, len * 8);
+	cap->prev_wait_states = (*(e->base + periodreg) & 0x7FFF);
+	ecspi_setSSDelay(dev_no, wait_states);
+
+	/* One burst mode */
+	*(e->base + configreg) &= ~(0xF << 8);
+	/* Clear Transfer Completed bit. */
+	*(e->base + statreg) |= (1 << 7);
+	/* Enable Transfer Completed interrupt. */
+	*(e->base + intreg) |= (1 << 7);
+
+	writeFifo(dev_no, out, len);
+	*(e->base + conreg) |= (1 << 2);
+
+	return 0;
+
+fail_intr:
+	resourceDestroy(cap->irqcond);
+fail_irqcond:
+	resourceDestroy(cap->cond);
+fail_cond:
+	resourceDestroy(cap->lock);
+
+	return -3;
+}
+
+
+ecspi_capbuf_t *ecspi_captureWait(ecspi_capture_t *cap)
+{
+	ecspi_capbuf_t *buf = NULL;
+
+	mutexLock(cap->lock);
+	cap->waiting++;
+	for (;;) {
+		ecspi_captureStamp(cap);
+
+		if (cap->rd != cap->stamped || !cap->running || cap->stop) {
+			break;
+		}
+
+		condWait(cap->irqcond, cap->lock, 0);
+		ecspi_captureCheckEnd(cap);
+	}
+
+	/* Context goes away with ecspi_captureStop(), buffers aren't handed out any more */
+	if (cap->rd != cap->stamped && !cap->stop) {
+		buf = &cap->bufs[cap->rd % cap->n];
+	}
+
+	/* ecspi_captureStop() destroys the lock once no one waits */
+	if (--cap->waiting == 0 && cap->stop) {
+		condSignal(cap->cond);
+	}
+	mutexUnlock(cap->lock);
+
+	return buf;
+}
+
+
+void ecspi_captureRelease(ecspi_capture_t *cap)
+{
+	mutexLock(cap->lock);
+	if (cap->rd != cap->stamped) {
+		cap->rd++;
+	}
+	mutexUnlock(cap->lock);
+}
+
+
+int ecspi_captureStop(ecspi_capture_t *cap)
+{
+	mutexLock(cap->lock);
+	cap->stop = 1;
+	while (cap->running) {
+		condWait(cap->irqcond, cap->lock, 0);
+		ecspi_captureCheckEnd(cap);
+	}
+
+	/* Blocked consumer returns NULL */
+	while (cap->waiting != 0) {
+		condWait(cap->cond, cap->lock, 0);
+	}
+	mutexUnlock(cap->lock);
+
+	resourceDestroy(cap->inth);
+	resourceDestroy(cap->irqcond);
+	resourceDestroy(cap->cond);
+	resourceDestroy(cap->lock);
+
+	return 0;
+}
+
+
 addr_t ecspi_getTxFifoPAddr(int dev_no)
 {
 	return ecspi_addr[dev_no - 1] + txdata * 4;
@@ -677,3 +1332,88 @@ int ecspi_init(int dev_no, uint8_t chan_msk)
 
 	return 0;
 }
+
+
+int ecspi_initDma(int dev_no, const char *tx_dev, const char *rx_dev)
+{
+	ecspi_t *e;
+	ecspi_dma_t *dma;
+	sdma_channel_config_t cfg;
+	addr_t txbd_paddr, rxbd_paddr;
+
+	if (dev_no < 1 || dev_no > 4) {
+		return -1;
+	}
+
+	e = &ecspi[dev_no - 1];
+	if (e->base == NULL) {
+		return -1;
+	}
+
+	if (e->dma != NULL) {
+		return 0;
+	}
+
+	if ((dma = calloc(1, sizeof(ecspi_dma_t))) == NULL) {
+		return -2;
+	}
+
+	if (sdma_open(&dma->tx, tx_dev) < 0) {
+		printf("ecspi: could not open SDMA channels for ecspi%d.\n", dev_no);
+		free(dma);
+		return -3;
+	}
+
+	if (sdma_open(&dma->rx, rx_dev) < 0) {
+		printf("ecspi: could not open SDMA channels for ecspi%d.\n", dev_no);
+		sdma_close(&dma->tx);
+		free(dma);
+		return -3;
+	}
+
+	/* Each channel maps its descriptor array from a page boundary */
+	dma->txbd = sdma_alloc_uncached(&dma->tx, sizeof(sdma_buffer_desc_t), &txbd_paddr, 0);
+	dma->rxbd = sdma_alloc_uncached(&dma->rx, sizeof(sdma_buffer_desc_t), &rxbd_paddr, 0);
+	/* Buffers have to be physically contiguous */
+	dma->txbuf = sdma_alloc_uncached(&dma->tx, ECSPI_DMA_MAXLEN, &dma->txbuf_paddr, 1);
+	dma->rxbuf = sdma_alloc_uncached(&dma->rx, ECSPI_DMA_MAXLEN, &dma->rxbuf_paddr, 1);
+
+	if (dma->txbd == NULL || dma->rxbd == NULL || dma->txbuf == NULL || dma->rxbuf == NULL) {
+		printf("ecspi: could not allocate DMA buffers for ecspi%d.\n", dev_no);
+		goto fail;
+	}
+
+	cfg.bd_cnt = 1;
+	cfg.trig = sdma_trig__event;
+	cfg.priority = ECSPI_DMA_PRIORITY;
+
+	cfg.bd_paddr = txbd_paddr;
+	cfg.event = ecspi_dma_tx_event[dev_no - 1];
+	if (sdma_channel_configure(&dma->tx, &cfg) < 0) {
+		printf("ecspi: could not configure SDMA TX channel for ecspi%d.\n", dev_no);
+		goto fail;
+	}
+
+	cfg.bd_paddr = rxbd_paddr;
+	cfg.event = ecspi_dma_rx_event[dev_no - 1];
+	if (sdma_channel_configure(&dma->rx, &cfg) < 0) {
+		printf("ecspi: could not configure SDMA RX channel for ecspi%d.\n", dev_no);
+		goto fail;
+	}
+
+	e->dma = dma;
+
+	return 0;
+
+fail:
+	if (dma->txbd != NULL) sdma_free_uncached(dma->txbd, sizeof(sdma_buffer_desc_t));
+	if (dma->rxbd != NULL) sdma_free_uncached(dma->rxbd, sizeof(sdma_buffer_desc_t));
+	if (dma->txbuf != NULL) sdma_free_uncached(dma->txbuf, ECSPI_DMA_MAXLEN);
+	if (dma->rxbuf != NULL) sdma_free_uncached(dma->rxbuf, ECSPI_DMA_MAXLEN);
+	/* Closing the channels gives their OCRAM back to the SDMA server */
+	sdma_close(&dma->tx);
+	sdma_close(&dma->rx);
+	free(dma);
+
+	return -3;
+}